@@ -1,7 +1,15 @@
 #include "camera_util.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
 #include "esp_camera.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "img_converters.h"
 
 #define CAM_PIN_PWDN 32
 #define CAM_PIN_RESET -1 //software reset will be performed
@@ -21,6 +29,8 @@
 #define CAM_PIN_HREF 23
 #define CAM_PIN_PCLK 22
 
+#define WALL_CLOCK_VALID_AFTER 1577836800 // 2020-01-01, anything earlier means SNTP has not run yet
+
 static const char *TAG = "camera_util";
 
 static camera_config_t camera_config = {
@@ -57,6 +67,11 @@ static camera_config_t camera_config = {
 };
 
 static bool camera_initialized = false;
+static uint8_t jpeg_quality = 80;
+
+static camera_stats_t stats = { 0 };
+static int64_t last_capture_us = 0;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
 
 /**
  * @brief Initialize the camera.
@@ -98,6 +113,23 @@ esp_err_t camera_deinit(void)
     return ESP_OK;
 }
 
+/**
+ * @brief Convert an esp_timer timestamp to wall-clock time.
+ * 
+ * @param timer_us The esp_timer timestamp.
+ * @return int64_t Microseconds since the epoch, or 0 if the system time has not been set.
+ */
+static int64_t wall_time_from_timer(int64_t timer_us)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec < WALL_CLOCK_VALID_AFTER)
+    {
+        return 0;
+    }
+    return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec - (esp_timer_get_time() - timer_us);
+}
+
 /**
  * @brief Convert a frame buffer to JPEG format.
  * 
@@ -118,13 +150,30 @@ static bool convert_frame_to_jpeg(camera_fb_t *fb, uint8_t **jpg_buf, size_t *jp
 }
 
 /**
- * @brief Capture an image and convert it to JPEG format.
+ * @brief Set the quality used when converting frames to JPEG.
  * 
- * @param jpg_buf Pointer to the output JPEG buffer.
+ * @param quality JPEG quality (1-100).
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if quality is out of range.
+ */
+esp_err_t camera_set_jpeg_quality(uint8_t quality)
+{
+    if (quality < 1 || quality > 100)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    jpeg_quality = quality;
+    return ESP_OK;
+}
+
+/**
+ * @brief Capture an image, convert it to JPEG format and describe the frame.
+ * 
+ * @param jpg_buf Pointer to the output JPEG buffer. The caller frees it.
  * @param jpg_len Pointer to the length of the output JPEG buffer.
+ * @param info Receives the frame dimensions and capture time (optional).
  * @return esp_err_t ESP_OK on success, or an error code on failure.
  */
-esp_err_t camera_capture_jpeg(uint8_t **jpg_buf, size_t *jpg_len)
+esp_err_t camera_capture_jpeg_ex(uint8_t **jpg_buf, size_t *jpg_len, camera_frame_info_t *info)
 {
     esp_err_t err = camera_init();
     if (err != ESP_OK)
@@ -132,29 +181,223 @@ esp_err_t camera_capture_jpeg(uint8_t **jpg_buf, size_t *jpg_len)
         return err;
     }
 
-    ESP_LOGI(TAG, "Taking picture...");
+    ESP_LOGD(TAG, "Taking picture...");
     //gpio_set_level(GPIO_FLASH_PIN, 1);
     //vTaskDelay(100);
+    int64_t start_us = esp_timer_get_time();
     camera_fb_t *pic = esp_camera_fb_get();
+    int64_t end_us = esp_timer_get_time();
     //gpio_set_level(GPIO_FLASH_PIN, 0);
     if (!pic)
     {
+        portENTER_CRITICAL(&stats_lock);
+        stats.capture_failures++;
+        portEXIT_CRITICAL(&stats_lock);
         ESP_LOGE(TAG, "Failed to capture image");
         return ESP_FAIL;
     }
-    ESP_LOGI(TAG, "Picture taken...");
+    ESP_LOGD(TAG, "Picture taken...");
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.frames_captured++;
+    stats.capture_us_total += end_us - start_us;
+    if (last_capture_us > 0 && end_us > last_capture_us)
+    {
+        float fps = 1000000.0f / (end_us - last_capture_us);
+        stats.fps = stats.fps > 0 ? stats.fps * 0.9f + fps * 0.1f : fps;
+    }
+    last_capture_us = end_us;
+    portEXIT_CRITICAL(&stats_lock);
+
+    if (info)
+    {
+        info->width = pic->width;
+        info->height = pic->height;
+        info->timestamp_us = (int64_t)pic->timestamp.tv_sec * 1000000LL + pic->timestamp.tv_usec;
+        info->wall_time_us = wall_time_from_timer(info->timestamp_us);
+    }
 
     if(pic->format != PIXFORMAT_JPEG)
     {
-        if (!convert_frame_to_jpeg(pic, jpg_buf, jpg_len, 80))
+        start_us = esp_timer_get_time();
+        if (!convert_frame_to_jpeg(pic, jpg_buf, jpg_len, jpeg_quality))
         { 
             ESP_LOGE(TAG, "JPEG conversion failed"); 
             esp_camera_fb_return(pic); 
             return ESP_FAIL; 
         }
-        ESP_LOGI(TAG, "Picture converted to JPEG...");
+        end_us = esp_timer_get_time();
+        portENTER_CRITICAL(&stats_lock);
+        stats.conversions++;
+        stats.convert_us_total += end_us - start_us;
+        portEXIT_CRITICAL(&stats_lock);
+        ESP_LOGD(TAG, "Picture converted to JPEG...");
+    }
+    else
+    {
+        // The frame buffer goes back to the driver, so hand the caller its own copy
+        *jpg_buf = malloc(pic->len);
+        if (!*jpg_buf)
+        {
+            esp_camera_fb_return(pic);
+            return ESP_ERR_NO_MEM;
+        }
+        memcpy(*jpg_buf, pic->buf, pic->len);
+        *jpg_len = pic->len;
     }
 
     esp_camera_fb_return(pic);
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Capture an image and convert it to JPEG format.
+ * 
+ * @param jpg_buf Pointer to the output JPEG buffer.
+ * @param jpg_len Pointer to the length of the output JPEG buffer.
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t camera_capture_jpeg(uint8_t **jpg_buf, size_t *jpg_len)
+{
+    return camera_capture_jpeg_ex(jpg_buf, jpg_len, NULL);
+}
+
+/**
+ * @brief Get the capture statistics.
+ * 
+ * @param stats Receives the statistics.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if stats is NULL.
+ */
+esp_err_t camera_get_stats(camera_stats_t *out)
+{
+    if (!out)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_lock);
+    return ESP_OK;
+}
+
+/**
+ * @brief Read the dimensions from a JPEG's start-of-frame marker.
+ * 
+ * @param jpg The JPEG data.
+ * @param len Length of the JPEG data.
+ * @param width Receives the width in pixels.
+ * @param height Receives the height in pixels.
+ * @return true if a frame header was found, false otherwise.
+ */
+static bool jpeg_get_size(const uint8_t *jpg, size_t len, uint16_t *width, uint16_t *height)
+{
+    if (len < 4 || jpg[0] != 0xFF || jpg[1] != 0xD8)
+    {
+        return false;
+    }
+
+    size_t pos = 2;
+    while (pos + 4 <= len)
+    {
+        if (jpg[pos] != 0xFF)
+        {
+            return false;
+        }
+        uint8_t marker = jpg[pos + 1];
+        if (marker == 0xFF)
+        {
+            // Fill byte ahead of a marker
+            pos++;
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9)
+        {
+            // Image data or the end of the image before any frame header
+            return false;
+        }
+
+        size_t segment_len = ((size_t)jpg[pos + 2] << 8) | jpg[pos + 3];
+        // SOF0 to SOF15, except DHT, JPG and DAC which share the range
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            if (pos + 9 > len)
+            {
+                return false;
+            }
+            *height = ((uint16_t)jpg[pos + 5] << 8) | jpg[pos + 6];
+            *width = ((uint16_t)jpg[pos + 7] << 8) | jpg[pos + 8];
+            return *width > 0 && *height > 0;
+        }
+        pos += 2 + segment_len;
+    }
+    return false;
+}
+
+/**
+ * @brief Scale a JPEG down in the DCT domain and encode it again.
+ * 
+ * @param jpg The JPEG data.
+ * @param jpg_len Length of the JPEG data.
+ * @param min_width Smallest acceptable width in pixels, 0 for full size.
+ * @param quality JPEG quality of the result (1-100).
+ * @param out Receives the new JPEG. The caller frees it.
+ * @param out_len Receives the length of the new JPEG.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED if the image cannot be decoded, ESP_ERR_NO_MEM if there is not enough memory.
+ */
+esp_err_t camera_jpeg_downscale(const uint8_t *jpg, size_t jpg_len, uint16_t min_width, uint8_t quality,
+                                uint8_t **out, size_t *out_len)
+{
+    uint16_t width, height;
+
+    if (!jpg || !out || !out_len || quality < 1 || quality > 100)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!jpeg_get_size(jpg, jpg_len, &width, &height))
+    {
+        ESP_LOGE(TAG, "No JPEG frame header found");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // The decoder scales by 1/2, 1/4 or 1/8 while it dequantizes, which is almost free
+    jpg_scale_t scale = JPG_SCALE_NONE;
+    while (scale < JPG_SCALE_8X && min_width > 0 && (width >> (scale + 1)) >= min_width)
+    {
+        scale++;
+    }
+    uint16_t scaled_width = width >> scale;
+    uint16_t scaled_height = height >> scale;
+
+    size_t rgb_len = (size_t)scaled_width * scaled_height * 2;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!rgb)
+    {
+        rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_8BIT);
+    }
+    if (!rgb)
+    {
+        ESP_LOGE(TAG, "No memory to decode %ux%u image", scaled_width, scaled_height);
+        return ESP_ERR_NO_MEM;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err = ESP_OK;
+    if (!jpg2rgb565(jpg, jpg_len, rgb, scale))
+    {
+        ESP_LOGE(TAG, "Failed to decode JPEG");
+        err = ESP_ERR_NOT_SUPPORTED;
+    }
+    else if (!fmt2jpg(rgb, rgb_len, scaled_width, scaled_height, PIXFORMAT_RGB565, quality, out, out_len))
+    {
+        ESP_LOGE(TAG, "Failed to encode JPEG");
+        err = ESP_ERR_NO_MEM;
+    }
+    heap_caps_free(rgb);
+
+    if (err == ESP_OK)
+    {
+        ESP_LOGD(TAG, "Scaled %ux%u JPEG to %ux%u (%u -> %u bytes) in %lld us", width, height, scaled_width, scaled_height,
+                 (unsigned)jpg_len, (unsigned)*out_len, (long long)(esp_timer_get_time() - start_us));
+    }
+    return err;
+}
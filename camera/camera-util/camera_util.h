@@ -4,6 +4,28 @@
 #include "esp_err.h"
 #include "esp_camera.h"
 
+/**
+ * @brief Description of a captured frame.
+ */
+typedef struct {
+    uint16_t width;         /*!< Frame width in pixels */
+    uint16_t height;        /*!< Frame height in pixels */
+    int64_t timestamp_us;   /*!< Capture time reported by the camera driver (esp_timer clock) */
+    int64_t wall_time_us;   /*!< Capture time in microseconds since the epoch, 0 if the system time is not set */
+} camera_frame_info_t;
+
+/**
+ * @brief Capture statistics since boot.
+ */
+typedef struct {
+    uint32_t frames_captured;   /*!< Frames returned by the driver */
+    uint32_t capture_failures;  /*!< Captures that returned no frame */
+    uint64_t capture_us_total;  /*!< Time spent waiting for frames */
+    uint32_t conversions;       /*!< Frames converted to JPEG in software */
+    uint64_t convert_us_total;  /*!< Time spent converting frames */
+    float fps;                  /*!< Recent capture rate, smoothed */
+} camera_stats_t;
+
 /**
  * @brief Initialize the camera.
  * 
@@ -27,4 +49,47 @@ esp_err_t camera_deinit(void);
  */
 esp_err_t camera_capture_jpeg(uint8_t **jpg_buf, size_t *jpg_len);
 
+/**
+ * @brief Capture an image, convert it to JPEG format and describe the frame.
+ * 
+ * @param jpg_buf Pointer to the output JPEG buffer. The caller frees it.
+ * @param jpg_len Pointer to the length of the output JPEG buffer.
+ * @param info Receives the frame dimensions and capture time (optional).
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t camera_capture_jpeg_ex(uint8_t **jpg_buf, size_t *jpg_len, camera_frame_info_t *info);
+
+/**
+ * @brief Set the quality used when converting frames to JPEG.
+ * 
+ * @param quality JPEG quality (1-100).
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if quality is out of range.
+ */
+esp_err_t camera_set_jpeg_quality(uint8_t quality);
+
+/**
+ * @brief Get the capture statistics.
+ * 
+ * @param stats Receives the statistics.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if stats is NULL.
+ */
+esp_err_t camera_get_stats(camera_stats_t *stats);
+
+/**
+ * @brief Scale a JPEG down in the DCT domain and encode it again.
+ * 
+ * The image is decoded at the smallest of full, 1/2, 1/4 and 1/8 size that
+ * is still at least min_width pixels wide. Only baseline JPEGs can be decoded.
+ * 
+ * @param jpg The JPEG data.
+ * @param jpg_len Length of the JPEG data.
+ * @param min_width Smallest acceptable width in pixels, 0 for full size.
+ * @param quality JPEG quality of the result (1-100).
+ * @param out Receives the new JPEG. The caller frees it.
+ * @param out_len Receives the length of the new JPEG.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED if the image cannot be decoded, ESP_ERR_NO_MEM if there is not enough memory.
+ */
+esp_err_t camera_jpeg_downscale(const uint8_t *jpg, size_t jpg_len, uint16_t min_width, uint8_t quality,
+                                uint8_t **out, size_t *out_len);
+
 #endif // CAMERA_UTIL_H
\ No newline at end of file
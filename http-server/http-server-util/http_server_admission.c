@@ -0,0 +1,293 @@
+#include "http_server_admission.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <stdlib.h>
+#include <sys/param.h>
+
+static const char *TAG = "http_server_admission";
+
+/* Idle time a bucket is credited for at most, keeps the refill from overflowing */
+#define BUCKET_MAX_IDLE_US 10000000
+
+struct token_bucket {
+    int64_t tokens;             // bytes that may be sent, negative while in debt
+    int64_t last_us;
+    uint32_t rate;              // bytes per second, 0 for unlimited
+    uint32_t burst;
+};
+
+/**
+ * @brief What admission control knows about one client connection.
+ */
+struct conn {
+    int fd;                     // -1 for a free slot
+    int64_t last_active_us;     // when the last request on it started or ended
+    bool busy;                  // a request is in progress
+    bool stream;                // handed to the stream task
+    http_request_class_t cls;   // class of the request in progress
+    struct token_bucket bucket;
+};
+
+static struct {
+    portMUX_TYPE lock;
+    struct conn *conns;         // limits.max_open_sockets entries
+    admission_limits_t limits;
+    struct token_bucket transfer_bucket;
+    uint16_t open;
+    uint16_t streams;
+    uint16_t transfers;
+} adm = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+/* Called with adm.lock held */
+static struct conn *conn_find(int fd) {
+    for (uint16_t i = 0; i < adm.limits.max_open_sockets; i++) {
+        if (adm.conns[i].fd == fd) {
+            return &adm.conns[i];
+        }
+    }
+    return NULL;
+}
+
+static void bucket_reset(struct token_bucket *bucket, uint32_t rate, uint32_t burst, int64_t now) {
+    bucket->tokens = burst;
+    bucket->last_us = now;
+    bucket->rate = rate;
+    bucket->burst = burst;
+}
+
+static void bucket_refill(struct token_bucket *bucket, int64_t now) {
+    int64_t elapsed = MIN(now - bucket->last_us, BUCKET_MAX_IDLE_US);
+    bucket->last_us = now;
+    if (bucket->rate > 0) {
+        bucket->tokens = MIN(bucket->tokens + elapsed * bucket->rate / 1000000, (int64_t)bucket->burst);
+    }
+}
+
+/* Microseconds until the bucket is out of debt */
+static int64_t bucket_wait_us(const struct token_bucket *bucket) {
+    if (bucket->rate == 0 || bucket->tokens >= 0) {
+        return 0;
+    }
+    return -bucket->tokens * 1000000 / bucket->rate;
+}
+
+static void bucket_charge(struct token_bucket *bucket, size_t bytes) {
+    if (bucket->rate > 0) {
+        bucket->tokens -= bytes;
+    }
+}
+
+esp_err_t admission_init(const admission_limits_t *limits) {
+    if (adm.conns) {
+        return ESP_OK;
+    }
+
+    struct conn *conns = calloc(limits->max_open_sockets, sizeof(struct conn));
+    if (!conns) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint16_t i = 0; i < limits->max_open_sockets; i++) {
+        conns[i].fd = -1;
+    }
+
+    taskENTER_CRITICAL(&adm.lock);
+    adm.conns = conns;
+    adm.limits = *limits;
+    bucket_reset(&adm.transfer_bucket, limits->class_rate, limits->class_burst, esp_timer_get_time());
+    taskEXIT_CRITICAL(&adm.lock);
+
+    ESP_LOGI(TAG, "Admission: %u sockets, %u reserved for control, up to %u streams and %u transfers",
+             (unsigned)limits->max_open_sockets, (unsigned)limits->reserved_control,
+             (unsigned)limits->max_streams, (unsigned)limits->max_transfers);
+    if (limits->conn_rate || limits->class_rate || limits->class_rate_streaming) {
+        ESP_LOGI(TAG, "Transfer rates: %u B/s per connection, %u B/s in total, %u B/s in total while streaming",
+                 (unsigned)limits->conn_rate, (unsigned)limits->class_rate, (unsigned)limits->class_rate_streaming);
+    }
+    return ESP_OK;
+}
+
+void admission_deinit(void) {
+    taskENTER_CRITICAL(&adm.lock);
+    struct conn *conns = adm.conns;
+    adm.conns = NULL;
+    adm.open = 0;
+    adm.streams = 0;
+    adm.transfers = 0;
+    taskEXIT_CRITICAL(&adm.lock);
+    free(conns);
+}
+
+void admission_conn_open(httpd_handle_t hd, int sockfd) {
+    int victim_fd = -1;
+    int64_t now = esp_timer_get_time();
+
+    if (!adm.conns) {
+        return;
+    }
+
+    taskENTER_CRITICAL(&adm.lock);
+    struct conn *slot = conn_find(-1);
+    if (slot) {
+        slot->fd = sockfd;
+        slot->last_active_us = now;
+        slot->busy = false;
+        slot->stream = false;
+        slot->cls = HTTP_CLASS_CONTROL;
+        bucket_reset(&slot->bucket, adm.limits.conn_rate, adm.limits.conn_burst, now);
+        adm.open++;
+    }
+
+    // Keep one socket free, so a control client can still get in
+    if (adm.open >= adm.limits.max_open_sockets) {
+        struct conn *victim = NULL;
+        for (uint16_t i = 0; i < adm.limits.max_open_sockets; i++) {
+            struct conn *c = &adm.conns[i];
+            if (c->fd < 0 || c->fd == sockfd || c->busy || c->stream) {
+                continue;
+            }
+            if (!victim || c->last_active_us < victim->last_active_us) {
+                victim = c;
+            }
+        }
+        if (victim) {
+            victim_fd = victim->fd;
+        }
+    }
+    taskEXIT_CRITICAL(&adm.lock);
+
+    if (victim_fd >= 0) {
+        ESP_LOGD(TAG, "Closing idle connection %d to make room", victim_fd);
+        httpd_sess_trigger_close(hd, victim_fd);
+    }
+}
+
+void admission_conn_close(int sockfd) {
+    if (!adm.conns) {
+        return;
+    }
+
+    taskENTER_CRITICAL(&adm.lock);
+    struct conn *c = conn_find(sockfd);
+    if (c) {
+        if (c->stream) {
+            adm.streams--;
+        }
+        c->fd = -1;
+        adm.open--;
+    }
+    taskEXIT_CRITICAL(&adm.lock);
+}
+
+admission_result_t admission_begin(int sockfd, http_request_class_t cls) {
+    admission_result_t result = ADMISSION_OK;
+
+    if (!adm.conns) {
+        return ADMISSION_OK;
+    }
+
+    taskENTER_CRITICAL(&adm.lock);
+    struct conn *c = conn_find(sockfd);
+    if (cls != HTTP_CLASS_CONTROL) {
+        if (adm.streams + adm.transfers >= adm.limits.max_open_sockets - adm.limits.reserved_control) {
+            result = ADMISSION_RESERVED;
+        } else if (cls == HTTP_CLASS_STREAM && adm.streams >= adm.limits.max_streams) {
+            result = ADMISSION_CLASS_FULL;
+        } else if (cls == HTTP_CLASS_TRANSFER && adm.transfers >= adm.limits.max_transfers) {
+            result = ADMISSION_CLASS_FULL;
+        }
+    }
+    if (result == ADMISSION_OK) {
+        if (cls == HTTP_CLASS_TRANSFER) {
+            adm.transfers++;
+        } else if (cls == HTTP_CLASS_STREAM && c) {
+            // Counted until the connection closes, see admission_conn_close()
+            adm.streams++;
+            c->stream = true;
+        }
+        if (c) {
+            c->busy = true;
+            c->cls = cls;
+            c->last_active_us = esp_timer_get_time();
+        }
+    }
+    taskEXIT_CRITICAL(&adm.lock);
+    return result;
+}
+
+void admission_end(int sockfd, http_request_class_t cls, bool ok) {
+    if (!adm.conns) {
+        return;
+    }
+
+    taskENTER_CRITICAL(&adm.lock);
+    struct conn *c = conn_find(sockfd);
+    if (cls == HTTP_CLASS_TRANSFER) {
+        adm.transfers--;
+    }
+    if (c) {
+        if (cls == HTTP_CLASS_STREAM && !ok && c->stream) {
+            adm.streams--;
+            c->stream = false;
+        }
+        c->busy = false;
+        c->last_active_us = esp_timer_get_time();
+    }
+    taskEXIT_CRITICAL(&adm.lock);
+}
+
+void admission_stream_release(int sockfd) {
+    if (!adm.conns) {
+        return;
+    }
+
+    taskENTER_CRITICAL(&adm.lock);
+    struct conn *c = conn_find(sockfd);
+    if (c && c->stream) {
+        adm.streams--;
+        c->stream = false;
+    }
+    taskEXIT_CRITICAL(&adm.lock);
+}
+
+void admission_pace(int sockfd, size_t bytes) {
+    if (!adm.conns) {
+        return;
+    }
+
+    while (true) {
+        taskENTER_CRITICAL(&adm.lock);
+        struct conn *c = conn_find(sockfd);
+        if (!c || !c->busy || c->cls != HTTP_CLASS_TRANSFER) {
+            taskEXIT_CRITICAL(&adm.lock);
+            return;
+        }
+
+        // Streams take priority: while one is connected, transfers share the lower rate
+        uint32_t class_rate = adm.limits.class_rate;
+        if (adm.streams > 0 && adm.limits.class_rate_streaming > 0) {
+            class_rate = adm.limits.class_rate_streaming;
+        }
+
+        int64_t now = esp_timer_get_time();
+        bucket_refill(&c->bucket, now);
+        bucket_refill(&adm.transfer_bucket, now);
+        adm.transfer_bucket.rate = class_rate;
+        int64_t wait_us = MAX(bucket_wait_us(&c->bucket), bucket_wait_us(&adm.transfer_bucket));
+        if (wait_us == 0) {
+            bucket_charge(&c->bucket, bytes);
+            bucket_charge(&adm.transfer_bucket, bytes);
+        }
+        taskEXIT_CRITICAL(&adm.lock);
+
+        if (wait_us == 0) {
+            return;
+        }
+        vTaskDelay(MAX(pdMS_TO_TICKS(wait_us / 1000), 1));
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef HTTP_SERVER_ADMISSION_H
+#define HTTP_SERVER_ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_http_server.h>
+#include <esp_err.h>
+
+/**
+ * @brief Classes of requests with separate admission limits.
+ */
+typedef enum {
+    HTTP_CLASS_CONTROL,     /*!< Short requests that must stay reachable: delete, statistics, metrics */
+    HTTP_CLASS_TRANSFER,    /*!< File downloads, uploads, listings and archives */
+    HTTP_CLASS_STREAM,      /*!< Camera streams, which hold their socket until the client leaves */
+} http_request_class_t;
+
+/**
+ * @brief Why admission_begin() turned a request away.
+ */
+typedef enum {
+    ADMISSION_OK,
+    ADMISSION_CLASS_FULL,   /*!< The request's class is at its limit */
+    ADMISSION_RESERVED,     /*!< Only the sockets reserved for control requests are left */
+} admission_result_t;
+
+/**
+ * @brief Limits enforced by admission control.
+ *
+ * Rates are in bytes per second, 0 leaves the rate unlimited. Bursts are
+ * the bytes a bucket can save up while its connections are idle.
+ */
+typedef struct {
+    uint16_t max_open_sockets;      /*!< The server's socket limit */
+    uint16_t reserved_control;      /*!< Sockets that streams and transfers may not use */
+    uint16_t max_streams;           /*!< Concurrent streams allowed */
+    uint16_t max_transfers;         /*!< Concurrent transfers allowed */
+    uint32_t conn_rate;             /*!< Send rate of each transfer connection */
+    uint32_t conn_burst;
+    uint32_t class_rate;            /*!< Send rate of all transfers together */
+    uint32_t class_burst;
+    uint32_t class_rate_streaming;  /*!< Send rate of all transfers together while a stream is connected, 0 for class_rate */
+} admission_limits_t;
+
+/**
+ * @brief Set up admission control.
+ *
+ * @param limits The limits to enforce.
+ * @return esp_err_t ESP_OK on success, or ESP_ERR_NO_MEM on failure.
+ */
+esp_err_t admission_init(const admission_limits_t *limits);
+
+/**
+ * @brief Drop the connection table once the server has stopped, so the next start applies its own limits.
+ */
+void admission_deinit(void);
+
+/**
+ * @brief Track a new connection. Called from the server's open_fn.
+ *
+ * When this takes the last free socket, the least recently used idle
+ * keep-alive connection is closed so that another client can still connect.
+ * Streams and connections with a request in progress are never closed.
+ *
+ * @param hd The server handle.
+ * @param sockfd The new client socket.
+ */
+void admission_conn_open(httpd_handle_t hd, int sockfd);
+
+/**
+ * @brief Forget a connection. Called from the server's close_fn.
+ *
+ * @param sockfd The client socket.
+ */
+void admission_conn_close(int sockfd);
+
+/**
+ * @brief Admit a request or tell why it must be turned away.
+ *
+ * An admitted request must be finished with admission_end().
+ *
+ * @param sockfd The client socket.
+ * @param cls The request's class.
+ * @return admission_result_t ADMISSION_OK if the request may run.
+ */
+admission_result_t admission_begin(int sockfd, http_request_class_t cls);
+
+/**
+ * @brief Finish an admitted request.
+ *
+ * A stream that was handed to the stream task keeps its slot until its connection closes.
+ *
+ * @param sockfd The client socket.
+ * @param cls The request's class.
+ * @param ok Whether the handler succeeded.
+ */
+void admission_end(int sockfd, http_request_class_t cls, bool ok);
+
+/**
+ * @brief Give back the slot of an admitted stream that the handler turned away itself.
+ *
+ * The connection stays open for further requests, so admission_end() alone would
+ * leave the slot taken until it closes.
+ *
+ * @param sockfd The client socket.
+ */
+void admission_stream_release(int sockfd);
+
+/**
+ * @brief Wait until a transfer may send more data, then charge it for the bytes.
+ *
+ * Transfers draw from a bucket of their own and from one shared by all
+ * transfers. A bucket may go into debt by one send, which the next send
+ * waits out. Other classes are not paced.
+ *
+ * @param sockfd The client socket.
+ * @param bytes The number of bytes about to be sent.
+ */
+void admission_pace(int sockfd, size_t bytes);
+
+#endif // HTTP_SERVER_ADMISSION_H
@@ -0,0 +1,37 @@
+#include "http_server_assets.h"
+#include "sdkconfig.h"
+
+#include <string.h>
+
+#if CONFIG_HTTP_SERVER_ASSET_BUNDLE
+
+/* Generated into the build directory by tools/pack_assets.py */
+extern const http_asset_t http_assets[];
+extern const uint32_t http_asset_displacements[];
+extern const size_t http_asset_count;
+
+/* Seeded FNV-1a, must match fnv1a() in tools/pack_assets.py */
+static uint32_t asset_hash(uint32_t seed, const char *path) {
+    uint32_t hash = 2166136261u ^ seed;
+    while (*path) {
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+    return hash;
+}
+
+const http_asset_t *http_asset_find(const char *path) {
+    if (http_asset_count == 0) {
+        return NULL;
+    }
+    uint32_t displacement = http_asset_displacements[asset_hash(0, path) % http_asset_count];
+    const http_asset_t *asset = &http_assets[asset_hash(displacement, path) % http_asset_count];
+    return asset->path && strcmp(asset->path, path) == 0 ? asset : NULL;
+}
+
+#else // CONFIG_HTTP_SERVER_ASSET_BUNDLE
+
+const http_asset_t *http_asset_find(const char *path) {
+    return NULL;
+}
+
+#endif // CONFIG_HTTP_SERVER_ASSET_BUNDLE
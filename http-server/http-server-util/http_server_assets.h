@@ -0,0 +1,28 @@
+#ifndef HTTP_SERVER_ASSETS_H
+#define HTTP_SERVER_ASSETS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A web asset embedded in flash by tools/pack_assets.py.
+ */
+typedef struct {
+    const char *path;           // URI path, e.g. "/index.html"
+    const char *content_type;
+    const char *etag;           // strong ETag derived from the content
+    const uint8_t *data;        // payload, memory-mapped flash
+    uint32_t size;              // payload length
+    bool gzip;                  // payload is gzip-compressed
+} http_asset_t;
+
+/**
+ * @brief Find an embedded asset by its URI path.
+ *
+ * @param path The URI path, without query string.
+ * @return const http_asset_t* The asset, or NULL if it is not in the bundle or the bundle is disabled.
+ */
+const http_asset_t *http_asset_find(const char *path);
+
+#endif // HTTP_SERVER_ASSETS_H
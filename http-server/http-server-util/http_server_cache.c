@@ -0,0 +1,284 @@
+#include "http_server_cache.h"
+#include "http_server_util.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if CONFIG_HTTP_SERVER_FILE_CACHE
+
+static const char *TAG = "http_server_cache";
+
+#if CONFIG_HTTP_SERVER_FILE_CACHE_IN_PSRAM
+#define FILE_CACHE_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define FILE_CACHE_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+static struct {
+    SemaphoreHandle_t lock;
+    file_cache_entry_t *head;   // most recently used
+    file_cache_entry_t *tail;   // least recently used
+    size_t bytes_used;
+    size_t entries;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t invalidations;
+} cache = { 0 };
+
+static uint32_t path_hash(const char *path) {
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t entry_cost(const file_cache_entry_t *entry) {
+    return entry->hdr_len + entry->size;
+}
+
+static void entry_free(file_cache_entry_t *entry) {
+    heap_caps_free(entry->response);
+    free(entry->path);
+    free(entry);
+}
+
+static void lru_unlink(file_cache_entry_t *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache.head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache.tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_push_front(file_cache_entry_t *entry) {
+    entry->prev = NULL;
+    entry->next = cache.head;
+    if (cache.head) {
+        cache.head->prev = entry;
+    } else {
+        cache.tail = entry;
+    }
+    cache.head = entry;
+}
+
+/* Called with cache.lock held */
+static void entry_remove(file_cache_entry_t *entry) {
+    lru_unlink(entry);
+    cache.bytes_used -= entry_cost(entry);
+    cache.entries--;
+    entry->unlinked = true;
+    if (entry->refcount == 0) {
+        entry_free(entry);
+    }
+}
+
+static bool same_encoding(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/* Called with cache.lock held */
+static file_cache_entry_t *entry_find(const char *path, const char *encoding) {
+    uint32_t hash = path_hash(path);
+    for (file_cache_entry_t *entry = cache.head; entry; entry = entry->next) {
+        if (entry->path_hash == hash && same_encoding(entry->encoding, encoding) && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t file_cache_init(void) {
+    if (cache.lock) {
+        return ESP_OK;
+    }
+    cache.lock = xSemaphoreCreateMutex();
+    if (!cache.lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "File cache: %d bytes, files up to %d bytes",
+             CONFIG_HTTP_SERVER_FILE_CACHE_SIZE, CONFIG_HTTP_SERVER_FILE_CACHE_MAX_FILE_SIZE);
+    return ESP_OK;
+}
+
+bool file_cache_eligible(const struct stat *file_stat) {
+    return cache.lock && file_stat->st_size <= CONFIG_HTTP_SERVER_FILE_CACHE_MAX_FILE_SIZE;
+}
+
+file_cache_entry_t *file_cache_get(const char *path, const char *encoding, const struct stat *file_stat) {
+    if (!cache.lock) {
+        return NULL;
+    }
+
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    file_cache_entry_t *entry = entry_find(path, encoding);
+    if (entry && (entry->size != file_stat->st_size || entry->mtime != file_stat->st_mtime || entry->ino != file_stat->st_ino)) {
+        ESP_LOGD(TAG, "Stale entry : %s", path);
+        cache.invalidations++;
+        entry_remove(entry);
+        entry = NULL;
+    }
+    if (entry) {
+        lru_unlink(entry);
+        lru_push_front(entry);
+        entry->refcount++;
+        cache.hits++;
+    } else {
+        cache.misses++;
+    }
+    xSemaphoreGive(cache.lock);
+    return entry;
+}
+
+file_cache_entry_t *file_cache_fill(const char *path, const char *encoding, const struct stat *file_stat,
+                                    const char *hdr, size_t hdr_len) {
+    size_t cost = hdr_len + file_stat->st_size;
+    if (!file_cache_eligible(file_stat) || cost > CONFIG_HTTP_SERVER_FILE_CACHE_SIZE) {
+        return NULL;
+    }
+
+    file_cache_entry_t *entry = calloc(1, sizeof(file_cache_entry_t));
+    if (!entry) {
+        return NULL;
+    }
+    entry->path = strdup(path);
+    entry->response = heap_caps_malloc(cost, FILE_CACHE_CAPS);
+    if (!entry->path || !entry->response) {
+        entry_free(entry);
+        return NULL;
+    }
+    entry->path_hash = path_hash(path);
+    entry->encoding = encoding;
+    entry->size = file_stat->st_size;
+    entry->mtime = file_stat->st_mtime;
+    entry->ino = file_stat->st_ino;
+    entry->hdr_len = hdr_len;
+    memcpy(entry->response, hdr, hdr_len);
+
+    FILE *fd = fopen(path, "r");
+    if (!fd) {
+        entry_free(entry);
+        return NULL;
+    }
+    size_t read = fread(entry->response + hdr_len, 1, entry->size, fd);
+    fclose(fd);
+    if (read != (size_t)entry->size) {
+        ESP_LOGW(TAG, "Short read caching %s", path);
+        entry_free(entry);
+        return NULL;
+    }
+
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    file_cache_entry_t *existing = entry_find(path, encoding);
+    if (existing) {
+        entry_remove(existing);
+    }
+    for (file_cache_entry_t *victim = cache.tail; victim && cache.bytes_used + cost > CONFIG_HTTP_SERVER_FILE_CACHE_SIZE;) {
+        file_cache_entry_t *prev = victim->prev;
+        entry_remove(victim);
+        cache.evictions++;
+        victim = prev;
+    }
+    lru_push_front(entry);
+    cache.bytes_used += cost;
+    cache.entries++;
+    entry->refcount = 1;
+    xSemaphoreGive(cache.lock);
+
+    ESP_LOGD(TAG, "Cached %s (%ld bytes)", path, (long)entry->size);
+    return entry;
+}
+
+void file_cache_release(file_cache_entry_t *entry) {
+    if (!entry) {
+        return;
+    }
+
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    if (--entry->refcount == 0 && entry->unlinked) {
+        entry_free(entry);
+    }
+    xSemaphoreGive(cache.lock);
+}
+
+void file_cache_invalidate(const char *path) {
+    if (!cache.lock) {
+        return;
+    }
+
+    uint32_t hash = path_hash(path);
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    for (file_cache_entry_t *entry = cache.head; entry;) {
+        file_cache_entry_t *next = entry->next;
+        if (entry->path_hash == hash && strcmp(entry->path, path) == 0) {
+            cache.invalidations++;
+            entry_remove(entry);
+        }
+        entry = next;
+    }
+    xSemaphoreGive(cache.lock);
+}
+
+esp_err_t http_server_get_file_cache_stats(http_file_cache_stats_t *stats) {
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!cache.lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->evictions = cache.evictions;
+    stats->invalidations = cache.invalidations;
+    stats->bytes_used = cache.bytes_used;
+    stats->entries = cache.entries;
+    xSemaphoreGive(cache.lock);
+    return ESP_OK;
+}
+
+#else // CONFIG_HTTP_SERVER_FILE_CACHE
+
+esp_err_t file_cache_init(void) {
+    return ESP_OK;
+}
+
+bool file_cache_eligible(const struct stat *file_stat) {
+    return false;
+}
+
+file_cache_entry_t *file_cache_get(const char *path, const char *encoding, const struct stat *file_stat) {
+    return NULL;
+}
+
+file_cache_entry_t *file_cache_fill(const char *path, const char *encoding, const struct stat *file_stat,
+                                    const char *hdr, size_t hdr_len) {
+    return NULL;
+}
+
+void file_cache_release(file_cache_entry_t *entry) {
+}
+
+void file_cache_invalidate(const char *path) {
+}
+
+esp_err_t http_server_get_file_cache_stats(http_file_cache_stats_t *stats) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif // CONFIG_HTTP_SERVER_FILE_CACHE
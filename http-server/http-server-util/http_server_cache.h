@@ -0,0 +1,85 @@
+#ifndef HTTP_SERVER_CACHE_H
+#define HTTP_SERVER_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include <esp_err.h>
+
+/**
+ * @brief A cached file: a complete 200 response, header block followed by the body.
+ */
+typedef struct file_cache_entry {
+    struct file_cache_entry *prev;  // LRU list, most recently used first
+    struct file_cache_entry *next;
+    char *path;
+    uint32_t path_hash;
+    const char *encoding;           // Content-Encoding the body was stored for, NULL for none
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    uint32_t refcount;
+    bool unlinked;                  // evicted or invalidated, freed once the last reader releases it
+    size_t hdr_len;
+    char *response;                 // hdr_len bytes of headers, then size bytes of body
+} file_cache_entry_t;
+
+/**
+ * @brief Set up the file cache. Does nothing when the cache is disabled in Kconfig.
+ *
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t file_cache_init(void);
+
+/**
+ * @brief Check whether a file is small enough to be cached.
+ *
+ * @param file_stat The file's metadata.
+ * @return true if the file may be cached.
+ */
+bool file_cache_eligible(const struct stat *file_stat);
+
+/**
+ * @brief Look up a file that is still current on disk.
+ *
+ * A precompressed file is cached once as itself and once as the negotiated
+ * encoding of its original, with different headers, so both the path and the
+ * encoding select the entry. An entry whose size, mtime or inode no longer
+ * match is dropped.
+ *
+ * @param path The file path.
+ * @param encoding The Content-Encoding it is sent with, NULL for none.
+ * @param file_stat The file's current metadata.
+ * @return file_cache_entry_t* A referenced entry to release with file_cache_release(), or NULL on a miss.
+ */
+file_cache_entry_t *file_cache_get(const char *path, const char *encoding, const struct stat *file_stat);
+
+/**
+ * @brief Read a file into a new cache entry.
+ *
+ * @param path The file path.
+ * @param encoding The Content-Encoding named in hdr, NULL for none. Must stay valid for the life of the cache.
+ * @param file_stat The file's metadata.
+ * @param hdr The response header block to store ahead of the body.
+ * @param hdr_len Length of hdr.
+ * @return file_cache_entry_t* A referenced entry to release with file_cache_release(), or NULL if the file could not be cached.
+ */
+file_cache_entry_t *file_cache_fill(const char *path, const char *encoding, const struct stat *file_stat,
+                                    const char *hdr, size_t hdr_len);
+
+/**
+ * @brief Drop a reference taken by file_cache_get() or file_cache_fill().
+ *
+ * @param entry The entry.
+ */
+void file_cache_release(file_cache_entry_t *entry);
+
+/**
+ * @brief Drop a file from the cache, all its encodings, e.g. after it was deleted or overwritten.
+ *
+ * @param path The file path.
+ */
+void file_cache_invalidate(const char *path);
+
+#endif // HTTP_SERVER_CACHE_H
@@ -0,0 +1,306 @@
+#include "http_server_metrics.h"
+#include "http_server_util.h"
+#include "camera_util.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Counters live in one slot per core and are only ever added to with
+ * relaxed 32-bit atomics, which stay within the core's cache and never take
+ * a lock. A scrape sums the slots. 64-bit totals are kept as two halves: the
+ * high half is bumped when the low half wraps, and readers retry if it
+ * changed while they read.
+ */
+
+#define LATENCY_BUCKET_COUNT (sizeof(latency_bounds_us) / sizeof(latency_bounds_us[0]))
+
+static const uint32_t latency_bounds_us[] = {
+    1000, 5000, 10000, 25000, 50000, 100000, 250000, 1000000, 5000000,
+};
+
+static const char *const route_names[HTTP_ROUTE_COUNT] = {
+    [HTTP_ROUTE_FILE] = "file",
+    [HTTP_ROUTE_UPLOAD] = "upload",
+    [HTTP_ROUTE_DELETE] = "delete",
+    [HTTP_ROUTE_LIST] = "list",
+    [HTTP_ROUTE_ARCHIVE] = "archive",
+    [HTTP_ROUTE_IMAGE] = "img",
+    [HTTP_ROUTE_SNAPSHOT] = "snapshot",
+    [HTTP_ROUTE_STREAM] = "stream",
+    [HTTP_ROUTE_WS] = "ws",
+    [HTTP_ROUTE_STATS] = "stream_stats",
+    [HTTP_ROUTE_METRICS] = "metrics",
+};
+
+typedef struct {
+    uint32_t lo;
+    uint32_t hi;
+} metric_u64_t;
+
+struct metrics_slot {
+    uint32_t requests[HTTP_ROUTE_COUNT];
+    uint32_t latency_buckets[HTTP_ROUTE_COUNT][LATENCY_BUCKET_COUNT + 1];  // last one is +Inf
+    metric_u64_t latency_us_sum[HTTP_ROUTE_COUNT];
+    metric_u64_t bytes_sent;
+    metric_u64_t storage_read_bytes;
+    metric_u64_t storage_read_us;
+    metric_u64_t storage_write_bytes;
+    metric_u64_t storage_write_us;
+    uint32_t tls_handshake_buckets[LATENCY_BUCKET_COUNT + 1];
+    metric_u64_t tls_handshake_us_sum;
+    uint32_t tls_handshake_failures;
+};
+
+static struct metrics_slot slots[portNUM_PROCESSORS];
+
+static inline struct metrics_slot *this_core_slot(void) {
+    // A task that migrates right after this only makes two cores share a slot for one update
+    return &slots[xPortGetCoreID()];
+}
+
+static inline void counter_add(uint32_t *counter, uint32_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void counter64_add(metric_u64_t *counter, uint64_t value) {
+    while (value > 0) {
+        uint32_t part = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+        uint32_t old = __atomic_fetch_add(&counter->lo, part, __ATOMIC_RELAXED);
+        if ((uint32_t)(old + part) < old) {
+            __atomic_fetch_add(&counter->hi, 1, __ATOMIC_RELAXED);
+        }
+        value -= part;
+    }
+}
+
+static uint64_t counter64_read(const metric_u64_t *counter) {
+    uint32_t hi, lo;
+    do {
+        hi = __atomic_load_n(&counter->hi, __ATOMIC_RELAXED);
+        lo = __atomic_load_n(&counter->lo, __ATOMIC_RELAXED);
+    } while (hi != __atomic_load_n(&counter->hi, __ATOMIC_RELAXED));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t sum32(size_t offset) {
+    uint64_t total = 0;
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        total += __atomic_load_n((const uint32_t *)((const char *)&slots[i] + offset), __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+static uint64_t sum64(size_t offset) {
+    uint64_t total = 0;
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        total += counter64_read((const metric_u64_t *)((const char *)&slots[i] + offset));
+    }
+    return total;
+}
+
+#define SUM32(field) sum32(offsetof(struct metrics_slot, field))
+#define SUM64(field) sum64(offsetof(struct metrics_slot, field))
+
+static size_t latency_bucket(int64_t latency_us) {
+    size_t bucket = 0;
+    while (bucket < LATENCY_BUCKET_COUNT && (uint64_t)latency_us > latency_bounds_us[bucket]) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void http_metrics_record_request(http_route_t route, int64_t latency_us) {
+    if (route >= HTTP_ROUTE_COUNT) {
+        return;
+    }
+    if (latency_us < 0) {
+        latency_us = 0;
+    }
+
+    size_t bucket = latency_bucket(latency_us);
+
+    struct metrics_slot *slot = this_core_slot();
+    counter_add(&slot->requests[route], 1);
+    counter_add(&slot->latency_buckets[route][bucket], 1);
+    counter64_add(&slot->latency_us_sum[route], latency_us);
+}
+
+void http_metrics_record_tls_handshake(bool ok, int64_t elapsed_us) {
+    struct metrics_slot *slot = this_core_slot();
+    if (!ok) {
+        counter_add(&slot->tls_handshake_failures, 1);
+        return;
+    }
+    if (elapsed_us < 0) {
+        elapsed_us = 0;
+    }
+    counter_add(&slot->tls_handshake_buckets[latency_bucket(elapsed_us)], 1);
+    counter64_add(&slot->tls_handshake_us_sum, elapsed_us);
+}
+
+void http_metrics_add_bytes_sent(size_t bytes) {
+    counter64_add(&this_core_slot()->bytes_sent, bytes);
+}
+
+void http_metrics_add_storage_read(size_t bytes, int64_t elapsed_us) {
+    struct metrics_slot *slot = this_core_slot();
+    counter64_add(&slot->storage_read_bytes, bytes);
+    counter64_add(&slot->storage_read_us, elapsed_us > 0 ? elapsed_us : 0);
+}
+
+void http_metrics_add_storage_write(size_t bytes, int64_t elapsed_us) {
+    struct metrics_slot *slot = this_core_slot();
+    counter64_add(&slot->storage_write_bytes, bytes);
+    counter64_add(&slot->storage_write_us, elapsed_us > 0 ? elapsed_us : 0);
+}
+
+static void write_metric_header(resp_writer_t *w, const char *name, const char *type, const char *help) {
+    resp_writer_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Write one histogram from per-bucket counts; Prometheus buckets are cumulative */
+static void write_histogram(resp_writer_t *w, const char *name, const char *labels, const uint64_t *buckets, uint64_t sum_us) {
+    const char *sep = *labels ? "," : "";
+    uint64_t cumulative = 0;
+
+    for (size_t b = 0; b <= LATENCY_BUCKET_COUNT; b++) {
+        cumulative += buckets[b];
+        if (b < LATENCY_BUCKET_COUNT) {
+            resp_writer_printf(w, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels, sep, latency_bounds_us[b] / 1e6, cumulative);
+        } else {
+            resp_writer_printf(w, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, cumulative);
+        }
+    }
+    const char *lbrace = *labels ? "{" : "";
+    const char *rbrace = *labels ? "}" : "";
+    resp_writer_printf(w, "%s_sum%s%s%s %.6f\n", name, lbrace, labels, rbrace, sum_us / 1e6);
+    resp_writer_printf(w, "%s_count%s%s%s %" PRIu64 "\n", name, lbrace, labels, rbrace, cumulative);
+}
+
+static void write_request_metrics(resp_writer_t *w) {
+    write_metric_header(w, "http_requests_total", "counter", "Requests handled, by route.");
+    for (int r = 0; r < HTTP_ROUTE_COUNT; r++) {
+        resp_writer_printf(w, "http_requests_total{route=\"%s\"} %" PRIu64 "\n", route_names[r], SUM32(requests[r]));
+    }
+
+    write_metric_header(w, "http_request_duration_seconds", "histogram", "Handler latency, by route.");
+    for (int r = 0; r < HTTP_ROUTE_COUNT; r++) {
+        uint64_t buckets[LATENCY_BUCKET_COUNT + 1];
+        for (size_t b = 0; b <= LATENCY_BUCKET_COUNT; b++) {
+            buckets[b] = SUM32(latency_buckets[r][b]);
+        }
+        char labels[32];
+        snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[r]);
+        write_histogram(w, "http_request_duration_seconds", labels, buckets, SUM64(latency_us_sum[r]));
+    }
+
+    write_metric_header(w, "http_sent_bytes_total", "counter", "Bytes written to client sockets.");
+    resp_writer_printf(w, "http_sent_bytes_total %" PRIu64 "\n", SUM64(bytes_sent));
+}
+
+static void write_tls_metrics(resp_writer_t *w) {
+#if CONFIG_HTTP_SERVER_HTTPS
+    uint64_t buckets[LATENCY_BUCKET_COUNT + 1];
+    for (size_t b = 0; b <= LATENCY_BUCKET_COUNT; b++) {
+        buckets[b] = SUM32(tls_handshake_buckets[b]);
+    }
+    write_metric_header(w, "tls_handshake_duration_seconds", "histogram", "Duration of successful TLS handshakes; resumed sessions fall in the low buckets.");
+    write_histogram(w, "tls_handshake_duration_seconds", "", buckets, SUM64(tls_handshake_us_sum));
+    write_metric_header(w, "tls_handshake_failures_total", "counter", "TLS handshakes that failed.");
+    resp_writer_printf(w, "tls_handshake_failures_total %" PRIu64 "\n", SUM32(tls_handshake_failures));
+#endif
+}
+
+static void write_stream_metrics(resp_writer_t *w) {
+    http_stream_client_stats_t stats[CONFIG_HTTP_SERVER_STREAM_MAX_CLIENTS];
+    size_t count = 0;
+    uint64_t dropped = 0;
+
+    if (http_server_get_stream_stats(stats, CONFIG_HTTP_SERVER_STREAM_MAX_CLIENTS, &count) != ESP_OK) {
+        count = 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        dropped += stats[i].frames_dropped;
+    }
+
+    write_metric_header(w, "http_stream_clients", "gauge", "Connected camera stream clients.");
+    resp_writer_printf(w, "http_stream_clients %u\n", (unsigned)count);
+    write_metric_header(w, "http_stream_dropped_frames", "gauge", "Frames dropped for slow clients, summed over connected clients.");
+    resp_writer_printf(w, "http_stream_dropped_frames %" PRIu64 "\n", dropped);
+}
+
+static void write_cache_metrics(resp_writer_t *w) {
+    http_file_cache_stats_t cache;
+    if (http_server_get_file_cache_stats(&cache) != ESP_OK) {
+        return;
+    }
+
+    write_metric_header(w, "http_file_cache_hits_total", "counter", "Files served from the RAM cache.");
+    resp_writer_printf(w, "http_file_cache_hits_total %" PRIu32 "\n", cache.hits);
+    write_metric_header(w, "http_file_cache_misses_total", "counter", "Cacheable files not found in the RAM cache.");
+    resp_writer_printf(w, "http_file_cache_misses_total %" PRIu32 "\n", cache.misses);
+    write_metric_header(w, "http_file_cache_bytes", "gauge", "Bytes held by the RAM file cache.");
+    resp_writer_printf(w, "http_file_cache_bytes %u\n", (unsigned)cache.bytes_used);
+}
+
+static void write_camera_metrics(resp_writer_t *w) {
+    camera_stats_t cam;
+    if (camera_get_stats(&cam) != ESP_OK) {
+        return;
+    }
+
+    write_metric_header(w, "camera_frames_total", "counter", "Frames captured.");
+    resp_writer_printf(w, "camera_frames_total %" PRIu32 "\n", cam.frames_captured);
+    write_metric_header(w, "camera_capture_failures_total", "counter", "Captures that returned no frame.");
+    resp_writer_printf(w, "camera_capture_failures_total %" PRIu32 "\n", cam.capture_failures);
+    write_metric_header(w, "camera_fps", "gauge", "Recent capture rate.");
+    resp_writer_printf(w, "camera_fps %.2f\n", cam.fps);
+    write_metric_header(w, "camera_capture_seconds", "summary", "Time spent waiting for frames.");
+    resp_writer_printf(w, "camera_capture_seconds_sum %.6f\ncamera_capture_seconds_count %" PRIu32 "\n",
+                       cam.capture_us_total / 1e6, cam.frames_captured);
+    write_metric_header(w, "camera_convert_seconds", "summary", "Time spent converting frames to JPEG.");
+    resp_writer_printf(w, "camera_convert_seconds_sum %.6f\ncamera_convert_seconds_count %" PRIu32 "\n",
+                       cam.convert_us_total / 1e6, cam.conversions);
+}
+
+static void write_system_metrics(resp_writer_t *w) {
+#if !CONFIG_IDF_TARGET_LINUX
+    // The host build allocates from the C library, which has no per-type heap statistics
+    write_metric_header(w, "heap_free_bytes", "gauge", "Free heap, by memory type.");
+    resp_writer_printf(w, "heap_free_bytes{type=\"internal\"} %u\n", (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    resp_writer_printf(w, "heap_free_bytes{type=\"psram\"} %u\n", (unsigned)heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    write_metric_header(w, "heap_min_free_bytes", "gauge", "Lowest free heap since boot, by memory type.");
+    resp_writer_printf(w, "heap_min_free_bytes{type=\"internal\"} %u\n", (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    resp_writer_printf(w, "heap_min_free_bytes{type=\"psram\"} %u\n", (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+#endif
+
+    write_metric_header(w, "storage_read_bytes_total", "counter", "Bytes read from storage by the server.");
+    resp_writer_printf(w, "storage_read_bytes_total %" PRIu64 "\n", SUM64(storage_read_bytes));
+    write_metric_header(w, "storage_read_seconds_total", "counter", "Time spent in storage reads.");
+    resp_writer_printf(w, "storage_read_seconds_total %.6f\n", SUM64(storage_read_us) / 1e6);
+    write_metric_header(w, "storage_write_bytes_total", "counter", "Bytes written to storage by the server.");
+    resp_writer_printf(w, "storage_write_bytes_total %" PRIu64 "\n", SUM64(storage_write_bytes));
+    write_metric_header(w, "storage_write_seconds_total", "counter", "Time spent in storage writes.");
+    resp_writer_printf(w, "storage_write_seconds_total %.6f\n", SUM64(storage_write_us) / 1e6);
+
+    write_metric_header(w, "uptime_seconds", "gauge", "Time since boot.");
+    resp_writer_printf(w, "uptime_seconds %" PRId64 "\n", esp_timer_get_time() / 1000000);
+}
+
+esp_err_t http_metrics_write(resp_writer_t *w) {
+    write_request_metrics(w);
+    write_tls_metrics(w);
+    write_stream_metrics(w);
+    write_cache_metrics(w);
+    write_camera_metrics(w);
+    write_system_metrics(w);
+    return w->err;
+}
@@ -0,0 +1,72 @@
+#ifndef HTTP_SERVER_METRICS_H
+#define HTTP_SERVER_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "http_server_writer.h"
+
+/**
+ * @brief Routes that requests are counted and timed under.
+ */
+typedef enum {
+    HTTP_ROUTE_FILE,
+    HTTP_ROUTE_UPLOAD,
+    HTTP_ROUTE_DELETE,
+    HTTP_ROUTE_LIST,
+    HTTP_ROUTE_ARCHIVE,
+    HTTP_ROUTE_IMAGE,
+    HTTP_ROUTE_SNAPSHOT,
+    HTTP_ROUTE_STREAM,
+    HTTP_ROUTE_WS,
+    HTTP_ROUTE_STATS,
+    HTTP_ROUTE_METRICS,
+    HTTP_ROUTE_COUNT,
+} http_route_t;
+
+/**
+ * @brief Count a completed request and add its latency to the route's histogram.
+ *
+ * @param route The route that handled the request.
+ * @param latency_us Time from the start of the handler to its completion.
+ */
+void http_metrics_record_request(http_route_t route, int64_t latency_us);
+
+/**
+ * @brief Count bytes written to client sockets.
+ */
+void http_metrics_add_bytes_sent(size_t bytes);
+
+/**
+ * @brief Count bytes read from storage and the time the reads took.
+ */
+void http_metrics_add_storage_read(size_t bytes, int64_t elapsed_us);
+
+/**
+ * @brief Count bytes written to storage and the time the writes took.
+ */
+void http_metrics_add_storage_write(size_t bytes, int64_t elapsed_us);
+
+/**
+ * @brief Count a TLS handshake and add its duration to the handshake histogram.
+ *
+ * @param ok Whether the handshake succeeded.
+ * @param elapsed_us Duration of the handshake.
+ */
+void http_metrics_record_tls_handshake(bool ok, int64_t elapsed_us);
+
+/**
+ * @brief Write all metrics in the Prometheus text exposition format.
+ *
+ * Includes the server's counters, stream and file cache statistics, camera
+ * statistics and heap usage.
+ *
+ * @param w The writer to append to.
+ * @return esp_err_t ESP_OK on success, or the writer's error.
+ */
+esp_err_t http_metrics_write(resp_writer_t *w);
+
+#endif // HTTP_SERVER_METRICS_H
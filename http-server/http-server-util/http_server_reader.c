@@ -0,0 +1,172 @@
+#include "http_server_reader.h"
+#include "http_server_metrics.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+static const char *TAG = "http_server_reader";
+
+#define READER_QUEUE_LEN 8
+
+/**
+ * @brief One read() performed by the reader task on behalf of a stream.
+ */
+struct read_job {
+    int fd;
+    char *buf;
+    size_t len;
+    ssize_t result;
+    SemaphoreHandle_t done;
+};
+
+/* read() that counts towards the storage metrics */
+static ssize_t storage_read(int fd, void *buf, size_t len) {
+    int64_t start = esp_timer_get_time();
+    ssize_t n = read(fd, buf, len);
+    if (n > 0) {
+        http_metrics_add_storage_read(n, esp_timer_get_time() - start);
+    }
+    return n;
+}
+
+#if CONFIG_HTTP_SERVER_READAHEAD
+static QueueHandle_t read_queue = NULL;
+
+/*
+ * A single task serves all streams. Reads are queued in order, and the
+ * storage device handles one transfer at a time anyway.
+ */
+static void file_reader_task(void *p) {
+    struct read_job *job;
+    while (true) {
+        if (xQueueReceive(read_queue, &job, portMAX_DELAY) == pdTRUE) {
+            job->result = storage_read(job->fd, job->buf, job->len);
+            xSemaphoreGive(job->done);
+        }
+    }
+}
+
+esp_err_t file_reader_start(void) {
+    if (read_queue) {
+        return ESP_OK;
+    }
+
+    read_queue = xQueueCreate(READER_QUEUE_LEN, sizeof(struct read_job *));
+    if (!read_queue) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(file_reader_task, "http_reader", CONFIG_HTTP_SERVER_READER_TASK_STACK_SIZE, NULL,
+                    CONFIG_HTTP_SERVER_READER_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start reader task");
+        vQueueDelete(read_queue);
+        read_queue = NULL;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* Hand a read to the reader task, or perform it right away if its queue is full */
+static void read_job_submit(struct read_job *job) {
+    if (xQueueSend(read_queue, &job, 0) != pdTRUE) {
+        job->result = storage_read(job->fd, job->buf, job->len);
+        xSemaphoreGive(job->done);
+    }
+}
+#else // CONFIG_HTTP_SERVER_READAHEAD
+
+esp_err_t file_reader_start(void) {
+    return ESP_OK;
+}
+#endif // CONFIG_HTTP_SERVER_READAHEAD
+
+/**
+ * @brief Length of the next read: a whole number of clusters, ending on a cluster boundary.
+ */
+static size_t aligned_read_len(off_t pos, off_t remaining, size_t blksize, size_t bufsize) {
+    size_t len = bufsize;
+    if (blksize > 0 && blksize <= bufsize) {
+        len = bufsize - bufsize % blksize;
+        len -= pos % blksize;
+    }
+    return MIN((off_t)len, remaining);
+}
+
+static esp_err_t stream_sync(int fd, off_t pos, off_t remaining, size_t blksize, char *buf, size_t bufsize,
+                             file_reader_sink_t sink, void *ctx) {
+    while (remaining > 0) {
+        ssize_t n = storage_read(fd, buf, aligned_read_len(pos, remaining, blksize, bufsize));
+        if (n <= 0) {
+            return ESP_FAIL;
+        }
+        esp_err_t err = sink(ctx, buf, n);
+        if (err != ESP_OK) {
+            return err;
+        }
+        pos += n;
+        remaining -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t file_reader_stream(int fd, off_t offset, off_t length, size_t blksize, char *bufs[2], size_t bufsize,
+                             file_reader_sink_t sink, void *ctx) {
+#if CONFIG_HTTP_SERVER_READAHEAD
+    if (!read_queue || !bufs[1] || length <= (off_t)bufsize) {
+        return stream_sync(fd, offset, length, blksize, bufs[0], bufsize, sink, ctx);
+    }
+
+    // Only one read is ever in flight, so both jobs share the semaphore
+    StaticSemaphore_t done_storage;
+    SemaphoreHandle_t done = xSemaphoreCreateBinaryStatic(&done_storage);
+    struct read_job jobs[2] = {
+        { .fd = fd, .buf = bufs[0], .done = done },
+        { .fd = fd, .buf = bufs[1], .done = done },
+    };
+    off_t pos = offset;
+    off_t remaining = length;
+    int cur = 0;
+    esp_err_t err = ESP_OK;
+
+    jobs[cur].len = aligned_read_len(pos, remaining, blksize, bufsize);
+    read_job_submit(&jobs[cur]);
+    while (true) {
+        xSemaphoreTake(done, portMAX_DELAY);
+        ssize_t n = jobs[cur].result;
+        if (n <= 0) {
+            err = ESP_FAIL;
+            break;
+        }
+        pos += n;
+        remaining -= n;
+
+        // Start reading the next buffer before this one goes out
+        bool more = remaining > 0;
+        if (more) {
+            jobs[!cur].len = aligned_read_len(pos, remaining, blksize, bufsize);
+            read_job_submit(&jobs[!cur]);
+        }
+        err = sink(ctx, jobs[cur].buf, n);
+        if (err != ESP_OK || !more) {
+            if (more) {
+                // The buffer being read into belongs to the caller, wait for it
+                xSemaphoreTake(done, portMAX_DELAY);
+            }
+            break;
+        }
+        cur = !cur;
+    }
+    vSemaphoreDelete(done);
+    return err;
+#else
+    return stream_sync(fd, offset, length, blksize, bufs[0], bufsize, sink, ctx);
+#endif
+}
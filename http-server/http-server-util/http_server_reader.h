@@ -0,0 +1,50 @@
+#ifndef HTTP_SERVER_READER_H
+#define HTTP_SERVER_READER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <esp_err.h>
+
+/**
+ * @brief Consumer of file data, e.g. a function sending it to the client.
+ *
+ * @param ctx The context passed to file_reader_stream().
+ * @param data The next bytes of the file.
+ * @param len Length of data.
+ * @return esp_err_t ESP_OK to continue, anything else stops the stream.
+ */
+typedef esp_err_t (*file_reader_sink_t)(void *ctx, const char *data, size_t len);
+
+/**
+ * @brief Start the task that performs read-ahead for file_reader_stream().
+ *
+ * Does nothing when read-ahead is disabled in Kconfig.
+ *
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t file_reader_start(void);
+
+/**
+ * @brief Pass a byte range of an open file to a sink, buffer by buffer.
+ *
+ * With two buffers the reader task fills one while the sink consumes the
+ * other, so storage and network latency overlap. Reads are cut at multiples
+ * of blksize, the filesystem's cluster size, so that after the first one they
+ * start on cluster boundaries. With one buffer, or without the reader task,
+ * reading and consuming alternate on the calling task.
+ *
+ * @param fd The file, positioned at offset.
+ * @param offset The file position of the first byte, used for alignment.
+ * @param length Number of bytes to pass on.
+ * @param blksize The filesystem's preferred I/O size (st_blksize), or 0 if unknown.
+ * @param bufs Two buffers of bufsize bytes. bufs[1] may be NULL.
+ * @param bufsize Size of each buffer.
+ * @param sink Receives the data in file order.
+ * @param ctx Passed to sink.
+ * @return esp_err_t ESP_OK on success, ESP_FAIL on a read error or short file, or the error returned by sink.
+ */
+esp_err_t file_reader_stream(int fd, off_t offset, off_t length, size_t blksize, char *bufs[2], size_t bufsize,
+                             file_reader_sink_t sink, void *ctx);
+
+#endif // HTTP_SERVER_READER_H
@@ -0,0 +1,709 @@
+#include "http_server_stream.h"
+#include "camera_util.h"
+#include "http_server_metrics.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+
+static const char *TAG = "http_server_stream";
+
+#define STREAM_MAX_CLIENTS CONFIG_HTTP_SERVER_STREAM_MAX_CLIENTS
+#define STREAM_FRAME_INTERVAL_US (CONFIG_HTTP_SERVER_STREAM_FRAME_INTERVAL_MS * 1000LL)
+#define STREAM_IDLE_POLL_US 5000 // how soon idle clients see a new frame while others are blocked in select()
+#define STREAM_SEND_TIMEOUT_US (CONFIG_HTTP_SERVER_STREAM_SEND_TIMEOUT_MS * 1000LL)
+#define STREAM_OUTSTANDING_BUDGET CONFIG_HTTP_SERVER_STREAM_OUTSTANDING_BUDGET
+
+#define WS_MAX_FRAME_HDR_LEN 10
+#define WS_MAX_CONTROL_PAYLOAD 125
+#define WS_MAX_ACK_WINDOW 16
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_PONG 0xA
+#define WS_FIN 0x80
+
+#if CONFIG_HTTPD_WS_SUPPORT
+#define WS_DEFAULT_ACK_WINDOW CONFIG_HTTP_SERVER_WS_ACK_WINDOW
+#else
+#define WS_DEFAULT_ACK_WINDOW 0
+#endif
+
+static const char *STREAM_PART = "\r\n--" PART_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n"
+    "X-Frame-Seq: %" PRIu32 "\r\nX-Capture-Us: %" PRId64 "\r\n";
+
+typedef struct {
+    uint32_t refcount;
+    uint32_t seq;
+    uint8_t *buf;
+    size_t len;
+    camera_frame_info_t info;
+    char part_hdr[224];     // boundary and part header, built once and shared by every MJPEG client
+    size_t part_hdr_len;
+    uint8_t ws_hdr[WS_MAX_FRAME_HDR_LEN + STREAM_WS_HDR_LEN]; // WebSocket frame and metadata header
+    size_t ws_hdr_len;
+} stream_frame_t;
+
+typedef struct {
+    int fd;                 // -1 when the slot is free
+    stream_client_type_t type;
+    bool closing;           // write failed, waiting for the server to close the socket
+    stream_frame_t *frame;  // frame being written, NULL between frames
+    uint32_t last_seq;      // sequence number of the last frame completely written
+    size_t offset;          // bytes of the current part already written
+    int64_t frame_start_us; // when the current part was started
+    int64_t last_progress_us; // last time the socket accepted any bytes
+    bool blocked;           // the socket pushed back at least once during the current part
+    bool backpressured;
+    uint32_t frames_sent;
+    uint32_t frames_dropped;
+    uint64_t bytes_sent;
+    uint32_t drain_rate_bps;
+    // WebSocket clients only
+    bool paused;
+    int64_t min_interval_us; // per-client frame rate limit, 0 for none
+    uint8_t ack_window;     // unacknowledged frames allowed in flight, 0 until the client acks
+    uint8_t in_flight_count;
+    uint32_t in_flight[WS_MAX_ACK_WINDOW]; // sequence numbers sent but not acknowledged, oldest first
+    uint8_t ctrl[2 + WS_MAX_CONTROL_PAYLOAD]; // pending control frame
+    size_t ctrl_len;
+    size_t ctrl_offset;
+} stream_client_t;
+
+static struct {
+    httpd_handle_t server;
+    bool tls;                   // sockets carry TLS, so writes go through the session
+    SemaphoreHandle_t lock;
+    TaskHandle_t task;
+    TaskHandle_t capture_task;
+    stream_client_t clients[STREAM_MAX_CLIENTS];
+    size_t client_count;
+    stream_frame_t *latest;
+    uint32_t next_seq;
+} mux = { 0 };
+
+/* Frame references are only taken and dropped with mux.lock held */
+static void frame_release(stream_frame_t *frame) {
+    if (frame && --frame->refcount == 0) {
+        free(frame->buf);
+        free(frame);
+    }
+}
+
+static void client_reset(stream_client_t *client) {
+    frame_release(client->frame);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+}
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, v);
+    put_le32(p + 4, v >> 32);
+}
+
+/**
+ * @brief Build the WebSocket frame header and frame metadata for a frame.
+ */
+static void frame_build_ws_hdr(stream_frame_t *frame) {
+    uint8_t *p = frame->ws_hdr;
+    uint64_t payload_len = STREAM_WS_HDR_LEN + frame->len;
+
+    *p++ = WS_FIN | WS_OPCODE_BINARY;
+    if (payload_len < 126) {
+        *p++ = payload_len;
+    } else if (payload_len <= 0xFFFF) {
+        *p++ = 126;
+        *p++ = payload_len >> 8;
+        *p++ = payload_len;
+    } else {
+        *p++ = 127;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            *p++ = payload_len >> shift;
+        }
+    }
+
+    p[0] = STREAM_WS_HDR_VERSION;
+    p[1] = STREAM_WS_HDR_LEN;
+    put_le16(p + 2, 0);
+    put_le32(p + 4, frame->seq);
+    put_le64(p + 8, frame->info.timestamp_us);
+    put_le16(p + 16, frame->info.width);
+    put_le16(p + 18, frame->info.height);
+    put_le32(p + 20, frame->len);
+    put_le64(p + 24, frame->info.wall_time_us);
+    frame->ws_hdr_len = (p - frame->ws_hdr) + STREAM_WS_HDR_LEN;
+}
+
+/**
+ * @brief Build the multipart boundary and part header for a frame.
+ *
+ * X-Capture-Us is the capture time on the esp_timer clock. X-Timestamp is
+ * the capture time on the wall clock in seconds, only sent once the system
+ * time has been set.
+ */
+static void frame_build_part_hdr(stream_frame_t *frame) {
+    size_t size = sizeof(frame->part_hdr);
+    size_t len = snprintf(frame->part_hdr, size, STREAM_PART, (unsigned)frame->len, frame->seq, frame->info.timestamp_us);
+    if (frame->info.wall_time_us > 0) {
+        len += snprintf(frame->part_hdr + len, size - len, "X-Timestamp: %" PRId64 ".%06" PRId64 "\r\n",
+                        frame->info.wall_time_us / 1000000, frame->info.wall_time_us % 1000000);
+    }
+    len += snprintf(frame->part_hdr + len, size - len, "\r\n");
+    frame->part_hdr_len = len;
+}
+
+/**
+ * @brief Capture a new frame and make it the latest one.
+ *
+ * Clients still writing an older frame keep their reference and pick up
+ * whichever frame is latest once they finish, skipping anything in between.
+ */
+static void capture_and_publish(void) {
+    uint8_t *jpg_buf = NULL;
+    size_t jpg_len = 0;
+
+    camera_frame_info_t info = { 0 };
+    esp_err_t res = camera_capture_jpeg_ex(&jpg_buf, &jpg_len, &info);
+    if (res != ESP_OK || jpg_buf == NULL || jpg_len == 0) {
+        ESP_LOGE(TAG, "Failed to capture JPEG image");
+        free(jpg_buf);
+        return;
+    }
+
+    stream_frame_t *frame = calloc(1, sizeof(stream_frame_t));
+    if (!frame) {
+        free(jpg_buf);
+        return;
+    }
+    frame->refcount = 1;
+    frame->buf = jpg_buf;
+    frame->len = jpg_len;
+    frame->info = info;
+
+    xSemaphoreTake(mux.lock, portMAX_DELAY);
+    frame->seq = ++mux.next_seq;
+    frame_build_part_hdr(frame);
+    frame_build_ws_hdr(frame);
+    frame_release(mux.latest);
+    mux.latest = frame;
+    xSemaphoreGive(mux.lock);
+}
+
+/**
+ * @brief Check whether the client should start on the latest frame, given its pause, ack window and rate limit.
+ */
+static bool client_wants_frame(const stream_client_t *client, int64_t now) {
+    if (!mux.latest || mux.latest->seq == client->last_seq) {
+        return false;
+    }
+    if (client->type != STREAM_CLIENT_WS) {
+        return true;
+    }
+    if (client->paused || (client->ack_window && client->in_flight_count >= client->ack_window)) {
+        return false;
+    }
+    return !client->min_interval_us || now - client->frame_start_us >= client->min_interval_us;
+}
+
+/**
+ * @brief Write to a client socket without blocking.
+ *
+ * Under TLS the data is encrypted by the connection's session, one buffer
+ * per call and at most one record. After EAGAIN the session may hold a
+ * record it could not finish; callers retry from the same offset, which
+ * gives mbedTLS the same buffer and length it expects.
+ *
+ * @return ssize_t Bytes written, or -1 with errno set.
+ */
+static ssize_t client_send(stream_client_t *client, struct iovec *iov, int iovcnt) {
+    if (mux.tls) {
+        int sent = httpd_socket_send(mux.server, client->fd, iov[0].iov_base, iov[0].iov_len, MSG_DONTWAIT);
+        if (sent < 0) {
+            errno = sent == HTTPD_SOCK_ERR_TIMEOUT ? EAGAIN : EIO;
+            return -1;
+        }
+        return sent;
+    }
+
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    return sendmsg(client->fd, &msg, MSG_DONTWAIT);
+}
+
+/**
+ * @brief Write the pending WebSocket control frame, if any.
+ *
+ * @return true if it is completely written, false if the socket is full or failed.
+ */
+static bool client_write_ctrl(stream_client_t *client) {
+    while (client->ctrl_len) {
+        struct iovec iov = {
+            .iov_base = client->ctrl + client->ctrl_offset,
+            .iov_len = client->ctrl_len - client->ctrl_offset,
+        };
+        ssize_t sent = client_send(client, &iov, 1);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client->closing = true;
+            }
+            return false;
+        }
+        client->ctrl_offset += sent;
+        if (client->ctrl_offset == client->ctrl_len) {
+            client->ctrl_len = 0;
+            client->ctrl_offset = 0;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Write as much of the client's current frame as the socket accepts without blocking.
+ *
+ * The part header and the JPEG payload go out in a single gathered write so
+ * that small frames do not cost an extra TCP segment for the header.
+ *
+ * @param client The client to write to.
+ * @param now Current esp_timer time in microseconds.
+ * @return true if the client still has data pending, false if it is idle or failed.
+ */
+static bool client_write(stream_client_t *client, int64_t now) {
+    if (!client->frame) {
+        if (!client_write_ctrl(client)) {
+            return !client->closing;
+        }
+        if (!client_wants_frame(client, now)) {
+            return false;
+        }
+        client->frame = mux.latest;
+        client->frame->refcount++;
+        client->offset = 0;
+        client->frame_start_us = now;
+        client->last_progress_us = now;
+        client->blocked = false;
+    }
+
+    stream_frame_t *frame = client->frame;
+    uint8_t *hdr = client->type == STREAM_CLIENT_WS ? frame->ws_hdr : (uint8_t *)frame->part_hdr;
+    const size_t hdr_len = client->type == STREAM_CLIENT_WS ? frame->ws_hdr_len : frame->part_hdr_len;
+    const size_t part_len = hdr_len + frame->len;
+    while (true) {
+        struct iovec iov[2];
+        int iovcnt;
+        if (client->offset < hdr_len) {
+            iov[0].iov_base = hdr + client->offset;
+            iov[0].iov_len = hdr_len - client->offset;
+            iov[1].iov_base = frame->buf;
+            iov[1].iov_len = frame->len;
+            iovcnt = 2;
+        } else {
+            size_t payload_offset = client->offset - hdr_len;
+            iov[0].iov_base = frame->buf + payload_offset;
+            iov[0].iov_len = frame->len - payload_offset;
+            iovcnt = 1;
+        }
+
+        ssize_t sent = client_send(client, iov, iovcnt);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client->blocked = true;
+                break;
+            }
+            ESP_LOGW(TAG, "Stream client %d send failed (errno %d)", client->fd, errno);
+            client->closing = true;
+            return false;
+        }
+
+        client->offset += sent;
+        client->bytes_sent += sent;
+        http_metrics_add_bytes_sent(sent);
+        client->last_progress_us = now;
+        if (client->offset == part_len) {
+            // Only parts that filled the socket say anything about how fast it drains
+            int64_t elapsed_us = now - client->frame_start_us;
+            if (client->blocked && elapsed_us > 0) {
+                uint32_t sample_bps = (uint32_t)(part_len * 1000000LL / elapsed_us);
+                client->drain_rate_bps = client->drain_rate_bps ? (client->drain_rate_bps * 3 + sample_bps) / 4 : sample_bps;
+            }
+            // Parts are never abandoned half-written, so frames captured while this
+            // one went out and already replaced by a newer one are dropped. Frames
+            // a WebSocket client later skips by pausing, acking or rate limiting are not
+            if (mux.latest->seq > frame->seq + 1) {
+                client->frames_dropped += mux.latest->seq - frame->seq - 1;
+            }
+            client->last_seq = frame->seq;
+            client->frames_sent++;
+            if (client->ack_window) {
+                if (client->in_flight_count == WS_MAX_ACK_WINDOW) {
+                    memmove(client->in_flight, client->in_flight + 1, (WS_MAX_ACK_WINDOW - 1) * sizeof(uint32_t));
+                    client->in_flight_count--;
+                }
+                client->in_flight[client->in_flight_count++] = frame->seq;
+            }
+            client->backpressured = false;
+            frame_release(frame);
+            client->frame = NULL;
+            return false;
+        }
+    }
+
+    size_t outstanding = part_len - client->offset;
+    bool backpressured = outstanding > STREAM_OUTSTANDING_BUDGET || mux.latest != frame;
+    if (backpressured != client->backpressured) {
+        ESP_LOGD(TAG, "Stream client %d %s backpressure (%u bytes outstanding)", client->fd,
+                 backpressured ? "under" : "out of", (unsigned)outstanding);
+        client->backpressured = backpressured;
+    }
+
+    if (now - client->last_progress_us > STREAM_SEND_TIMEOUT_US) {
+        ESP_LOGW(TAG, "Stream client %d made no progress for %d ms, closing", client->fd,
+                 CONFIG_HTTP_SERVER_STREAM_SEND_TIMEOUT_MS);
+        client->closing = true;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Capture frames at the configured interval while anyone is watching.
+ *
+ * Capturing and encoding a frame can take tens of milliseconds, so it runs
+ * here and not in stream_mux_task(), whose writes to every viewer would
+ * stall meanwhile. Each new frame wakes the stream task.
+ */
+static void stream_capture_task(void *arg) {
+    TickType_t last_capture = xTaskGetTickCount();
+
+    while (true) {
+        xSemaphoreTake(mux.lock, portMAX_DELAY);
+        size_t client_count = mux.client_count;
+        if (client_count == 0) {
+            // Drop the last frame so a new viewer never starts with a stale picture
+            frame_release(mux.latest);
+            mux.latest = NULL;
+        }
+        xSemaphoreGive(mux.lock);
+
+        if (client_count == 0) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            last_capture = xTaskGetTickCount();
+            continue;
+        }
+
+        capture_and_publish();
+        xTaskNotifyGive(mux.task);
+        // A capture that overran the interval is followed by the next one right away, without catching up
+        if (xTaskDelayUntil(&last_capture, pdMS_TO_TICKS(CONFIG_HTTP_SERVER_STREAM_FRAME_INTERVAL_MS)) == pdFALSE) {
+            last_capture = xTaskGetTickCount();
+        }
+    }
+}
+
+/**
+ * @brief Write frames to every client socket as it drains.
+ *
+ * Sleeps while no client has anything to write, until the capture task
+ * publishes a frame or a client or control frame is added.
+ */
+static void stream_mux_task(void *arg) {
+    while (true) {
+        fd_set write_fds;
+        FD_ZERO(&write_fds);
+        int max_fd = -1;
+        int close_fds[STREAM_MAX_CLIENTS];
+        size_t close_count = 0;
+        bool waiting = false;   // a client is idle and waits for the next frame
+
+        int64_t now = esp_timer_get_time();
+        xSemaphoreTake(mux.lock, portMAX_DELAY);
+        size_t client_count = mux.client_count;
+        for (size_t i = 0; i < STREAM_MAX_CLIENTS; i++) {
+            stream_client_t *client = &mux.clients[i];
+            if (client->fd < 0 || client->closing) {
+                continue;
+            }
+            if (client_write(client, now)) {
+                FD_SET(client->fd, &write_fds);
+                max_fd = MAX(max_fd, client->fd);
+            } else if (client->closing) {
+                close_fds[close_count++] = client->fd;
+            } else {
+                waiting = true;
+            }
+        }
+        xSemaphoreGive(mux.lock);
+
+        for (size_t i = 0; i < close_count; i++) {
+            httpd_sess_trigger_close(mux.server, close_fds[i]);
+        }
+
+        if (max_fd < 0) {
+            ulTaskNotifyTake(pdTRUE, client_count ? pdMS_TO_TICKS(CONFIG_HTTP_SERVER_STREAM_FRAME_INTERVAL_MS) : portMAX_DELAY);
+            continue;
+        }
+
+        // A new frame does not end select(), so idle clients are looked at again soon
+        int64_t wait_us = waiting ? STREAM_IDLE_POLL_US : STREAM_FRAME_INTERVAL_US;
+        struct timeval timeout = {
+            .tv_sec = wait_us / 1000000,
+            .tv_usec = wait_us % 1000000,
+        };
+        if (select(max_fd + 1, NULL, &write_fds, NULL, &timeout) < 0 && errno != EINTR) {
+            ESP_LOGE(TAG, "select failed (errno %d)", errno);
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+}
+
+esp_err_t stream_mux_start(httpd_handle_t server, bool tls) {
+    if (mux.task) {
+        mux.server = server;
+        mux.tls = tls;
+        return ESP_OK;
+    }
+
+    mux.lock = xSemaphoreCreateMutex();
+    if (!mux.lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        mux.clients[i].fd = -1;
+    }
+    mux.server = server;
+    mux.tls = tls;
+
+    if (xTaskCreate(stream_mux_task, "http_stream_mux", CONFIG_HTTP_SERVER_STREAM_TASK_STACK_SIZE,
+                    NULL, CONFIG_HTTP_SERVER_STREAM_TASK_PRIORITY, &mux.task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start stream task");
+        vSemaphoreDelete(mux.lock);
+        mux.lock = NULL;
+        mux.task = NULL;
+        return ESP_FAIL;
+    }
+    if (xTaskCreate(stream_capture_task, "http_stream_cap", CONFIG_HTTP_SERVER_STREAM_CAPTURE_TASK_STACK_SIZE,
+                    NULL, CONFIG_HTTP_SERVER_STREAM_CAPTURE_TASK_PRIORITY, &mux.capture_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start stream capture task");
+        vTaskDelete(mux.task);
+        vSemaphoreDelete(mux.lock);
+        mux.lock = NULL;
+        mux.task = NULL;
+        mux.capture_task = NULL;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t stream_mux_add_client(int sockfd, stream_client_type_t type) {
+    esp_err_t err = ESP_ERR_NO_MEM;
+
+    xSemaphoreTake(mux.lock, portMAX_DELAY);
+    for (size_t i = 0; mux.server && i < STREAM_MAX_CLIENTS; i++) {
+        if (mux.clients[i].fd < 0) {
+            client_reset(&mux.clients[i]);
+            mux.clients[i].fd = sockfd;
+            mux.clients[i].type = type;
+            mux.client_count++;
+            err = ESP_OK;
+            break;
+        }
+    }
+    xSemaphoreGive(mux.lock);
+
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Stream client %d added", sockfd);
+        xTaskNotifyGive(mux.capture_task);
+        xTaskNotifyGive(mux.task);
+    }
+    return err;
+}
+
+void stream_mux_stop(void) {
+    if (!mux.lock) {
+        return;
+    }
+
+    // Taking the lock waits out a write in progress, none starts after it
+    xSemaphoreTake(mux.lock, portMAX_DELAY);
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (mux.clients[i].fd >= 0) {
+            client_reset(&mux.clients[i]);
+        }
+    }
+    mux.client_count = 0;
+    mux.server = NULL;
+    xSemaphoreGive(mux.lock);
+}
+
+void stream_mux_remove_client(int sockfd) {
+    if (!mux.lock) {
+        return;
+    }
+
+    xSemaphoreTake(mux.lock, portMAX_DELAY);
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (mux.clients[i].fd == sockfd) {
+            client_reset(&mux.clients[i]);
+            mux.client_count--;
+            ESP_LOGI(TAG, "Stream client %d removed", sockfd);
+            break;
+        }
+    }
+    xSemaphoreGive(mux.lock);
+}
+
+static stream_client_t *find_client(int sockfd) {
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (mux.clients[i].fd == sockfd) {
+            return &mux.clients[i];
+        }
+    }
+    return NULL;
+}
+
+static void client_ack(stream_client_t *client, uint32_t seq) {
+    if (!client->ack_window) {
+        client->ack_window = WS_DEFAULT_ACK_WINDOW;
+    }
+
+    size_t acked = 0;
+    while (acked < client->in_flight_count && client->in_flight[acked] <= seq) {
+        acked++;
+    }
+    memmove(client->in_flight, client->in_flight + acked, (client->in_flight_count - acked) * sizeof(uint32_t));
+    client->in_flight_count -= acked;
+}
+
+esp_err_t stream_mux_ws_control(int sockfd, const char *msg) {
+    esp_err_t err = ESP_OK;
+    char *end = NULL;
+
+    xSemaphoreTake(mux.lock, portMAX_DELAY);
+    stream_client_t *client = find_client(sockfd);
+    if (!client || client->type != STREAM_CLIENT_WS) {
+        err = ESP_ERR_NOT_FOUND;
+    } else if (strcmp(msg, "pause") == 0) {
+        client->paused = true;
+    } else if (strcmp(msg, "resume") == 0) {
+        client->paused = false;
+    } else if (strncmp(msg, "ack=", 4) == 0) {
+        unsigned long seq = strtoul(msg + 4, &end, 10);
+        if (end == msg + 4 || *end) {
+            err = ESP_ERR_INVALID_ARG;
+        } else {
+            client_ack(client, seq);
+        }
+    } else if (strncmp(msg, "window=", 7) == 0) {
+        unsigned long window = strtoul(msg + 7, &end, 10);
+        if (end == msg + 7 || *end || window < 1 || window > WS_MAX_ACK_WINDOW) {
+            err = ESP_ERR_INVALID_ARG;
+        } else {
+            client->ack_window = window;
+        }
+    } else if (strncmp(msg, "fps=", 4) == 0) {
+        unsigned long fps = strtoul(msg + 4, &end, 10);
+        if (end == msg + 4 || *end) {
+            err = ESP_ERR_INVALID_ARG;
+        } else {
+            client->min_interval_us = fps ? 1000000LL / fps : 0;
+        }
+    } else if (strncmp(msg, "quality=", 8) == 0) {
+        unsigned long quality = strtoul(msg + 8, &end, 10);
+        err = (end == msg + 8 || *end || quality > 100) ? ESP_ERR_INVALID_ARG : camera_set_jpeg_quality(quality);
+    } else {
+        err = ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreGive(mux.lock);
+
+    if (err == ESP_OK) {
+        // A resume or ack may let the client take the latest frame now
+        xTaskNotifyGive(mux.task);
+    } else if (err == ESP_ERR_INVALID_ARG) {
+        ESP_LOGW(TAG, "Stream client %d sent invalid control message: %s", sockfd, msg);
+    }
+    return err;
+}
+
+esp_err_t stream_mux_ws_queue_pong(int sockfd, const uint8_t *payload, size_t len) {
+    if (len > WS_MAX_CONTROL_PAYLOAD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(mux.lock, portMAX_DELAY);
+    stream_client_t *client = find_client(sockfd);
+    if (!client || client->type != STREAM_CLIENT_WS) {
+        err = ESP_ERR_NOT_FOUND;
+    } else if (client->ctrl_len == 0) {
+        // A pong still waiting to go out answers this ping as well
+        client->ctrl[0] = WS_FIN | WS_OPCODE_PONG;
+        client->ctrl[1] = len;
+        memcpy(client->ctrl + 2, payload, len);
+        client->ctrl_len = len + 2;
+        client->ctrl_offset = 0;
+    }
+    xSemaphoreGive(mux.lock);
+
+    if (err == ESP_OK) {
+        xTaskNotifyGive(mux.task);
+    }
+    return err;
+}
+
+bool stream_mux_has_capacity(void) {
+    xSemaphoreTake(mux.lock, portMAX_DELAY);
+    bool has_capacity = mux.client_count < STREAM_MAX_CLIENTS;
+    xSemaphoreGive(mux.lock);
+    return has_capacity;
+}
+
+esp_err_t http_server_get_stream_stats(http_stream_client_stats_t *stats, size_t max_stats, size_t *count) {
+    if (!stats || !count) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *count = 0;
+    if (!mux.lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(mux.lock, portMAX_DELAY);
+    for (size_t i = 0; i < STREAM_MAX_CLIENTS && *count < max_stats; i++) {
+        const stream_client_t *client = &mux.clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        http_stream_client_stats_t *s = &stats[(*count)++];
+        s->sockfd = client->fd;
+        s->frames_sent = client->frames_sent;
+        s->frames_dropped = client->frames_dropped;
+        s->bytes_sent = client->bytes_sent;
+        s->drain_rate_bps = client->drain_rate_bps;
+        s->outstanding_bytes = 0;
+        if (client->frame) {
+            size_t hdr_len = client->type == STREAM_CLIENT_WS ? client->frame->ws_hdr_len : client->frame->part_hdr_len;
+            s->outstanding_bytes = hdr_len + client->frame->len - client->offset;
+        }
+        s->websocket = client->type == STREAM_CLIENT_WS;
+        s->backpressured = client->backpressured;
+    }
+    xSemaphoreGive(mux.lock);
+    return ESP_OK;
+}
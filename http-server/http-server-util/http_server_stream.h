@@ -0,0 +1,115 @@
+#ifndef HTTP_SERVER_STREAM_H
+#define HTTP_SERVER_STREAM_H
+
+#include <stdbool.h>
+
+#include <esp_http_server.h>
+#include <esp_err.h>
+
+#include "http_server_util.h"
+
+#define PART_BOUNDARY "123456789000000000000987654321"
+
+/*
+ * Every WebSocket binary message carries one JPEG frame behind a fixed
+ * little-endian header:
+ *
+ *   offset  size  field
+ *   0       1     version (STREAM_WS_HDR_VERSION)
+ *   1       1     header length in bytes (STREAM_WS_HDR_LEN)
+ *   2       2     reserved, 0
+ *   4       4     frame sequence number
+ *   8       8     capture timestamp in microseconds (esp_timer clock)
+ *   16      2     width in pixels
+ *   18      2     height in pixels
+ *   20      4     JPEG length in bytes
+ *   24      8     capture time in microseconds since the epoch, 0 if the system time is not set
+ *
+ * Version 1 headers were 24 bytes and had no wall-clock time. Clients should
+ * skip the header by its length field so that later fields can be added.
+ *
+ * MJPEG parts carry the same times as X-Capture-Us (esp_timer clock) and
+ * X-Timestamp (wall clock in seconds with microseconds, omitted while the
+ * system time is not set), and the sequence number as X-Frame-Seq.
+ *
+ * Clients control their stream with text messages:
+ *   "fps=<n>"      limit the frame rate, 0 removes the limit
+ *   "quality=<n>"  JPEG quality 1-100 (applies to the camera, so all viewers)
+ *   "pause"        stop sending frames
+ *   "resume"       start sending frames again
+ *   "ack=<seq>"    acknowledge every frame up to seq and enable ack flow control
+ *   "window=<n>"   number of unacknowledged frames allowed in flight
+ */
+#define STREAM_WS_HDR_VERSION 2
+#define STREAM_WS_HDR_LEN 32
+
+typedef enum {
+    STREAM_CLIENT_MJPEG,    /*!< multipart/x-mixed-replace over plain HTTP */
+    STREAM_CLIENT_WS,       /*!< WebSocket binary messages */
+} stream_client_type_t;
+
+/**
+ * @brief Start the task that owns all MJPEG stream sockets and the task that captures their frames.
+ *
+ * @param server The HTTP server the stream sockets belong to.
+ * @param tls Whether the sockets carry TLS, in which case frames are written through the server's session.
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t stream_mux_start(httpd_handle_t server, bool tls);
+
+/**
+ * @brief Drop all stream clients and detach from the server before it stops.
+ *
+ * The stream task stays idle until the next stream_mux_start(). The sockets
+ * themselves are closed by the server.
+ */
+void stream_mux_stop(void);
+
+/**
+ * @brief Hand a connected socket over to the stream multiplexer.
+ *
+ * The HTTP response headers or WebSocket handshake must already have been sent on the socket.
+ *
+ * @param sockfd The client socket.
+ * @param type How frames are framed on the socket.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NO_MEM if all stream slots are in use or the server is stopping.
+ */
+esp_err_t stream_mux_add_client(int sockfd, stream_client_type_t type);
+
+/**
+ * @brief Apply a control message received from a WebSocket stream client.
+ *
+ * @param sockfd The client socket.
+ * @param msg The text message, see the list above.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_FOUND for unknown clients, ESP_ERR_INVALID_ARG for bad messages.
+ */
+esp_err_t stream_mux_ws_control(int sockfd, const char *msg);
+
+/**
+ * @brief Queue a pong for a WebSocket stream client.
+ *
+ * The stream task owns the socket, so control frames are written by it
+ * between two frames instead of by the server task.
+ *
+ * @param sockfd The client socket.
+ * @param payload The ping payload to echo.
+ * @param len Length of payload, at most 125 bytes.
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t stream_mux_ws_queue_pong(int sockfd, const uint8_t *payload, size_t len);
+
+/**
+ * @brief Stop streaming to a socket. Safe to call for sockets that are not streaming.
+ *
+ * @param sockfd The client socket.
+ */
+void stream_mux_remove_client(int sockfd);
+
+/**
+ * @brief Check whether another stream client can be accepted.
+ *
+ * @return true if a stream slot is free, false otherwise.
+ */
+bool stream_mux_has_capacity(void);
+
+#endif // HTTP_SERVER_STREAM_H
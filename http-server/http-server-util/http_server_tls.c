@@ -0,0 +1,259 @@
+#include "http_server_tls.h"
+#include "http_server_metrics.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#if CONFIG_HTTP_SERVER_HTTPS
+
+#include "esp_tls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+static const char *TAG = "http_server_tls";
+
+/* Largest plaintext mbedTLS puts in one outgoing record */
+#if CONFIG_MBEDTLS_ASYMMETRIC_CONTENT_LEN
+#define TLS_RECORD_MAX CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+#elif defined(CONFIG_MBEDTLS_SSL_MAX_CONTENT_LEN)
+#define TLS_RECORD_MAX CONFIG_MBEDTLS_SSL_MAX_CONTENT_LEN
+#else
+#define TLS_RECORD_MAX 4096
+#endif
+
+/*
+ * Connections are secured with esp-tls directly rather than through
+ * esp_https_server, which performs the handshake inside its own open_fn and
+ * gives no way to time it. The transport hooks are the same ones
+ * esp_https_server installs.
+ */
+static struct {
+    bool enabled;
+    bool session_tickets;
+    esp_tls_cfg_server_t cfg;
+#if CONFIG_ESP_TLS_SERVER_SESSION_TICKETS
+    esp_tls_server_session_ticket_ctx_t ticket_ctx;
+#endif
+} tls = { 0 };
+
+/*
+ * Stream sockets are written by the stream task while the server task may
+ * still read WebSocket acks from them, so each session has a lock.
+ */
+typedef struct {
+    esp_tls_t *session;
+    SemaphoreHandle_t lock;
+} tls_conn_t;
+
+static void tls_conn_free(void *ctx) {
+    tls_conn_t *conn = ctx;
+    esp_tls_server_session_delete(conn->session);
+    vSemaphoreDelete(conn->lock);
+    free(conn);
+}
+
+/**
+ * @brief Send override for TLS sessions.
+ *
+ * The server's own sends block like on a plain socket. With MSG_DONTWAIT,
+ * as the stream task sends, the write never waits: not for the session lock
+ * and not for socket space. It is cut to one record, so HTTPD_SOCK_ERR_TIMEOUT
+ * means nothing was accepted. mbedTLS keeps the record it could not finish,
+ * and the caller must retry with the same buffer and length.
+ */
+static int tls_send(httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags) {
+    tls_conn_t *conn = httpd_sess_get_transport_ctx(hd, sockfd);
+    if (!conn) {
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+    const bool dontwait = flags & MSG_DONTWAIT;
+    if (xSemaphoreTake(conn->lock, dontwait ? 0 : portMAX_DELAY) != pdTRUE) {
+        return HTTPD_SOCK_ERR_TIMEOUT;
+    }
+    int fl = 0;
+    if (dontwait) {
+        // The socket stays blocking for the server task, which parses requests from it
+        fl = fcntl(sockfd, F_GETFL, 0);
+        fcntl(sockfd, F_SETFL, fl | O_NONBLOCK);
+        buf_len = MIN(buf_len, TLS_RECORD_MAX);
+    }
+    ssize_t ret = esp_tls_conn_write(conn->session, buf, buf_len);
+    if (dontwait) {
+        fcntl(sockfd, F_SETFL, fl);
+    }
+    xSemaphoreGive(conn->lock);
+    if (ret == ESP_TLS_ERR_SSL_WANT_WRITE || ret == ESP_TLS_ERR_SSL_WANT_READ) {
+        return HTTPD_SOCK_ERR_TIMEOUT;
+    }
+    return ret < 0 ? HTTPD_SOCK_ERR_FAIL : ret;
+}
+
+/**
+ * @brief Receive override for TLS sessions.
+ *
+ * The session lock is only held for non-blocking reads. While the rest of a
+ * record is still on its way, e.g. a WebSocket ack split across segments,
+ * the wait happens in select() without the lock, so the stream task's
+ * writes to the same session go on. The wait is bounded by the socket's
+ * receive timeout, which the server sets to recv_wait_timeout.
+ */
+static int tls_recv(httpd_handle_t hd, int sockfd, char *buf, size_t buf_len, int flags) {
+    tls_conn_t *conn = httpd_sess_get_transport_ctx(hd, sockfd);
+    if (!conn) {
+        return HTTPD_SOCK_ERR_INVALID;
+    }
+    struct timeval timeout = { 0 };
+    socklen_t optlen = sizeof(timeout);
+    getsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &optlen);
+    const int64_t timeout_us = timeout.tv_sec * 1000000LL + timeout.tv_usec;
+    const int64_t deadline_us = esp_timer_get_time() + timeout_us;
+
+    for (;;) {
+        xSemaphoreTake(conn->lock, portMAX_DELAY);
+        int fl = fcntl(sockfd, F_GETFL, 0);
+        fcntl(sockfd, F_SETFL, fl | O_NONBLOCK);
+        ssize_t ret = esp_tls_conn_read(conn->session, buf, buf_len);
+        fcntl(sockfd, F_SETFL, fl);
+        xSemaphoreGive(conn->lock);
+        if (ret != ESP_TLS_ERR_SSL_WANT_READ && ret != ESP_TLS_ERR_SSL_WANT_WRITE) {
+            return ret < 0 ? HTTPD_SOCK_ERR_FAIL : ret;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sockfd, &fds);
+        struct timeval wait;
+        struct timeval *wait_ptr = NULL;
+        if (timeout_us > 0) {
+            int64_t left_us = MAX(deadline_us - esp_timer_get_time(), 0);
+            wait.tv_sec = left_us / 1000000;
+            wait.tv_usec = left_us % 1000000;
+            wait_ptr = &wait;
+        }
+        int n = ret == ESP_TLS_ERR_SSL_WANT_READ ? select(sockfd + 1, &fds, NULL, NULL, wait_ptr)
+                                                 : select(sockfd + 1, NULL, &fds, NULL, wait_ptr);
+        if (n == 0) {
+            return HTTPD_SOCK_ERR_TIMEOUT;
+        }
+        if (n < 0 && errno != EINTR) {
+            return HTTPD_SOCK_ERR_FAIL;
+        }
+    }
+}
+
+/* Decrypted bytes already buffered, which select() on the socket cannot see */
+static int tls_pending(httpd_handle_t hd, int sockfd) {
+    tls_conn_t *conn = httpd_sess_get_transport_ctx(hd, sockfd);
+    if (!conn) {
+        return 0;
+    }
+    xSemaphoreTake(conn->lock, portMAX_DELAY);
+    ssize_t avail = esp_tls_get_bytes_avail(conn->session);
+    xSemaphoreGive(conn->lock);
+    return avail > 0 ? avail : 0;
+}
+
+esp_err_t tls_transport_init(const uint8_t *cert, size_t cert_len, const uint8_t *key, size_t key_len, bool session_tickets) {
+    if (!cert || !cert_len || !key || !key_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    tls.cfg.servercert_buf = cert;
+    tls.cfg.servercert_bytes = cert_len;
+    tls.cfg.serverkey_buf = key;
+    tls.cfg.serverkey_bytes = key_len;
+
+    if (session_tickets) {
+#if CONFIG_ESP_TLS_SERVER_SESSION_TICKETS
+        esp_err_t err = esp_tls_server_session_ticket_ctx_init(&tls.ticket_ctx);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set up session tickets");
+            return err;
+        }
+        tls.cfg.ticket_ctx = &tls.ticket_ctx;
+        tls.session_tickets = true;
+#else
+        ESP_LOGW(TAG, "Session tickets need CONFIG_ESP_TLS_SERVER_SESSION_TICKETS, every connection does a full handshake");
+#endif
+    }
+
+    tls.enabled = true;
+    ESP_LOGI(TAG, "HTTPS enabled%s", tls.session_tickets ? " with session tickets" : "");
+    return ESP_OK;
+}
+
+void tls_transport_deinit(void) {
+#if CONFIG_ESP_TLS_SERVER_SESSION_TICKETS
+    if (tls.session_tickets) {
+        esp_tls_server_session_ticket_ctx_free(&tls.ticket_ctx);
+    }
+#endif
+    memset(&tls, 0, sizeof(tls));
+}
+
+bool tls_transport_enabled(void) {
+    return tls.enabled;
+}
+
+esp_err_t tls_transport_open(httpd_handle_t hd, int sockfd) {
+    tls_conn_t *conn = calloc(1, sizeof(tls_conn_t));
+    if (!conn) {
+        return ESP_ERR_NO_MEM;
+    }
+    conn->lock = xSemaphoreCreateMutex();
+    conn->session = esp_tls_init();
+    if (!conn->lock || !conn->session) {
+        if (conn->lock) {
+            vSemaphoreDelete(conn->lock);
+        }
+        esp_tls_conn_destroy(conn->session);
+        free(conn);
+        return ESP_ERR_NO_MEM;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    int ret = esp_tls_server_session_create(&tls.cfg, sockfd, conn->session);
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    http_metrics_record_tls_handshake(ret == 0, elapsed_us);
+    if (ret != 0) {
+        ESP_LOGW(TAG, "Handshake on socket %d failed (-0x%04x) after %lld ms", sockfd, -ret, (long long)(elapsed_us / 1000));
+        tls_conn_free(conn);
+        return ESP_FAIL;
+    }
+    ESP_LOGD(TAG, "Handshake on socket %d took %lld ms", sockfd, (long long)(elapsed_us / 1000));
+
+    httpd_sess_set_transport_ctx(hd, sockfd, conn, tls_conn_free);
+    httpd_sess_set_send_override(hd, sockfd, tls_send);
+    httpd_sess_set_recv_override(hd, sockfd, tls_recv);
+    httpd_sess_set_pending_override(hd, sockfd, tls_pending);
+    return ESP_OK;
+}
+
+#else // CONFIG_HTTP_SERVER_HTTPS
+
+esp_err_t tls_transport_init(const uint8_t *cert, size_t cert_len, const uint8_t *key, size_t key_len, bool session_tickets) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void tls_transport_deinit(void) {
+}
+
+bool tls_transport_enabled(void) {
+    return false;
+}
+
+esp_err_t tls_transport_open(httpd_handle_t hd, int sockfd) {
+    return ESP_OK;
+}
+
+#endif // CONFIG_HTTP_SERVER_HTTPS
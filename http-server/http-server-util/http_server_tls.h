@@ -0,0 +1,44 @@
+#ifndef HTTP_SERVER_TLS_H
+#define HTTP_SERVER_TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_http_server.h>
+#include <esp_err.h>
+
+/**
+ * @brief Set up the TLS server configuration shared by all connections.
+ *
+ * @param cert PEM server certificate chain, NUL terminated.
+ * @param cert_len Length of cert including the terminator.
+ * @param key PEM private key, NUL terminated.
+ * @param key_len Length of key including the terminator.
+ * @param session_tickets Issue session tickets so that returning clients skip the full handshake.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED if HTTPS is disabled in Kconfig, or an error code on failure.
+ */
+esp_err_t tls_transport_init(const uint8_t *cert, size_t cert_len, const uint8_t *key, size_t key_len, bool session_tickets);
+
+/**
+ * @brief Undo tls_transport_init(), e.g. when the server fails to start.
+ */
+void tls_transport_deinit(void);
+
+/**
+ * @brief Check whether connections are secured with TLS.
+ */
+bool tls_transport_enabled(void);
+
+/**
+ * @brief Perform the TLS handshake on a new connection and route its traffic through the session.
+ *
+ * Called from the server's open_fn. The handshake time is added to the metrics.
+ *
+ * @param hd The server handle.
+ * @param sockfd The new client socket.
+ * @return esp_err_t ESP_OK on success, ESP_FAIL if the handshake failed.
+ */
+esp_err_t tls_transport_open(httpd_handle_t hd, int sockfd);
+
+#endif // HTTP_SERVER_TLS_H
@@ -1,350 +1,2978 @@
 #include "http_server_util.h"
+#include "http_server_stream.h"
+#include "http_server_cache.h"
+#include "http_server_assets.h"
+#include "http_server_writer.h"
+#include "http_server_reader.h"
+#include "http_server_metrics.h"
+#include "http_server_admission.h"
+#include "http_server_tls.h"
 #include "file_operations.h"
 #include "camera_util.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 
 #include "esp_err.h"
 #include "esp_log.h"
+#if !CONFIG_IDF_TARGET_LINUX
 #include "esp_vfs.h"
 #include "esp_spiffs.h"
+#include "esp_vfs_fat.h"
+#endif
 #include "esp_http_server.h"
 #include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/param.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 static httpd_handle_t server = NULL;
 static const char *TAG = "http_server_util";
 
-#define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
-#define MAX_FILE_SIZE (200*1024) // 200 KB
-#define MAX_FILE_SIZE_STR "200KB"
-#define SCRATCH_BUFSIZE 8192
+#if CONFIG_IDF_TARGET_LINUX
+/* Host build (tools/host): files are served from an ordinary directory */
+#define BASE_PATH_MAX 64
+#define FILE_NAME_MAX 256
+#else
+#define BASE_PATH_MAX ESP_VFS_PATH_MAX
+#define FILE_NAME_MAX CONFIG_SPIFFS_OBJ_NAME_LEN
+#endif
+#define FILE_PATH_MAX (BASE_PATH_MAX + FILE_NAME_MAX)
+#define MAX_FILE_SIZE CONFIG_HTTP_SERVER_UPLOAD_MAX_SIZE
+#define MULTIPART_OVERHEAD_MAX 1024 // boundaries and part headers around an uploaded file
+#define UPLOAD_RECV_RETRIES 3       // receive timeouts in a row before an upload is abandoned
+#define SCRATCH_BUF_COUNT CONFIG_HTTP_SERVER_SCRATCH_BUF_COUNT
 
-#define PART_BOUNDARY "123456789000000000000987654321"
+struct scratch_pool {
+    SemaphoreHandle_t available;
+    portMUX_TYPE lock;
+    uint32_t free_mask;
+    size_t bufsize;
+    char *bufs[SCRATCH_BUF_COUNT];
+};
 
 struct file_server_data {
-    char base_path[ESP_VFS_PATH_MAX + 1];
-    char scratch[SCRATCH_BUFSIZE];
+    char base_path[BASE_PATH_MAX + 1];
+    struct scratch_pool pool;
+};
+
+typedef esp_err_t (*httpd_req_handler_t)(httpd_req_t *req);
+
+typedef struct {
+    httpd_req_t *req;
+    httpd_req_handler_t handler;
+    http_route_t route;
+    int64_t start_us;
+} httpd_async_req_t;
+
+/* The request the server task is currently running, see run_timed() */
+static struct {
+    http_route_t route;
+    int64_t start_us;
+    bool handed_off;
+} timed_req;
+
+/* Set while the server runs, released by stop_http_server() */
+static struct file_server_data *server_data = NULL;
+
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+static QueueHandle_t async_req_queue = NULL;
+static SemaphoreHandle_t worker_ready_count = NULL;
+static TaskHandle_t worker_handles[CONFIG_HTTP_SERVER_ASYNC_WORKERS];
+#endif
+
+#define CACHE_CONTROL_MAX_RULES 8
+#define FILE_HEADERS_MAX 512
+
+struct cache_control_rule {
+    char prefix[32];
+    char value[48];
 };
 
+static struct cache_control_rule cache_control_rules[CACHE_CONTROL_MAX_RULES];
+static size_t cache_control_rule_count = 0;
+
 #define HTTP_RESP_SEND_ERR(req, status, msg) \
     do { \
         httpd_resp_send_err(req, status, msg); \
         return ESP_FAIL; \
     } while (0)
 
-static esp_err_t send_html_header(httpd_req_t *req) {
-    httpd_resp_sendstr_chunk(req, "<!DOCTYPE html><html lang=\"en\"><head><meta charset=\"UTF-8\">:<title>ESP32-CAM</title>"
+/**
+ * @brief Allocate the I/O buffers of the scratch pool.
+ *
+ * Buffers are placed in DMA-capable internal RAM when possible so that the
+ * SD/MMC driver can transfer into them without a bounce buffer.
+ *
+ * @param pool The pool to initialize.
+ * @param bufsize Size of each buffer.
+ * @return esp_err_t ESP_OK on success, or ESP_ERR_NO_MEM on failure.
+ */
+static esp_err_t scratch_pool_init(struct scratch_pool *pool, size_t bufsize) {
+    pool->lock = (portMUX_TYPE)portMUX_INITIALIZER_UNLOCKED;
+    pool->free_mask = 0;
+    pool->bufsize = bufsize;
+
+    for (size_t i = 0; i < SCRATCH_BUF_COUNT; i++) {
+        pool->bufs[i] = heap_caps_malloc(bufsize, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (!pool->bufs[i]) {
+            pool->bufs[i] = heap_caps_malloc(bufsize, MALLOC_CAP_8BIT);
+        }
+        if (!pool->bufs[i]) {
+            ESP_LOGE(TAG, "Failed to allocate I/O buffer %u of %u", (unsigned)i, (unsigned)SCRATCH_BUF_COUNT);
+            return ESP_ERR_NO_MEM;
+        }
+        pool->free_mask |= (1u << i);
+    }
+
+    pool->available = xSemaphoreCreateCounting(SCRATCH_BUF_COUNT, SCRATCH_BUF_COUNT);
+    if (!pool->available) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "I/O buffer pool: %u x %u bytes", (unsigned)SCRATCH_BUF_COUNT, (unsigned)bufsize);
+    return ESP_OK;
+}
+
+/**
+ * @brief Free the buffers of a scratch pool, also one that was only partly initialized.
+ *
+ * @param pool The pool to free. No buffer may be leased.
+ */
+static void scratch_pool_deinit(struct scratch_pool *pool) {
+    for (size_t i = 0; i < SCRATCH_BUF_COUNT; i++) {
+        heap_caps_free(pool->bufs[i]);
+        pool->bufs[i] = NULL;
+    }
+    if (pool->available) {
+        vSemaphoreDelete(pool->available);
+        pool->available = NULL;
+    }
+    pool->free_mask = 0;
+}
+
+/**
+ * @brief Lease an I/O buffer from the pool for the duration of a request.
+ *
+ * @param pool The pool to lease from.
+ * @param timeout Ticks to wait for a buffer to become free.
+ * @return char* A buffer of pool->bufsize bytes, or NULL if none became free in time.
+ */
+static char *scratch_pool_lease(struct scratch_pool *pool, TickType_t timeout) {
+    if (xSemaphoreTake(pool->available, timeout) != pdTRUE) {
+        return NULL;
+    }
+
+    char *buf = NULL;
+    taskENTER_CRITICAL(&pool->lock);
+    if (pool->free_mask) {
+        int i = __builtin_ctz(pool->free_mask);
+        pool->free_mask &= ~(1u << i);
+        buf = pool->bufs[i];
+    }
+    taskEXIT_CRITICAL(&pool->lock);
+    return buf;
+}
+
+/**
+ * @brief Return a leased I/O buffer to the pool.
+ *
+ * @param pool The pool the buffer was leased from.
+ * @param buf The buffer returned by scratch_pool_lease().
+ */
+static void scratch_pool_release(struct scratch_pool *pool, char *buf) {
+    if (!buf) {
+        return;
+    }
+
+    taskENTER_CRITICAL(&pool->lock);
+    for (size_t i = 0; i < SCRATCH_BUF_COUNT; i++) {
+        if (pool->bufs[i] == buf) {
+            pool->free_mask |= (1u << i);
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&pool->lock);
+    xSemaphoreGive(pool->available);
+}
+
+static http_request_class_t route_class(http_route_t route) {
+    switch (route) {
+    case HTTP_ROUTE_STREAM:
+    case HTTP_ROUTE_WS:
+        return HTTP_CLASS_STREAM;
+    case HTTP_ROUTE_FILE:
+    case HTTP_ROUTE_UPLOAD:
+    case HTTP_ROUTE_LIST:
+    case HTTP_ROUTE_ARCHIVE:
+    case HTTP_ROUTE_IMAGE:
+    case HTTP_ROUTE_SNAPSHOT:
+        return HTTP_CLASS_TRANSFER;
+    default:
+        return HTTP_CLASS_CONTROL;
+    }
+}
+
+static bool is_on_async_worker_thread(void) {
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+    TaskHandle_t handle = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < CONFIG_HTTP_SERVER_ASYNC_WORKERS; i++) {
+        if (worker_handles[i] == handle) {
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+/**
+ * @brief Hand a request over to an idle async worker.
+ *
+ * @param req The request received by the server task.
+ * @param handler The handler to run on the worker.
+ * @return esp_err_t ESP_OK if a worker took the request, ESP_FAIL if all workers are busy.
+ */
+static esp_err_t submit_async_req(httpd_req_t *req, httpd_req_handler_t handler) {
+    httpd_req_t *copy = NULL;
+    esp_err_t err = httpd_req_async_handler_begin(req, &copy);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    httpd_async_req_t async_req = {
+        .req = copy,
+        .handler = handler,
+        .route = timed_req.route,
+        .start_us = timed_req.start_us,
+    };
+
+    // Only queue when a worker is idle, otherwise the caller serves the request inline
+    if (xSemaphoreTake(worker_ready_count, 0) != pdTRUE) {
+        httpd_req_async_handler_complete(copy);
+        return ESP_FAIL;
+    }
+
+    if (xQueueSend(async_req_queue, &async_req, pdMS_TO_TICKS(100)) != pdTRUE) {
+        ESP_LOGE(TAG, "Async request queue full");
+        xSemaphoreGive(worker_ready_count);
+        httpd_req_async_handler_complete(copy);
+        return ESP_FAIL;
+    }
+    timed_req.handed_off = true;
+    return ESP_OK;
+}
+
+static void async_req_worker_task(void *p) {
+    while (true) {
+        xSemaphoreGive(worker_ready_count);
+
+        httpd_async_req_t async_req;
+        if (xQueueReceive(async_req_queue, &async_req, portMAX_DELAY) == pdTRUE) {
+            esp_err_t err = async_req.handler(async_req.req);
+            admission_end(httpd_req_to_sockfd(async_req.req), route_class(async_req.route), err == ESP_OK);
+            http_metrics_record_request(async_req.route, esp_timer_get_time() - async_req.start_us);
+            if (httpd_req_async_handler_complete(async_req.req) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to complete async request");
+            }
+        }
+    }
+}
+
+/**
+ * @brief Wait until every worker is idle and keep them from taking new requests.
+ *
+ * Holding all counts of worker_ready_count makes submit_async_req() serve
+ * requests inline, so once this returns no worker holds a request copy.
+ */
+static void drain_async_req_workers(void) {
+    for (int i = 0; i < CONFIG_HTTP_SERVER_ASYNC_WORKERS; i++) {
+        if (xSemaphoreTake(worker_ready_count, pdMS_TO_TICKS(1000)) != pdTRUE) {
+            ESP_LOGW(TAG, "Waiting for async requests to finish");
+            i--;
+        }
+    }
+}
+
+/**
+ * @brief Let drained workers take requests again.
+ */
+static void resume_async_req_workers(void) {
+    for (int i = 0; i < CONFIG_HTTP_SERVER_ASYNC_WORKERS; i++) {
+        xSemaphoreGive(worker_ready_count);
+    }
+}
+
+/**
+ * @brief Delete whatever start_async_req_workers() created, so that a later start begins from scratch.
+ */
+static void stop_async_req_workers(void) {
+    for (int i = CONFIG_HTTP_SERVER_ASYNC_WORKERS - 1; i >= 0; i--) {
+        if (worker_handles[i]) {
+            vTaskDelete(worker_handles[i]);
+            worker_handles[i] = NULL;
+        }
+    }
+    if (async_req_queue) {
+        vQueueDelete(async_req_queue);
+        async_req_queue = NULL;
+    }
+    if (worker_ready_count) {
+        vSemaphoreDelete(worker_ready_count);
+        worker_ready_count = NULL;
+    }
+}
+
+static esp_err_t start_async_req_workers(void) {
+    if (async_req_queue) {
+        return ESP_OK;
+    }
+
+    worker_ready_count = xSemaphoreCreateCounting(CONFIG_HTTP_SERVER_ASYNC_WORKERS, 0);
+    async_req_queue = xQueueCreate(CONFIG_HTTP_SERVER_ASYNC_WORKERS, sizeof(httpd_async_req_t));
+    if (!worker_ready_count || !async_req_queue) {
+        ESP_LOGE(TAG, "Failed to create async worker queue");
+        stop_async_req_workers();
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < CONFIG_HTTP_SERVER_ASYNC_WORKERS; i++) {
+        if (xTaskCreate(async_req_worker_task, "http_async_worker", CONFIG_HTTP_SERVER_ASYNC_WORKER_STACK_SIZE,
+                        NULL, 5, &worker_handles[i]) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start async worker %d", i);
+            // Workers that did start are blocked on the queue and hold nothing yet
+            worker_handles[i] = NULL;
+            stop_async_req_workers();
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+#endif
+
+/**
+ * @brief Answer 503 with Retry-After, for requests turned away for lack of a slot, buffer or memory.
+ *
+ * @param req The request.
+ * @param retry_after Seconds the client should wait before retrying.
+ * @param msg The response body.
+ * @return esp_err_t ESP_OK, the connection stays open.
+ */
+static esp_err_t send_busy(httpd_req_t *req, const char *retry_after, const char *msg) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", retry_after);
+    httpd_resp_sendstr(req, msg);
+    return ESP_OK;
+}
+
+static esp_err_t admission_reject(httpd_req_t *req, http_route_t route, admission_result_t result) {
+    int sockfd = httpd_req_to_sockfd(req);
+
+    ESP_LOGW(TAG, "Turning away %s on socket %d (%s)", req->uri, sockfd,
+             result == ADMISSION_RESERVED ? "sockets reserved" : "class full");
+    if (route == HTTP_ROUTE_WS) {
+        // The handshake has already been answered, all that is left is to close
+        return ESP_FAIL;
+    }
+
+    send_busy(req, route == HTTP_ROUTE_STREAM ? "5" : "1", "Server busy");
+    if (result == ADMISSION_RESERVED) {
+        // Give the socket back for control requests
+        httpd_sess_trigger_close(req->handle, sockfd);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Run a handler on the server task, subject to admission control, and record its latency under a route.
+ *
+ * A handler that passes the request to an async worker is finished and
+ * recorded by the worker instead.
+ */
+static esp_err_t run_timed(httpd_req_t *req, http_route_t route, httpd_req_handler_t handler) {
+    int sockfd = httpd_req_to_sockfd(req);
+    http_request_class_t cls = route_class(route);
+    // Frames on an open WebSocket belong to a stream that was admitted with its handshake
+    bool admit = route != HTTP_ROUTE_WS || req->method == HTTP_GET;
+    esp_err_t err;
+
+    timed_req.route = route;
+    timed_req.start_us = esp_timer_get_time();
+    timed_req.handed_off = false;
+
+    admission_result_t result = admit ? admission_begin(sockfd, cls) : ADMISSION_OK;
+    if (result != ADMISSION_OK) {
+        err = admission_reject(req, route, result);
+        http_metrics_record_request(route, esp_timer_get_time() - timed_req.start_us);
+        return err;
+    }
+
+    err = handler(req);
+    if (!timed_req.handed_off) {
+        if (admit) {
+            admission_end(sockfd, cls, err == ESP_OK);
+        }
+        http_metrics_record_request(route, esp_timer_get_time() - timed_req.start_us);
+    }
+    return err;
+}
+
+#define TIMED_HANDLER(handler, route) \
+    static esp_err_t handler##_timed(httpd_req_t *req) { return run_timed(req, route, handler); }
+
+/**
+ * @brief Check whether a path below the base path is one the server keeps for itself.
+ *
+ * That is the scaled image cache, which is left out of listings and archives
+ * and refused by every route that names a file.
+ *
+ * @param path Path relative to the base path, with or without a leading '/'.
+ */
+static bool is_reserved_path(const char *path) {
+#if CONFIG_HTTP_SERVER_IMG_RESIZE
+    const size_t len = strlen(CONFIG_HTTP_SERVER_IMG_CACHE_DIR);
+    path += strspn(path, "/");
+    return strncmp(path, CONFIG_HTTP_SERVER_IMG_CACHE_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Check whether an entry read from a directory is reserved, see is_reserved_path().
+ *
+ * @param base_path The server's base path.
+ * @param dirpath The directory, base_path followed by the path below it.
+ * @param name The entry's name.
+ */
+static bool is_reserved_entry(const char *base_path, const char *dirpath, const char *name) {
+    const char *rel = dirpath + strlen(base_path);
+    return rel[strspn(rel, "/")] == '\0' && is_reserved_path(name);
+}
+
+static void send_html_header(resp_writer_t *w) {
+    resp_writer_puts(w, "<!DOCTYPE html><html lang=\"en\"><head><meta charset=\"UTF-8\">:<title>ESP32-CAM</title>"
     "<style>body {margin: 0; padding: 0; box-sizing: border-box;} table {width: 95%; margin: auto; table-layout: fixed; border-collapse: collapse;} th, td {border: 1px solid #000; padding: 10px; text-align: center; overflow: hidden; text-overflow: ellipsis; white-space: nowrap;}</style>"
     "</head><body>");
+}
+
+static void send_html_footer(resp_writer_t *w) {
+    resp_writer_puts(w, "</body></html>");
+}
+
+/**
+ * @brief Write the listing table, one row per entry as the directory is read.
+ */
+static void send_file_list(resp_writer_t *w, httpd_req_t *req, const char *dirpath, file_iter_t *it) {
+    char date[30];
+    const char *entrytype;
+
+    resp_writer_puts(w, "<h2>Files in ");
+    resp_writer_html_escaped(w, dirpath);
+    resp_writer_puts(w, "</h2><table border=\"1\">"
+        "<thead><tr><th>Name</th><th>Type</th><th>Size (Bytes)</th><th>Date</th><th>Delete</th></tr></thead>"
+        "<tbody>");
+
+    const char *base_path = ((struct file_server_data *)req->user_ctx)->base_path;
+    const file_iter_entry_t *entry;
+    while (w->err == ESP_OK && file_iter_next(it, &entry) == ESP_OK) {
+        const char *name = entry->name;
+        if (is_reserved_entry(base_path, dirpath, name)) {
+            continue;
+        }
+        entrytype = (entry->type == DT_DIR ? "directory" : "file");
+        if (file_iter_stat(it) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to stat %s : %s", entrytype, name);
+            continue;
+        }
+
+        ESP_LOGD(TAG, "Found %s : %s (%lu bytes)", entrytype, name, (unsigned long)entry->size);
+        struct tm tm_info;
+        localtime_r(&entry->mtime, &tm_info);
+        strftime(date, sizeof(date), "%m/%d/%Y %I:%M:%S %p", &tm_info);
+
+        resp_writer_puts(w, "<tr><td><a href=\"");
+        resp_writer_html_escaped(w, req->uri);
+        resp_writer_html_escaped(w, name);
+        resp_writer_puts(w, entry->type == DT_DIR ? "/\">" : "\">");
+#if CONFIG_HTTP_SERVER_IMG_RESIZE && CONFIG_HTTP_SERVER_IMG_PREVIEW_WIDTH > 0
+        if (entry->type != DT_DIR && (IS_FILE_EXT(name, ".jpg") || IS_FILE_EXT(name, ".jpeg"))) {
+            resp_writer_puts(w, "<img loading=\"lazy\" alt=\"\" style=\"max-height:48px;vertical-align:middle\" src=\"/img");
+            resp_writer_html_escaped(w, req->uri);
+            resp_writer_html_escaped(w, name);
+            resp_writer_printf(w, "?w=%d\"> ", CONFIG_HTTP_SERVER_IMG_PREVIEW_WIDTH);
+        }
+#endif
+        resp_writer_html_escaped(w, name);
+        resp_writer_printf(w, "</a></td><td>%s</td><td>%lu</td><td>%s</td><td>", entrytype, (unsigned long)entry->size, date);
+        resp_writer_puts(w, "<form method=\"post\" action=\"/delete");
+        resp_writer_html_escaped(w, req->uri);
+        resp_writer_html_escaped(w, name);
+        resp_writer_puts(w, "\"><button type=\"submit\">Delete</button></form></td></tr>\n");
+    }
+
+    resp_writer_puts(w, "</tbody></table>");
+}
+
+static esp_err_t index_html_get_handler(httpd_req_t *req) {
+    httpd_resp_set_status(req, "307 Temporary Redirect");
+    httpd_resp_set_hdr(req, "Location", "/");
+    httpd_resp_send(req, NULL, 0);
+    return ESP_OK;
+}
+
+/**
+ * @brief Write a raw, already formatted response to the client socket.
+ */
+static esp_err_t httpd_send_raw(httpd_req_t *req, const char *buf, size_t len) {
+    admission_pace(httpd_req_to_sockfd(req), len);
+    while (len > 0) {
+        int sent = httpd_send(req, buf, len);
+        if (sent < 0) {
+            return ESP_FAIL;
+        }
+        http_metrics_add_bytes_sent(sent);
+        buf += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t file_list_html(httpd_req_t *req, const char *dirpath) {
+    char clean_dirpath[FILE_PATH_MAX];
+    strlcpy(clean_dirpath, dirpath, sizeof(clean_dirpath));
+    size_t dirpath_len = strlen(clean_dirpath);
+    if (clean_dirpath[dirpath_len - 1] == '/') {
+        clean_dirpath[dirpath_len - 1] = '\0';
+    }
+
+    ESP_LOGI(TAG, "Request to list directory : %s", clean_dirpath);
+
+    file_iter_t it;
+    esp_err_t err = file_iter_open(&it, clean_dirpath, FILE_ITER_START);
+    if (req->method == HTTP_HEAD) {
+        // The listing is generated as it is sent, so HEAD gets the headers of a GET without a length
+        static const char list_head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nTransfer-Encoding: chunked\r\n\r\n";
+        static const char list_head_err[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        if (err != ESP_OK) {
+            return httpd_send_raw(req, list_head_err, sizeof(list_head_err) - 1);
+        }
+        file_iter_close(&it);
+        return httpd_send_raw(req, list_head, sizeof(list_head) - 1);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to list directory : %s", clean_dirpath);
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to list directory");
+    }
+
+    struct scratch_pool *pool = &((struct file_server_data *)req->user_ctx)->pool;
+    char *chunk = scratch_pool_lease(pool, pdMS_TO_TICKS(CONFIG_HTTP_SERVER_SCRATCH_LEASE_TIMEOUT_MS));
+    if (chunk) {
+        resp_writer_t w;
+        resp_writer_init(&w, req, chunk, pool->bufsize);
+        send_html_header(&w);
+        send_file_list(&w, req, clean_dirpath, &it);
+        send_html_footer(&w);
+        resp_writer_finish(&w);
+        scratch_pool_release(pool, chunk);
+    }
+
+    file_iter_close(&it);
+
+    if (!chunk) {
+        return send_busy(req, "1", "Server busy");
+    }
     return ESP_OK;
 }
 
-static esp_err_t send_html_footer(httpd_req_t *req) {
-    httpd_resp_sendstr_chunk(req, "</body></html>");
-    httpd_resp_sendstr_chunk(req, NULL);
+struct mime_type {
+    const char *ext;
+    const char *type;
+};
+
+/* Sorted by extension for bsearch() */
+static const struct mime_type mime_types[] = {
+    { "bin",         "application/octet-stream" },
+    { "css",         "text/css" },
+    { "csv",         "text/csv" },
+    { "gif",         "image/gif" },
+    { "gz",          "application/gzip" },
+    { "htm",         "text/html" },
+    { "html",        "text/html" },
+    { "ico",         "image/x-icon" },
+    { "jpeg",        "image/jpeg" },
+    { "jpg",         "image/jpeg" },
+    { "js",          "text/javascript" },
+    { "json",        "application/json" },
+    { "log",         "text/plain" },
+    { "map",         "application/json" },
+    { "mjs",         "text/javascript" },
+    { "mp4",         "video/mp4" },
+    { "pdf",         "application/pdf" },
+    { "png",         "image/png" },
+    { "svg",         "image/svg+xml" },
+    { "txt",         "text/plain" },
+    { "wasm",        "application/wasm" },
+    { "wav",         "audio/wav" },
+    { "webmanifest", "application/manifest+json" },
+    { "webp",        "image/webp" },
+    { "woff",        "font/woff" },
+    { "woff2",       "font/woff2" },
+    { "xml",         "application/xml" },
+    { "zip",         "application/zip" },
+};
+
+static int mime_type_cmp(const void *key, const void *elem) {
+    return strcasecmp((const char *)key, ((const struct mime_type *)elem)->ext);
+}
+
+static const char *content_type_from_file(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    if (!ext || strchr(ext, '/')) {
+        return "text/plain";
+    }
+    const struct mime_type *mime = bsearch(ext + 1, mime_types, sizeof(mime_types) / sizeof(mime_types[0]),
+                                           sizeof(mime_types[0]), mime_type_cmp);
+    return mime ? mime->type : "text/plain";
+}
+
+esp_err_t http_server_set_cache_control(const char *path_prefix, const char *value) {
+    if (!path_prefix || !value || strlen(path_prefix) >= sizeof(cache_control_rules[0].prefix) ||
+        strlen(value) >= sizeof(cache_control_rules[0].value)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    struct cache_control_rule *rule = NULL;
+    for (size_t i = 0; i < cache_control_rule_count; i++) {
+        if (strcmp(cache_control_rules[i].prefix, path_prefix) == 0) {
+            rule = &cache_control_rules[i];
+            break;
+        }
+    }
+    if (!rule) {
+        if (cache_control_rule_count == CACHE_CONTROL_MAX_RULES) {
+            return ESP_ERR_NO_MEM;
+        }
+        rule = &cache_control_rules[cache_control_rule_count++];
+        strlcpy(rule->prefix, path_prefix, sizeof(rule->prefix));
+    }
+    strlcpy(rule->value, value, sizeof(rule->value));
     return ESP_OK;
 }
 
-static esp_err_t send_file_list(httpd_req_t *req, const char *dirpath) {
-    char entrypath[FILE_PATH_MAX];
-    char entrysize[16];
-    char date[30];
-    const char *entrytype;
+/**
+ * @brief Pick the Cache-Control value of the longest matching path prefix.
+ */
+static const char *cache_control_for_path(const char *path) {
+    const char *value = CONFIG_HTTP_SERVER_DEFAULT_CACHE_CONTROL;
+    size_t best_len = 0;
+
+    for (size_t i = 0; i < cache_control_rule_count; i++) {
+        size_t len = strlen(cache_control_rules[i].prefix);
+        if (len >= best_len && strncmp(path, cache_control_rules[i].prefix, len) == 0) {
+            value = cache_control_rules[i].value;
+            best_len = len;
+        }
+    }
+    return value;
+}
+
+static void format_http_date(char *dest, size_t destsize, time_t t) {
+    struct tm tm_info;
+    gmtime_r(&t, &tm_info);
+    strftime(dest, destsize, "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+}
+
+typedef enum {
+    BYTE_RANGE_NONE,            // no usable Range header, send the whole file
+    BYTE_RANGE_OK,
+    BYTE_RANGE_UNSATISFIABLE,
+} byte_range_result_t;
+
+/**
+ * @brief Parse a single "bytes=" range against a file size.
+ *
+ * Multi-range requests are answered with the whole file, which RFC 7233
+ * allows and saves us from generating multipart/byteranges bodies.
+ *
+ * @param value The Range header value.
+ * @param size The file size.
+ * @param start Receives the first byte of the range.
+ * @param end Receives the last byte of the range, inclusive.
+ * @return byte_range_result_t The parse result.
+ */
+static byte_range_result_t parse_byte_range(const char *value, off_t size, off_t *start, off_t *end) {
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) {
+        return BYTE_RANGE_NONE;
+    }
+    value += 6;
+
+    char *endptr;
+    if (*value == '-') {
+        // Suffix range: the last N bytes
+        long long suffix = strtoll(value + 1, &endptr, 10);
+        if (endptr == value + 1 || *endptr) {
+            return BYTE_RANGE_NONE;
+        }
+        if (suffix <= 0 || size == 0) {
+            return BYTE_RANGE_UNSATISFIABLE;
+        }
+        *start = suffix >= size ? 0 : size - suffix;
+        *end = size - 1;
+        return BYTE_RANGE_OK;
+    }
+
+    long long first = strtoll(value, &endptr, 10);
+    if (endptr == value || *endptr != '-' || first < 0) {
+        return BYTE_RANGE_NONE;
+    }
+    value = endptr + 1;
+
+    long long last = size - 1;
+    if (*value) {
+        last = strtoll(value, &endptr, 10);
+        if (*endptr || last < first) {
+            return BYTE_RANGE_NONE;
+        }
+    }
+
+    if (first >= size) {
+        return BYTE_RANGE_UNSATISFIABLE;
+    }
+    *start = first;
+    *end = MIN(last, (long long)size - 1);
+    return BYTE_RANGE_OK;
+}
+
+/**
+ * @brief Cache validators, representation and caching policy of a file response.
+ */
+struct file_validators {
+    char etag[64];
+    char last_modified[32];
+    const char *cache_control;
+    const char *content_type;
+    const char *content_encoding;   // NULL for the identity encoding
+    bool vary;                      // the response depends on Accept-Encoding
+};
+
+/**
+ * @brief Derive a strong ETag and Last-Modified from the file's metadata.
+ *
+ * The ETag comes from the file actually sent, so a precompressed sibling
+ * never shares a validator with the uncompressed original.
+ *
+ * @param v Receives the validators.
+ * @param filename The URI path of the file, used to pick the Cache-Control rule.
+ * @param content_type MIME type of the original file.
+ * @param content_encoding Encoding of the file sent, or NULL.
+ * @param file_stat The metadata of the file sent.
+ */
+static void file_validators_init(struct file_validators *v, const char *filename, const char *content_type,
+                                 const char *content_encoding, const struct stat *file_stat) {
+    snprintf(v->etag, sizeof(v->etag), "\"%lx-%llx-%lx\"",
+             (unsigned long)file_stat->st_size, (unsigned long long)file_stat->st_mtime, (unsigned long)file_stat->st_ino);
+    format_http_date(v->last_modified, sizeof(v->last_modified), file_stat->st_mtime);
+    v->cache_control = cache_control_for_path(filename);
+    v->content_type = content_type;
+    v->content_encoding = content_encoding;
+    v->vary = false;
+}
+
+/**
+ * @brief Check an If-None-Match list against an ETag, using weak comparison.
+ */
+static bool etag_list_matches(const char *list, const char *etag) {
+    const size_t etag_len = strlen(etag);
+
+    while (*list) {
+        while (*list == ' ' || *list == ',') {
+            list++;
+        }
+        if (*list == '*') {
+            return true;
+        }
+        if (strncmp(list, "W/", 2) == 0) {
+            list += 2;
+        }
+        if (strncmp(list, etag, etag_len) == 0 && (list[etag_len] == '\0' || list[etag_len] == ',' || list[etag_len] == ' ')) {
+            return true;
+        }
+        list = strchr(list, ',');
+        if (!list) {
+            break;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Evaluate If-None-Match and If-Modified-Since.
+ *
+ * If-Modified-Since is compared verbatim with Last-Modified, which is what
+ * clients echo back. A date that does not match simply sends the body.
+ *
+ * @return true if the client's copy is current and 304 should be sent.
+ */
+static bool is_not_modified(httpd_req_t *req, const struct file_validators *v) {
+    char value[128];
+
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) == ESP_OK) {
+        return etag_list_matches(value, v->etag);
+    }
+    if (httpd_req_get_hdr_value_str(req, "If-Modified-Since", value, sizeof(value)) == ESP_OK) {
+        return strcmp(value, v->last_modified) == 0;
+    }
+    return false;
+}
+
+/**
+ * @brief Build the raw header block of a file response.
+ *
+ * httpd_resp_send() derives Content-Length from the body it sends, so
+ * responses that need the real file size are written raw. With
+ * include_entity the size and type are reported, as HEAD, 206 and cached
+ * 200 responses require. A 304 leaves them out.
+ *
+ * @param content_length Bytes in the body, the file size or the length of the range.
+ * @param content_range The Content-Range value of a 206, or NULL.
+ * @return int Length of the header block, or -1 if it does not fit.
+ */
+static int build_file_headers(char *head, size_t size, const char *status, off_t content_length,
+                              const char *content_range, const struct file_validators *v, bool include_entity) {
+    int len = snprintf(head, size, "HTTP/1.1 %s\r\n", status);
+    if (include_entity) {
+        len += snprintf(head + len, size - len,
+            "Content-Type: %s\r\n"
+            "Content-Length: %ld\r\n"
+            "Accept-Ranges: bytes\r\n",
+            v->content_type, (long)content_length);
+        if (content_range && (size_t)len < size) {
+            len += snprintf(head + len, size - len, "Content-Range: %s\r\n", content_range);
+        }
+        if (v->content_encoding && (size_t)len < size) {
+            len += snprintf(head + len, size - len, "Content-Encoding: %s\r\n", v->content_encoding);
+        }
+    }
+    if (v->vary && (size_t)len < size) {
+        len += snprintf(head + len, size - len, "Vary: Accept-Encoding\r\n");
+    }
+    if ((size_t)len >= size) {
+        return -1;
+    }
+    len += snprintf(head + len, size - len,
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "Cache-Control: %s\r\n"
+        "\r\n",
+        v->etag, v->last_modified, v->cache_control);
+    return (size_t)len < size ? len : -1;
+}
+
+/**
+ * @brief Answer a HEAD request or a conditional GET without a body.
+ */
+static esp_err_t send_file_headers(httpd_req_t *req, const char *status,
+                                   const struct stat *file_stat, const struct file_validators *v, bool include_entity) {
+    char head[FILE_HEADERS_MAX];
+    int len = build_file_headers(head, sizeof(head), status, file_stat->st_size, NULL, v, include_entity);
+    if (len < 0) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to build response");
+    }
+    return httpd_send_raw(req, head, len);
+}
+
+/**
+ * @brief Send a cached file, precomputed headers and body, in a single send.
+ */
+static esp_err_t send_cached_file(httpd_req_t *req, file_cache_entry_t *cached) {
+    ESP_LOGI(TAG, "Sending cached file : %s (%ld bytes)", cached->path, (long)cached->size);
+    esp_err_t err = httpd_send_raw(req, cached->response, cached->hdr_len + cached->size);
+    file_cache_release(cached);
+    return err;
+}
+
+/**
+ * @brief Check whether an Accept-Encoding list allows a content coding.
+ *
+ * An explicit entry wins over "*", and q=0 refuses the coding.
+ */
+static bool accepts_encoding(const char *list, const char *coding) {
+    const size_t coding_len = strlen(coding);
+    int wildcard = -1;
+
+    while (*list) {
+        while (*list == ' ' || *list == ',') {
+            list++;
+        }
+        const char *end = list + strcspn(list, ",");
+        const size_t token_len = strcspn(list, " ;,");
+        const char *q = strstr(list, "q=");
+        const bool refused = q && q < end && strtod(q + 2, NULL) == 0;
+
+        if (token_len == coding_len && strncasecmp(list, coding, coding_len) == 0) {
+            return !refused;
+        }
+        if (token_len == 1 && *list == '*') {
+            wildcard = !refused;
+        }
+        list = end;
+    }
+    return wildcard == 1;
+}
+
+#if CONFIG_HTTP_SERVER_PRECOMPRESSED
+#define SIBLING_CACHE_SIZE 32
+#define SIBLING_GZ (1u << 0)
+#define SIBLING_BR (1u << 1)
+
+/**
+ * @brief Remembers which precompressed siblings exist next to a file.
+ *
+ * Direct-mapped on the path hash. A collision only costs an extra stat(),
+ * since the chosen sibling is always stat()ed before it is served.
+ */
+struct sibling_cache_entry {
+    uint32_t path_hash;
+    time_t mtime;           // mtime of the original, 0 if it does not exist
+    int64_t checked_us;
+    uint8_t siblings;       // SIBLING_GZ | SIBLING_BR
+    bool valid;
+};
+
+static struct sibling_cache_entry sibling_cache[SIBLING_CACHE_SIZE];
+static portMUX_TYPE sibling_cache_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t sibling_path_hash(const char *path, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)path[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool sibling_exists(char *filepath, size_t len, const char *suffix) {
+    struct stat sibling_stat;
+    strcpy(filepath + len, suffix);
+    bool exists = stat(filepath, &sibling_stat) == 0;
+    filepath[len] = '\0';
+    return exists;
+}
+
+/**
+ * @brief Look up, or probe and remember, the precompressed siblings of a file.
+ *
+ * @param filepath The path of the original file, with room for a 3 byte suffix.
+ * @param mtime mtime of the original, 0 if it does not exist.
+ * @return uint8_t Mask of SIBLING_GZ and SIBLING_BR.
+ */
+static uint8_t sibling_lookup(char *filepath, time_t mtime) {
+    const size_t len = strlen(filepath);
+    const uint32_t hash = sibling_path_hash(filepath, len);
+    struct sibling_cache_entry *slot = &sibling_cache[hash % SIBLING_CACHE_SIZE];
+    const int64_t now = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&sibling_cache_lock);
+    bool hit = slot->valid && slot->path_hash == hash && slot->mtime == mtime &&
+               now - slot->checked_us < (int64_t)CONFIG_HTTP_SERVER_PRECOMPRESSED_CACHE_TTL_MS * 1000;
+    uint8_t siblings = slot->siblings;
+    taskEXIT_CRITICAL(&sibling_cache_lock);
+    if (hit) {
+        return siblings;
+    }
+
+    siblings = sibling_exists(filepath, len, ".gz") ? SIBLING_GZ : 0;
+#if CONFIG_HTTP_SERVER_PRECOMPRESSED_BR
+    siblings |= sibling_exists(filepath, len, ".br") ? SIBLING_BR : 0;
+#endif
+
+    taskENTER_CRITICAL(&sibling_cache_lock);
+    slot->path_hash = hash;
+    slot->mtime = mtime;
+    slot->checked_us = now;
+    slot->siblings = siblings;
+    slot->valid = true;
+    taskEXIT_CRITICAL(&sibling_cache_lock);
+    return siblings;
+}
+
+/**
+ * @brief Forget what is known about a file's siblings, e.g. after one was written or deleted.
+ *
+ * @param filepath The path of an original file or of one of its .gz/.br siblings.
+ */
+static void sibling_cache_forget(const char *filepath) {
+    size_t len = strlen(filepath);
+    if (IS_FILE_EXT(filepath, ".gz") || IS_FILE_EXT(filepath, ".br")) {
+        len -= 3;
+    }
+    const uint32_t hash = sibling_path_hash(filepath, len);
+    struct sibling_cache_entry *slot = &sibling_cache[hash % SIBLING_CACHE_SIZE];
+
+    taskENTER_CRITICAL(&sibling_cache_lock);
+    if (slot->path_hash == hash) {
+        slot->valid = false;
+    }
+    taskEXIT_CRITICAL(&sibling_cache_lock);
+}
+
+/**
+ * @brief Pick a precompressed sibling of a file that the client accepts.
+ *
+ * On success the suffix is appended to filepath and file_stat describes the
+ * sibling. Brotli is preferred over gzip when both are enabled and accepted.
+ *
+ * @param req The request.
+ * @param filepath The path of the original file.
+ * @param size Size of the filepath buffer.
+ * @param file_stat The original's metadata if have_original, receives the sibling's.
+ * @param have_original Whether the original file exists.
+ * @param vary Set when a sibling exists, so the response depends on Accept-Encoding.
+ * @return const char* The Content-Encoding to send, or NULL to send the original.
+ */
+static const char *select_precompressed(httpd_req_t *req, char *filepath, size_t size,
+                                        struct stat *file_stat, bool have_original, bool *vary) {
+    static const struct {
+        uint8_t flag;
+        const char *suffix;
+        const char *coding;
+    } variants[] = {
+        { SIBLING_BR, ".br", "br" },
+        { SIBLING_GZ, ".gz", "gzip" },
+    };
+    const size_t len = strlen(filepath);
+    char accept[128];
+
+    *vary = false;
+    if (len + 4 > size) {
+        return NULL;
+    }
+    uint8_t siblings = sibling_lookup(filepath, have_original ? file_stat->st_mtime : 0);
+    if (!siblings) {
+        return NULL;
+    }
+    *vary = true;
+
+    esp_err_t err = httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept, sizeof(accept));
+    if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        if (!(siblings & variants[i].flag) || !accepts_encoding(accept, variants[i].coding)) {
+            continue;
+        }
+        struct stat sibling_stat;
+        strcpy(filepath + len, variants[i].suffix);
+        if (stat(filepath, &sibling_stat) == 0) {
+            *file_stat = sibling_stat;
+            return variants[i].coding;
+        }
+        filepath[len] = '\0';
+        sibling_cache_forget(filepath);
+    }
+    return NULL;
+}
+#endif // CONFIG_HTTP_SERVER_PRECOMPRESSED
+
+/**
+ * @brief Answer a request from the embedded asset bundle.
+ *
+ * The payload is sent straight from flash, without a copy into RAM.
+ *
+ * @return esp_err_t ESP_ERR_NOT_SUPPORTED if the client does not accept the
+ * stored gzip payload. The caller then tries the filesystem and answers 406
+ * if the file is not there either.
+ */
+static esp_err_t send_asset(httpd_req_t *req, const http_asset_t *asset, const char *filename) {
+    char value[128];
+
+    if (asset->gzip) {
+        esp_err_t err = httpd_req_get_hdr_value_str(req, "Accept-Encoding", value, sizeof(value));
+        if ((err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC) || !accepts_encoding(value, "gzip")) {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+    }
+
+    bool not_modified = httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) == ESP_OK &&
+                        etag_list_matches(value, asset->etag);
+
+    char head[FILE_HEADERS_MAX];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n", not_modified ? "304 Not Modified" : "200 OK");
+    if (!not_modified) {
+        len += snprintf(head + len, sizeof(head) - len,
+            "Content-Type: %s\r\n"
+            "Content-Length: %lu\r\n"
+            "%s",
+            asset->content_type, (unsigned long)asset->size, asset->gzip ? "Content-Encoding: gzip\r\n" : "");
+    }
+    if ((size_t)len < sizeof(head)) {
+        len += snprintf(head + len, sizeof(head) - len,
+            "ETag: %s\r\n"
+            "Cache-Control: %s\r\n"
+            "%s"
+            "\r\n",
+            asset->etag, cache_control_for_path(filename), asset->gzip ? "Vary: Accept-Encoding\r\n" : "");
+    }
+    if ((size_t)len >= sizeof(head)) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to build response");
+    }
+
+    ESP_LOGD(TAG, "Sending embedded asset : %s (%lu bytes)", asset->path, (unsigned long)asset->size);
+    esp_err_t err = httpd_send_raw(req, head, len);
+    if (err == ESP_OK && !not_modified && req->method != HTTP_HEAD) {
+        err = httpd_send_raw(req, (const char *)asset->data, asset->size);
+    }
+    return err;
+}
+
+static const char* get_path_from_uri(char *dest, const char *base_path, const char *uri, size_t destsize) {
+    const size_t base_pathlen = strlen(base_path);
+    size_t pathlen = strlen(uri);
+
+    const char *quest = strchr(uri, '?');
+    if (quest) {
+        pathlen = MIN(pathlen, quest - uri);
+    }
+    const char *hash = strchr(uri, '#');
+    if (hash) {
+        pathlen = MIN(pathlen, hash - uri);
+    }
+
+    if (base_pathlen + pathlen + 1 > destsize) {
+        return NULL;
+    }
+
+    strcpy(dest, base_path);
+    strlcpy(dest + base_pathlen, uri, pathlen + 1);
+    return dest + base_pathlen;
+}
+
+static esp_err_t favicon_get_handler(httpd_req_t *req)
+{
+    extern const unsigned char favicon_ico_start[] asm("_binary_favicon_ico_start");
+    extern const unsigned char favicon_ico_end[]   asm("_binary_favicon_ico_end");
+    const size_t favicon_ico_size = (favicon_ico_end - favicon_ico_start);
+    httpd_resp_set_type(req, "image/x-icon");
+    httpd_resp_send(req, (const char *)favicon_ico_start, favicon_ico_size);
+    return ESP_OK;
+}
+
+static esp_err_t send_chunk_sink(void *ctx, const char *data, size_t len) {
+    admission_pace(httpd_req_to_sockfd((httpd_req_t *)ctx), len);
+    esp_err_t err = httpd_resp_send_chunk((httpd_req_t *)ctx, data, len);
+    if (err == ESP_OK) {
+        http_metrics_add_bytes_sent(len);
+    }
+    return err;
+}
+
+static esp_err_t send_raw_sink(void *ctx, const char *data, size_t len) {
+    return httpd_send_raw((httpd_req_t *)ctx, data, len);
+}
+
+static esp_err_t download_file_get_handler(httpd_req_t *req) {
+    char filepath[FILE_PATH_MAX];
+    int fd = -1;
+    struct stat file_stat;
+    struct file_server_data *server_data = (struct file_server_data *)req->user_ctx;
+
+    const char *filename = get_path_from_uri(filepath, server_data->base_path, req->uri, sizeof(filepath));
+    ESP_LOGI(TAG, "Filename: %s", filename);
+
+    if (!filename) {
+        ESP_LOGE(TAG, "Filename is too long");
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+    }
+    if (is_reserved_path(filename)) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_404_NOT_FOUND, "File does not exist");
+    }
+
+    if (filename[strlen(filename) - 1] == '/') {
+        ESP_LOGI(TAG, "Responding with directory contents of %s", filepath);
+        return file_list_html(req, filepath);
+    }
+
+    // The embedded bundle answers from flash before the filesystem is consulted
+    const http_asset_t *asset = http_asset_find(filename);
+    bool asset_refused = false;
+    if (asset) {
+        esp_err_t err = send_asset(req, asset, filename);
+        if (err != ESP_ERR_NOT_SUPPORTED) {
+            return err;
+        }
+        asset_refused = true;
+    }
+
+    // The MIME type is that of the original, also when a compressed sibling is sent
+    const char *content_type = content_type_from_file(filename);
+    const char *content_encoding = NULL;
+    bool have_file = stat(filepath, &file_stat) == 0;
+    bool vary = false;
+#if CONFIG_HTTP_SERVER_PRECOMPRESSED
+    content_encoding = select_precompressed(req, filepath, sizeof(filepath), &file_stat, have_file, &vary);
+#endif
+
+    if (!have_file && !content_encoding) {
+        if (strcmp(filename, "/index.html") == 0) {
+            return index_html_get_handler(req);
+        } else if (strcmp(filename, "/favicon.ico") == 0) {
+            return favicon_get_handler(req);
+        }
+        if (asset_refused) {
+            // The bundle has the file, but only in an encoding the client refused
+            ESP_LOGW(TAG, "Client does not accept gzip for embedded asset : %s", filename);
+            httpd_resp_set_status(req, "406 Not Acceptable");
+            httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+            httpd_resp_sendstr(req, "Resource is only available gzip-compressed");
+            return ESP_OK;
+        }
+        ESP_LOGE(TAG, "Failed to stat file : %s", filepath);
+        HTTP_RESP_SEND_ERR(req, HTTPD_404_NOT_FOUND, "File does not exist");
+    }
+
+    struct file_validators validators;
+    file_validators_init(&validators, filename, content_type, content_encoding, &file_stat);
+    validators.vary = vary;
+
+    // Revalidation is answered before the file is ever opened
+    if (is_not_modified(req, &validators)) {
+        return send_file_headers(req, "304 Not Modified", &file_stat, &validators, false);
+    }
+    if (req->method == HTTP_HEAD) {
+        return send_file_headers(req, "200 OK", &file_stat, &validators, true);
+    }
+
+    char content_range[72];
+    off_t range_start = 0;
+    off_t range_end = file_stat.st_size - 1;
+    bool partial = false;
+
+    char range[64];
+    if (httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) == ESP_OK) {
+        // If-Range asks for the range only while the file is unchanged
+        char if_range[64];
+        bool range_valid = httpd_req_get_hdr_value_str(req, "If-Range", if_range, sizeof(if_range)) != ESP_OK ||
+                           strcmp(if_range, validators.etag) == 0 || strcmp(if_range, validators.last_modified) == 0;
+
+        switch (range_valid ? parse_byte_range(range, file_stat.st_size, &range_start, &range_end) : BYTE_RANGE_NONE) {
+        case BYTE_RANGE_OK:
+            partial = true;
+            break;
+        case BYTE_RANGE_UNSATISFIABLE:
+            snprintf(content_range, sizeof(content_range), "bytes */%ld", (long)file_stat.st_size);
+            httpd_resp_set_status(req, "416 Range Not Satisfiable");
+            httpd_resp_set_hdr(req, "Content-Range", content_range);
+            httpd_resp_send(req, NULL, 0);
+            return ESP_OK;
+        case BYTE_RANGE_NONE:
+            range_start = 0;
+            range_end = file_stat.st_size - 1;
+            break;
+        }
+    }
+
+    if (!is_on_async_worker_thread()) {
+        // Small whole-file requests are answered from RAM without touching the filesystem
+        if (!partial && file_cache_eligible(&file_stat)) {
+            file_cache_entry_t *cached = file_cache_get(filepath, validators.content_encoding, &file_stat);
+            if (cached) {
+                return send_cached_file(req, cached);
+            }
+        }
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+        if (submit_async_req(req, download_file_get_handler) == ESP_OK) {
+            return ESP_OK;
+        }
+#endif
+    }
+
+    if (!partial && file_cache_eligible(&file_stat)) {
+        char head[FILE_HEADERS_MAX];
+        int hdr_len = build_file_headers(head, sizeof(head), "200 OK", file_stat.st_size, NULL, &validators, true);
+        file_cache_entry_t *cached = hdr_len < 0 ? NULL : file_cache_fill(filepath, validators.content_encoding, &file_stat, head, hdr_len);
+        if (cached) {
+            return send_cached_file(req, cached);
+        }
+    }
+
+    char *chunks[2] = { NULL, NULL };
+    chunks[0] = scratch_pool_lease(&server_data->pool, pdMS_TO_TICKS(CONFIG_HTTP_SERVER_SCRATCH_LEASE_TIMEOUT_MS));
+    if (!chunks[0]) {
+        ESP_LOGW(TAG, "No free I/O buffer for : %s", filename);
+        return send_busy(req, "1", "Server busy");
+    }
+#if CONFIG_HTTP_SERVER_READAHEAD
+    // A second buffer enables read-ahead, without it the file is sent the plain way
+    if (file_stat.st_size > (off_t)server_data->pool.bufsize) {
+        chunks[1] = scratch_pool_lease(&server_data->pool, 0);
+    }
+#endif
+
+    fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        scratch_pool_release(&server_data->pool, chunks[0]);
+        scratch_pool_release(&server_data->pool, chunks[1]);
+        ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+    }
+
+    if (range_start > 0 && lseek(fd, range_start, SEEK_SET) != range_start) {
+        close(fd);
+        scratch_pool_release(&server_data->pool, chunks[0]);
+        scratch_pool_release(&server_data->pool, chunks[1]);
+        ESP_LOGE(TAG, "Failed to seek in file : %s", filepath);
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+    }
+
+    esp_err_t err;
+    if (partial) {
+        // The 206 reports the length of the range, so it goes out raw like HEAD and 304 responses
+        ESP_LOGI(TAG, "Sending file : %s (bytes %ld-%ld of %ld)...", filename, (long)range_start, (long)range_end, file_stat.st_size);
+        snprintf(content_range, sizeof(content_range), "bytes %ld-%ld/%ld", (long)range_start, (long)range_end, (long)file_stat.st_size);
+        char head[FILE_HEADERS_MAX];
+        int hdr_len = build_file_headers(head, sizeof(head), "206 Partial Content", range_end - range_start + 1,
+                                         content_range, &validators, true);
+        err = hdr_len < 0 ? ESP_FAIL : httpd_send_raw(req, head, hdr_len);
+        if (err == ESP_OK) {
+            err = file_reader_stream(fd, range_start, range_end - range_start + 1, file_stat.st_blksize,
+                                     chunks, server_data->pool.bufsize, send_raw_sink, req);
+        }
+    } else {
+        httpd_resp_set_type(req, validators.content_type);
+        if (validators.content_encoding) {
+            httpd_resp_set_hdr(req, "Content-Encoding", validators.content_encoding);
+        }
+        if (validators.vary) {
+            httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+        }
+        httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+        httpd_resp_set_hdr(req, "ETag", validators.etag);
+        httpd_resp_set_hdr(req, "Last-Modified", validators.last_modified);
+        httpd_resp_set_hdr(req, "Cache-Control", validators.cache_control);
+        ESP_LOGI(TAG, "Sending file : %s (%ld bytes)...", filename, file_stat.st_size);
+        err = file_reader_stream(fd, 0, file_stat.st_size, file_stat.st_blksize,
+                                 chunks, server_data->pool.bufsize, send_chunk_sink, req);
+    }
+    close(fd);
+    scratch_pool_release(&server_data->pool, chunks[0]);
+    scratch_pool_release(&server_data->pool, chunks[1]);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "File sending failed!");
+        if (partial) {
+            // The headers announced the whole range, all that is left is to close the connection
+            return ESP_FAIL;
+        }
+        httpd_resp_sendstr_chunk(req, NULL);
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
+    }
+    ESP_LOGI(TAG, "File sending complete");
+    if (!partial) {
+        httpd_resp_send_chunk(req, NULL, 0);
+    }
+    return ESP_OK;
+}
+
+#if CONFIG_HTTP_SERVER_IMG_RESIZE
+static void image_cache_forget(const char *base_path, const char *filepath, const struct stat *file_stat);
+#endif
+
+static esp_err_t delete_file_post_handler(httpd_req_t *req) {
+    char filepath[FILE_PATH_MAX];
+    struct stat file_stat;
+
+    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path, req->uri + sizeof("/delete") - 1, sizeof(filepath));
+    if (!filename) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+    }
+    if (is_reserved_path(filename)) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_403_FORBIDDEN, "Reserved path");
+    }
+
+    if (filename[strlen(filename) - 1] == '/') {
+        ESP_LOGE(TAG, "Invalid filename : %s", filename);
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Invalid filename");
+    }
+
+    if (stat(filepath, &file_stat) == -1) {
+        ESP_LOGE(TAG, "File does not exist : %s", filename);
+        HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, "File does not exist");
+    }
+
+    ESP_LOGI(TAG, "Deleting file : %s", filename);
+#if CONFIG_HTTP_SERVER_IMG_RESIZE
+    image_cache_forget(((struct file_server_data *)req->user_ctx)->base_path, filepath, &file_stat);
+#endif
+    unlink(filepath);
+    file_cache_invalidate(filepath);
+#if CONFIG_HTTP_SERVER_PRECOMPRESSED
+    sibling_cache_forget(filepath);
+#endif
+    httpd_resp_set_status(req, "303 See Other");
+    httpd_resp_set_hdr(req, "Location", "/");
+    httpd_resp_sendstr(req, "File deleted successfully");
+    return ESP_OK;
+}
+
+/**
+ * @brief State of a file upload in progress.
+ */
+struct upload {
+    char path[FILE_PATH_MAX];           // destination
+    char tmppath[FILE_PATH_MAX + 4];    // data is written here and renamed to path when complete
+    const char *name;                   // URI part of path
+    int fd;
+    size_t written;
+    bool multipart;
+    char delim[80];                     // "\r\n--<boundary>" ending the file part
+    size_t delim_len;
+    const char *error_status;
+    const char *error_msg;
+};
+
+/* memmem() is a GNU extension that newlib only declares with _GNU_SOURCE */
+static const char *mem_find(const char *haystack, size_t len, const char *needle, size_t needle_len) {
+    for (const char *p = haystack; needle_len <= len && p <= haystack + len - needle_len; p++) {
+        p = memchr(p, needle[0], len - needle_len - (p - haystack) + 1);
+        if (!p) {
+            break;
+        }
+        if (memcmp(p, needle, needle_len) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t upload_error(struct upload *up, const char *status, const char *msg) {
+    up->error_status = status;
+    up->error_msg = msg;
+    return ESP_FAIL;
+}
+
+/**
+ * @brief Query the free space of the filesystem mounted at base_path.
+ *
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED if the filesystem is neither FAT nor SPIFFS.
+ */
+static esp_err_t get_free_space(const char *base_path, uint64_t *free_bytes) {
+#if CONFIG_IDF_TARGET_LINUX
+    return ESP_ERR_NOT_SUPPORTED;
+#else
+    uint64_t total = 0;
+    if (esp_vfs_fat_info(base_path, &total, free_bytes) == ESP_OK) {
+        return ESP_OK;
+    }
+
+    size_t spiffs_total = 0, spiffs_used = 0;
+    if (esp_spiffs_info(NULL, &spiffs_total, &spiffs_used) == ESP_OK) {
+        *free_bytes = spiffs_total > spiffs_used ? spiffs_total - spiffs_used : 0;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * @brief Read the multipart boundary from the Content-Type of the request.
+ *
+ * @return true if the body is multipart/form-data with a usable boundary.
+ */
+static bool upload_parse_boundary(httpd_req_t *req, struct upload *up) {
+    char content_type[128];
+    if (httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type)) != ESP_OK ||
+        strncasecmp(content_type, "multipart/form-data", strlen("multipart/form-data")) != 0) {
+        return false;
+    }
+
+    const char *boundary = strstr(content_type, "boundary=");
+    if (!boundary) {
+        return false;
+    }
+    boundary += strlen("boundary=");
+    size_t len = strcspn(boundary, "\";");
+    if (*boundary == '"') {
+        boundary++;
+        len = strcspn(boundary, "\"");
+    }
+    if (len == 0 || len + 4 >= sizeof(up->delim)) {
+        return false;
+    }
+    up->delim_len = snprintf(up->delim, sizeof(up->delim), "\r\n--%.*s", (int)len, boundary);
+    return true;
+}
+
+/**
+ * @brief Create the temporary file the upload is written to.
+ */
+static esp_err_t upload_open(struct upload *up) {
+    if (strstr(up->name, "..")) {
+        return upload_error(up, "400 Bad Request", "Invalid filename");
+    }
+    if (is_reserved_path(up->name)) {
+        return upload_error(up, "403 Forbidden", "Reserved path");
+    }
+    snprintf(up->tmppath, sizeof(up->tmppath), "%s.tmp", up->path);
+    // An existing temporary file belongs to another upload of the same file
+    up->fd = open(up->tmppath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (up->fd < 0 && errno == EEXIST) {
+        ESP_LOGW(TAG, "Upload already in progress : %s", up->name);
+        return upload_error(up, "409 Conflict", "Upload of this file already in progress");
+    }
+    if (up->fd < 0) {
+        ESP_LOGE(TAG, "Failed to create file : %s", up->tmppath);
+        return upload_error(up, "500 Internal Server Error", "Failed to create file");
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Move the completed temporary file into place.
+ *
+ * FAT cannot rename over an existing file, so the old file is renamed to
+ * <path>.bak first and removed only once the new one is in place. If that
+ * fails the old file is restored. A power loss in between leaves the old file
+ * under <path>.bak, which the next upload of the same file puts back first.
+ */
+static esp_err_t upload_commit(struct upload *up) {
+    char bakpath[FILE_PATH_MAX + 4];
+    struct stat st;
+
+    snprintf(bakpath, sizeof(bakpath), "%s.bak", up->path);
+    if (stat(up->path, &st) != 0) {
+        rename(bakpath, up->path);
+    }
+    unlink(bakpath);
+
+    bool had_old = rename(up->path, bakpath) == 0;
+    if (!had_old && errno != ENOENT) {
+        ESP_LOGE(TAG, "Failed to move aside %s", up->path);
+        return upload_error(up, "500 Internal Server Error", "Failed to save file");
+    }
+    if (rename(up->tmppath, up->path) != 0) {
+        ESP_LOGE(TAG, "Failed to rename %s to %s", up->tmppath, up->path);
+        if (had_old && rename(bakpath, up->path) != 0) {
+            ESP_LOGE(TAG, "Failed to restore %s", up->path);
+        }
+        return upload_error(up, "500 Internal Server Error", "Failed to save file");
+    }
+    if (had_old) {
+        unlink(bakpath);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Skip the part headers that precede the file in a multipart body.
+ *
+ * When the upload URI names a directory, the file name is taken from the
+ * part's Content-Disposition.
+ *
+ * @return size_t Number of bytes to skip, or 0 if the headers are incomplete.
+ */
+static size_t upload_skip_part_headers(struct upload *up, const char *buf, size_t len) {
+    const char *hdr_end = mem_find(buf, len, "\r\n\r\n", 4);
+    if (!hdr_end) {
+        return 0;
+    }
+
+    // The body opens with the boundary line, without the leading CRLF of the delimiter
+    if (len < up->delim_len - 2 || memcmp(buf, up->delim + 2, up->delim_len - 2) != 0) {
+        return 0;
+    }
+
+    const size_t path_len = strlen(up->path);
+    if (up->path[path_len - 1] == '/') {
+        const char *fname = mem_find(buf, hdr_end - buf, "filename=\"", strlen("filename=\""));
+        if (!fname) {
+            return 0;
+        }
+        fname += strlen("filename=\"");
+        size_t fname_len = strcspn(fname, "\"\r\n");
+        if (fname_len == 0 || memchr(fname, '/', fname_len) || path_len + fname_len >= sizeof(up->path)) {
+            return 0;
+        }
+        strlcpy(up->path + path_len, fname, fname_len + 1);
+    }
+    return hdr_end + 4 - buf;
+}
+
+/**
+ * @brief Receive the request body and write the file data to the temporary file.
+ *
+ * Data is collected into a whole pool buffer before each write(), so the
+ * filesystem sees large writes instead of one per TCP segment. In a multipart
+ * body, the last delim_len - 1 bytes of each buffer are held back, since they
+ * may be the start of the closing delimiter.
+ */
+static esp_err_t upload_receive(httpd_req_t *req, struct upload *up, char *buf, size_t bufsize) {
+    size_t remaining = req->content_len;
+    size_t fill = 0;
+    bool in_headers = up->multipart;
+    int timeouts = 0;
+
+    if (!up->multipart && upload_open(up) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    while (true) {
+        if (remaining > 0 && fill < bufsize) {
+            int received = httpd_req_recv(req, buf + fill, MIN(remaining, bufsize - fill));
+            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+                // Each timeout already waited recv_wait_timeout, a stalled client is not waited for forever
+                if (++timeouts > UPLOAD_RECV_RETRIES) {
+                    ESP_LOGE(TAG, "File reception timed out : %s", up->name);
+                    return upload_error(up, "408 Request Timeout", "Timed out receiving file");
+                }
+                continue;
+            }
+            if (received <= 0) {
+                ESP_LOGE(TAG, "File reception failed : %s", up->name);
+                return upload_error(up, "500 Internal Server Error", "Failed to receive file");
+            }
+            timeouts = 0;
+            fill += received;
+            remaining -= received;
+            if (fill < bufsize && remaining > 0) {
+                continue;
+            }
+        }
+
+        size_t out = fill;  // bytes of buf that belong to the file
+        size_t keep = 0;    // bytes held back for the next round
+        bool done = remaining == 0;
+        if (in_headers) {
+            size_t skip = upload_skip_part_headers(up, buf, fill);
+            if (skip == 0) {
+                return upload_error(up, "400 Bad Request", "Malformed multipart body");
+            }
+            if (upload_open(up) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            memmove(buf, buf + skip, fill - skip);
+            fill -= skip;
+            in_headers = false;
+            continue;
+        }
+        if (up->multipart) {
+            const char *end = mem_find(buf, fill, up->delim, up->delim_len);
+            if (end) {
+                out = end - buf;
+                done = true;
+            } else if (done) {
+                return upload_error(up, "400 Bad Request", "Malformed multipart body");
+            } else {
+                keep = MIN(fill, up->delim_len - 1);
+                out = fill - keep;
+            }
+        }
+
+        if (up->written + out > MAX_FILE_SIZE) {
+            return upload_error(up, "413 Payload Too Large", "File too large");
+        }
+        int64_t write_start = esp_timer_get_time();
+        for (size_t off = 0; off < out;) {
+            ssize_t n = write(up->fd, buf + off, out - off);
+            if (n <= 0) {
+                ESP_LOGE(TAG, "Failed to write file : %s", up->tmppath);
+                return upload_error(up, "507 Insufficient Storage", "Failed to write file");
+            }
+            off += n;
+        }
+        http_metrics_add_storage_write(out, esp_timer_get_time() - write_start);
+        up->written += out;
+
+        if (done) {
+            return ESP_OK;
+        }
+        memmove(buf, buf + out, keep);
+        fill = keep;
+    }
+}
+
+/**
+ * @brief Receive a file with POST or PUT /upload/<path>.
+ *
+ * The body is either the raw file or multipart/form-data, as sent by an HTML
+ * form. When the path ends with '/', the form's file name is used. The file
+ * only replaces an existing one once it has been received completely.
+ */
+static esp_err_t upload_file_handler(httpd_req_t *req) {
+    struct file_server_data *server_data = (struct file_server_data *)req->user_ctx;
+    struct upload up = { .fd = -1 };
+
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+    if (!is_on_async_worker_thread() && submit_async_req(req, upload_file_handler) == ESP_OK) {
+        return ESP_OK;
+    }
+#endif
+
+    up.name = get_path_from_uri(up.path, server_data->base_path, req->uri + sizeof("/upload") - 1, sizeof(up.path));
+    if (!up.name || up.name[0] == '\0') {
+        HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid filename");
+    }
+    up.multipart = upload_parse_boundary(req, &up);
+    if (!up.multipart && up.name[strlen(up.name) - 1] == '/') {
+        HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid filename");
+    }
+
+    size_t limit = MAX_FILE_SIZE + (up.multipart ? MULTIPART_OVERHEAD_MAX : 0);
+    if (req->content_len > limit) {
+        ESP_LOGE(TAG, "Upload too large : %s (%u bytes)", up.name, (unsigned)req->content_len);
+        httpd_resp_set_status(req, "413 Payload Too Large");
+        httpd_resp_sendstr(req, "File too large");
+        return ESP_FAIL;
+    }
+
+    uint64_t free_bytes;
+    if (get_free_space(server_data->base_path, &free_bytes) == ESP_OK && req->content_len > free_bytes) {
+        ESP_LOGE(TAG, "Not enough space for : %s (%u bytes, %llu free)", up.name, (unsigned)req->content_len, (unsigned long long)free_bytes);
+        httpd_resp_set_status(req, "507 Insufficient Storage");
+        httpd_resp_sendstr(req, "Not enough free space");
+        return ESP_FAIL;
+    }
+
+    char *chunk = scratch_pool_lease(&server_data->pool, pdMS_TO_TICKS(CONFIG_HTTP_SERVER_SCRATCH_LEASE_TIMEOUT_MS));
+    if (!chunk) {
+        ESP_LOGW(TAG, "No free I/O buffer for : %s", up.name);
+        return send_busy(req, "1", "Server busy");
+    }
+
+    ESP_LOGI(TAG, "Receiving file : %s (%u bytes)...", up.name, (unsigned)req->content_len);
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err = upload_receive(req, &up, chunk, server_data->pool.bufsize);
+    scratch_pool_release(&server_data->pool, chunk);
+
+    if (up.fd >= 0) {
+        if (err == ESP_OK && fsync(up.fd) != 0) {
+            err = upload_error(&up, "500 Internal Server Error", "Failed to write file");
+        }
+        close(up.fd);
+    }
+    if (err == ESP_OK) {
+        err = upload_commit(&up);
+    }
+    if (err != ESP_OK) {
+        if (up.fd >= 0) {
+            unlink(up.tmppath);
+        }
+        httpd_resp_set_status(req, up.error_status);
+        httpd_resp_sendstr(req, up.error_msg);
+        return ESP_FAIL;
+    }
+
+    file_cache_invalidate(up.path);
+#if CONFIG_HTTP_SERVER_PRECOMPRESSED
+    sibling_cache_forget(up.path);
+#endif
+
+    int64_t elapsed_us = MAX(esp_timer_get_time() - start_us, 1);
+    ESP_LOGI(TAG, "Received file : %s (%u bytes in %lld ms, %llu KB/s)", up.name, (unsigned)up.written,
+             (long long)(elapsed_us / 1000), (unsigned long long)up.written * 1000000 / elapsed_us / 1024);
+
+    if (req->method == HTTP_PUT) {
+        httpd_resp_set_status(req, "201 Created");
+        httpd_resp_send(req, NULL, 0);
+    } else {
+        httpd_resp_set_status(req, "303 See Other");
+        httpd_resp_set_hdr(req, "Location", "/");
+        httpd_resp_sendstr(req, "File uploaded successfully");
+    }
+    return ESP_OK;
+}
+
+#define TAR_BLOCK_SIZE 512
+#define ARCHIVE_MAX_DEPTH 8
+#define ARCHIVE_PATH_MAX 256
+
+/**
+ * @brief A ustar header block.
+ */
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct archive_filter {
+    time_t since;   // 0 for no lower bound
+    time_t until;   // 0 for no upper bound
+    bool at_base;   // the tree is the whole base path, whose reserved directories are left out
+};
+
+/**
+ * @brief Write a ustar header block for a file or directory straight into the writer's buffer.
+ *
+ * Names longer than 100 bytes are split into prefix and name at a '/'.
+ *
+ * @return esp_err_t ESP_ERR_INVALID_SIZE if the name cannot be represented, else the writer's state.
+ */
+static esp_err_t tar_write_header(resp_writer_t *w, const char *name, bool is_dir, off_t size, time_t mtime) {
+    size_t name_len = strlen(name) + (is_dir ? 1 : 0);
+    const char *split = name;
+    if (name_len > sizeof(((struct tar_header *)0)->name)) {
+        // The prefix must hold everything up to a '/', the name field the rest
+        split = strchr(name + name_len - 1 - sizeof(((struct tar_header *)0)->name), '/');
+        if (!split || split - name > (ptrdiff_t)sizeof(((struct tar_header *)0)->prefix)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    size_t avail;
+    struct tar_header *hdr = (struct tar_header *)resp_writer_reserve(w, TAR_BLOCK_SIZE, &avail);
+    memset(hdr, 0, TAR_BLOCK_SIZE);
+    if (split != name) {
+        memcpy(hdr->prefix, name, split - name);
+        name = split + 1;
+    }
+    // The name field needs no terminator when it is full
+    const size_t field_len = strlen(name);
+    memcpy(hdr->name, name, field_len);
+    if (is_dir) {
+        hdr->name[field_len] = '/';
+    }
+    snprintf(hdr->mode, sizeof(hdr->mode), "%07o", is_dir ? 0755 : 0644);
+    snprintf(hdr->uid, sizeof(hdr->uid), "%07o", 0);
+    snprintf(hdr->gid, sizeof(hdr->gid), "%07o", 0);
+    snprintf(hdr->size, sizeof(hdr->size), "%011llo", is_dir ? 0ULL : (unsigned long long)size);
+    snprintf(hdr->mtime, sizeof(hdr->mtime), "%011llo", (unsigned long long)mtime);
+    hdr->typeflag = is_dir ? '5' : '0';
+    memcpy(hdr->magic, "ustar", 6);
+    memcpy(hdr->version, "00", 2);
+
+    unsigned int chksum = 0;
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        chksum += ((uint8_t *)hdr)[i];
+    }
+    snprintf(hdr->chksum, sizeof(hdr->chksum), "%06o", chksum);
+    hdr->chksum[7] = ' ';
+
+    resp_writer_commit(w, TAR_BLOCK_SIZE);
+    return w->err;
+}
+
+/**
+ * @brief Append a file's header and contents, read straight into the writer's buffer.
+ *
+ * Exactly the size announced in the header is sent, padded with zeros if
+ * the file shrank while it was read.
+ */
+static esp_err_t tar_write_file(resp_writer_t *w, const char *path, const char *name, const struct stat *file_stat) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ESP_LOGW(TAG, "Skipping unreadable file : %s", path);
+        return ESP_OK;
+    }
+
+    esp_err_t err = tar_write_header(w, name, false, file_stat->st_size, file_stat->st_mtime);
+    if (err == ESP_ERR_INVALID_SIZE) {
+        ESP_LOGW(TAG, "Skipping file with too long a name : %s", path);
+        close(fd);
+        return ESP_OK;
+    }
+
+    off_t remaining = file_stat->st_size;
+    size_t padding = (TAR_BLOCK_SIZE - (file_stat->st_size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+    while (w->err == ESP_OK && remaining > 0) {
+        size_t avail;
+        char *dst = resp_writer_reserve(w, TAR_BLOCK_SIZE, &avail);
+        ssize_t n = read(fd, dst, MIN((off_t)avail, remaining));
+        if (n <= 0) {
+            ESP_LOGW(TAG, "File shrank while archiving : %s", path);
+            n = MIN((off_t)avail, remaining);
+            memset(dst, 0, n);
+        }
+        resp_writer_commit(w, n);
+        remaining -= n;
+    }
+    close(fd);
+
+    static const char zeros[TAR_BLOCK_SIZE] = { 0 };
+    return resp_writer_append(w, zeros, padding);
+}
+
+/**
+ * @brief Stream a directory tree as a ustar archive.
+ *
+ * The tree is walked depth-first without recursion, holding one open
+ * directory per level. Names in the archive start with the directory's own name.
+ */
+static esp_err_t tar_write_tree(resp_writer_t *w, const char *dirpath, const struct archive_filter *filter) {
+    DIR *dirs[ARCHIVE_MAX_DEPTH];
+    size_t path_lens[ARCHIVE_MAX_DEPTH];
+    char path[ARCHIVE_PATH_MAX];
+    unsigned files = 0;
+
+    strlcpy(path, dirpath, sizeof(path));
+    const char *slash = strrchr(path, '/');
+    const size_t root_len = slash ? slash - path + 1 : 0;
+
+    int depth = 0;
+    path_lens[0] = strlen(path);
+    dirs[0] = opendir(path);
+    if (!dirs[0]) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    while (depth >= 0 && w->err == ESP_OK) {
+        struct dirent *de = readdir(dirs[depth]);
+        if (!de) {
+            closedir(dirs[depth--]);
+            continue;
+        }
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+            (depth == 0 && filter->at_base && is_reserved_path(de->d_name))) {
+            continue;
+        }
+
+        const size_t base = path_lens[depth];
+        if (snprintf(path + base, sizeof(path) - base, "/%s", de->d_name) >= (int)(sizeof(path) - base)) {
+            ESP_LOGW(TAG, "Skipping entry with too long a path : %s", de->d_name);
+            continue;
+        }
+
+        struct stat entry_stat;
+        if (stat(path, &entry_stat) != 0) {
+            continue;
+        }
+        if (S_ISDIR(entry_stat.st_mode)) {
+            if (depth + 1 == ARCHIVE_MAX_DEPTH) {
+                ESP_LOGW(TAG, "Skipping directory nested too deep : %s", path);
+                continue;
+            }
+            DIR *sub = opendir(path);
+            if (!sub) {
+                continue;
+            }
+            tar_write_header(w, path + root_len, true, 0, entry_stat.st_mtime);
+            dirs[++depth] = sub;
+            path_lens[depth] = strlen(path);
+            continue;
+        }
+
+        if ((filter->since && entry_stat.st_mtime < filter->since) ||
+            (filter->until && entry_stat.st_mtime > filter->until)) {
+            continue;
+        }
+        tar_write_file(w, path, path + root_len, &entry_stat);
+        files++;
+    }
+
+    while (depth >= 0) {
+        closedir(dirs[depth--]);
+    }
+
+    // End of archive: two zero blocks
+    static const char zeros[2 * TAR_BLOCK_SIZE] = { 0 };
+    resp_writer_append(w, zeros, sizeof(zeros));
+    ESP_LOGI(TAG, "Archived %u files from %s", files, dirpath);
+    return w->err;
+}
+
+/**
+ * @brief Download a directory tree as a TAR archive: GET /archive/<dir>?since=&until=
+ *
+ * since and until limit the files to an mtime range, in seconds since the epoch.
+ * The archive is generated while it is sent, through one pool buffer and
+ * without temporary files.
+ */
+static esp_err_t archive_get_handler(httpd_req_t *req) {
+    struct file_server_data *server_data = (struct file_server_data *)req->user_ctx;
+    char dirpath[FILE_PATH_MAX];
+    char query[96] = "";
+    char value[24];
+    char disposition[96];
+    struct archive_filter filter = { 0 };
+    struct stat dir_stat;
+
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+    if (!is_on_async_worker_thread() && submit_async_req(req, archive_get_handler) == ESP_OK) {
+        return ESP_OK;
+    }
+#endif
+
+    const char *dirname = get_path_from_uri(dirpath, server_data->base_path, req->uri + sizeof("/archive") - 1, sizeof(dirpath));
+    if (!dirname || strstr(dirname, "..")) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid path");
+    }
+    if (is_reserved_path(dirname)) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
+    }
+    filter.at_base = dirname[strspn(dirname, "/")] == '\0';
+    size_t dirpath_len = strlen(dirpath);
+    while (dirpath_len > 1 && dirpath[dirpath_len - 1] == '/') {
+        dirpath[--dirpath_len] = '\0';
+    }
+    if (stat(dirpath, &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode)) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
+    }
+
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+    if (httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK) {
+        filter.since = strtoll(value, NULL, 10);
+    }
+    if (httpd_query_key_value(query, "until", value, sizeof(value)) == ESP_OK) {
+        filter.until = strtoll(value, NULL, 10);
+    }
+
+    char *chunk = scratch_pool_lease(&server_data->pool, pdMS_TO_TICKS(CONFIG_HTTP_SERVER_SCRATCH_LEASE_TIMEOUT_MS));
+    if (!chunk) {
+        return send_busy(req, "1", "Server busy");
+    }
+
+    const char *slash = strrchr(dirpath, '/');
+    snprintf(disposition, sizeof(disposition), "attachment; filename=\"%.60s.tar\"", slash ? slash + 1 : dirpath);
+    httpd_resp_set_type(req, "application/x-tar");
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    ESP_LOGI(TAG, "Archiving %s...", dirpath);
+    int64_t start_us = esp_timer_get_time();
+    resp_writer_t w;
+    resp_writer_init(&w, req, chunk, server_data->pool.bufsize);
+    esp_err_t err = tar_write_tree(&w, dirpath, &filter);
+    err = err == ESP_OK ? resp_writer_finish(&w) : err;
+    scratch_pool_release(&server_data->pool, chunk);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Archive download of %s failed", dirpath);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Archive of %s sent in %lld ms", dirpath, (long long)((esp_timer_get_time() - start_us) / 1000));
+    return ESP_OK;
+}
+
+#if CONFIG_HTTP_SERVER_IMG_RESIZE
+/**
+ * @brief Cache key of a scaled image: the source file's identity and the scaling parameters.
+ */
+static uint64_t image_cache_key(const char *filepath, const struct stat *file_stat, unsigned width, unsigned quality) {
+    uint64_t hash = 14695981039346656037ull;
+    const uint64_t params[] = {
+        (uint64_t)file_stat->st_size, (uint64_t)file_stat->st_mtime, (uint64_t)file_stat->st_ino, width, quality,
+    };
+
+    for (const char *p = filepath; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 1099511628211ull;
+    }
+    for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+        for (int shift = 0; shift < 64; shift += 8) {
+            hash = (hash ^ (uint8_t)(params[i] >> shift)) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+/**
+ * @brief Read a whole file into memory, in PSRAM when available.
+ */
+static uint8_t *image_read_file(const char *filepath, size_t size) {
+    uint8_t *buf = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!buf) {
+        buf = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    if (!buf) {
+        return NULL;
+    }
+
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        heap_caps_free(buf);
+        return NULL;
+    }
+    int64_t start_us = esp_timer_get_time();
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, buf + got, size - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    http_metrics_add_storage_read(got, esp_timer_get_time() - start_us);
+
+    if (got != size) {
+        heap_caps_free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/**
+ * @brief Path of the cache entry for a key.
+ *
+ * @return ESP_OK, or ESP_ERR_INVALID_SIZE if the path does not fit in size bytes
+ */
+static esp_err_t image_cache_path(char *cachepath, size_t size, const char *base_path, uint64_t key) {
+    if (snprintf(cachepath, size, "%s/%s/%016llx.jpg", base_path, CONFIG_HTTP_SERVER_IMG_CACHE_DIR,
+                 (unsigned long long)key) >= (int)size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Remove the directory listing preview of a file that is about to be deleted.
+ *
+ * Entries of other widths or qualities stay until image_cache_trim() evicts them.
+ */
+static void image_cache_forget(const char *base_path, const char *filepath, const struct stat *file_stat) {
+    char cachepath[FILE_PATH_MAX];
+
+    if (CONFIG_HTTP_SERVER_IMG_PREVIEW_WIDTH == 0 || !S_ISREG(file_stat->st_mode)) {
+        return;
+    }
+    uint64_t key = image_cache_key(filepath, file_stat, CONFIG_HTTP_SERVER_IMG_PREVIEW_WIDTH, CONFIG_HTTP_SERVER_IMG_QUALITY);
+    if (image_cache_path(cachepath, sizeof(cachepath), base_path, key) == ESP_OK && unlink(cachepath) == 0) {
+        ESP_LOGD(TAG, "Removed cached preview %s", cachepath);
+    }
+}
+
+/**
+ * @brief Evict the oldest cached images until the cache fits in CONFIG_HTTP_SERVER_IMG_CACHE_MAX_SIZE.
+ *
+ * Each pass reads the whole directory, so this only runs after a new entry
+ * was stored, which already cost a full decode and encode.
+ */
+static void image_cache_trim(const char *base_path) {
+    char dirpath[FILE_PATH_MAX];
+    char path[FILE_PATH_MAX];
+    char oldest[FILE_PATH_MAX];
+
+    if (CONFIG_HTTP_SERVER_IMG_CACHE_MAX_SIZE <= 0) {
+        return;
+    }
+    if (snprintf(dirpath, sizeof(dirpath), "%s/%s", base_path, CONFIG_HTTP_SERVER_IMG_CACHE_DIR) >= (int)sizeof(dirpath)) {
+        return;
+    }
+
+    for (;;) {
+        DIR *dir = opendir(dirpath);
+        if (!dir) {
+            return;
+        }
+        struct dirent *entry;
+        struct stat st;
+        off_t total = 0;
+        time_t oldest_mtime = 0;
+        oldest[0] = '\0';
+        while ((entry = readdir(dir)) != NULL) {
+            if (!IS_FILE_EXT(entry->d_name, ".jpg")) {
+                continue;  // skips .tmp files still being written
+            }
+            if (snprintf(path, sizeof(path), "%s/%s", dirpath, entry->d_name) >= (int)sizeof(path) ||
+                stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            total += st.st_size;
+            if (!oldest[0] || st.st_mtime < oldest_mtime) {
+                oldest_mtime = st.st_mtime;
+                strlcpy(oldest, path, sizeof(oldest));
+            }
+        }
+        closedir(dir);
+
+        if (total <= CONFIG_HTTP_SERVER_IMG_CACHE_MAX_SIZE || !oldest[0] || unlink(oldest) != 0) {
+            return;
+        }
+        ESP_LOGD(TAG, "Evicted %s from the scaled image cache", oldest);
+    }
+}
+
+/**
+ * @brief Store a scaled image in the cache. Failures only cost a later rescale.
+ */
+static void image_cache_store(const char *cachepath, const uint8_t *data, size_t len) {
+    char tmppath[FILE_PATH_MAX];
+    char dirpath[FILE_PATH_MAX];
+
+    strlcpy(dirpath, cachepath, sizeof(dirpath));
+    char *slash = strrchr(dirpath, '/');
+    if (slash) {
+        *slash = '\0';
+        mkdir(dirpath, 0755);
+    }
+    if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", cachepath) >= (int)sizeof(tmppath)) {
+        return;
+    }
+
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ESP_LOGW(TAG, "Failed to create %s", tmppath);
+        return;
+    }
+    int64_t start_us = esp_timer_get_time();
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+    http_metrics_add_storage_write(written, esp_timer_get_time() - start_us);
+
+    if (written != len || rename(tmppath, cachepath) != 0) {
+        ESP_LOGW(TAG, "Failed to cache %s", cachepath);
+        unlink(tmppath);
+    }
+}
+
+static esp_err_t image_send_error(httpd_req_t *req, const char *status, const char *msg) {
+    httpd_resp_set_status(req, status);
+    httpd_resp_sendstr(req, msg);
+    return ESP_OK;
+}
+
+/**
+ * @brief Serve a stored JPEG scaled down to a requested width: GET /img/<path>?w=<width>&q=<quality>.
+ *
+ * The result is cached under CONFIG_HTTP_SERVER_IMG_CACHE_DIR, keyed by a
+ * hash of the source file's size, mtime and inode and the parameters, so a
+ * repeated request costs one stat() and a small file read.
+ */
+static esp_err_t image_get_handler(httpd_req_t *req) {
+    struct file_server_data *server_data = (struct file_server_data *)req->user_ctx;
+    char filepath[FILE_PATH_MAX];
+    char cachepath[FILE_PATH_MAX];
+    char query[64] = "";
+    char value[128];
+    char etag[24];
+    struct stat file_stat;
+    struct stat cache_stat;
+    unsigned width = 0;
+    unsigned quality = CONFIG_HTTP_SERVER_IMG_QUALITY;
+
+    const char *filename = get_path_from_uri(filepath, server_data->base_path, req->uri + sizeof("/img") - 1, sizeof(filepath));
+    if (!filename || strstr(filename, "..") || is_reserved_path(filename)) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid path");
+    }
+    if (!IS_FILE_EXT(filename, ".jpg") && !IS_FILE_EXT(filename, ".jpeg")) {
+        return image_send_error(req, "415 Unsupported Media Type", "Only JPEG images can be scaled");
+    }
 
-    struct dirent **entries;
-    size_t entry_count;
-    esp_err_t ret;
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+    if (httpd_query_key_value(query, "w", value, sizeof(value)) == ESP_OK) {
+        char *end;
+        unsigned long v = strtoul(value, &end, 10);
+        if (*end || v > UINT16_MAX) {
+            HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid width");
+        }
+        width = v;
+    }
+    if (httpd_query_key_value(query, "q", value, sizeof(value)) == ESP_OK) {
+        char *end;
+        unsigned long v = strtoul(value, &end, 10);
+        if (*end || v < 1 || v > 100) {
+            HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, "Invalid quality");
+        }
+        quality = v;
+    }
 
-    ret = list_files(dirpath, true, false, &entries, &entry_count);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to list directory : %s", dirpath);
-        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to list directory");
+    if (stat(filepath, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_404_NOT_FOUND, "File does not exist");
     }
 
-    httpd_resp_sendstr_chunk(req, "<h2>Files in ");
-    httpd_resp_sendstr_chunk(req, dirpath);
-    httpd_resp_sendstr_chunk(req, "</h2><table border=\"1\">"
-        "<thead><tr><th>Name</th><th>Type</th><th>Size (Bytes)</th><th>Date</th><th>Delete</th></tr></thead>"
-        "<tbody>");
+    uint64_t key = image_cache_key(filepath, &file_stat, width, quality);
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)key);
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) == ESP_OK && etag_list_matches(value, etag)) {
+        char head[FILE_HEADERS_MAX];
+        int len = snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: %s\r\n\r\n",
+                           etag, cache_control_for_path(filename));
+        return httpd_send_raw(req, head, len);
+    }
 
-    for (size_t i = 0; i < entry_count; i++) {
-        struct dirent *entry = entries[i];
-        entrytype = (entry->d_type == DT_DIR ? "directory" : "file");
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+    if (!is_on_async_worker_thread() && submit_async_req(req, image_get_handler) == ESP_OK) {
+        return ESP_OK;
+    }
+#endif
 
-        strlcpy(entrypath, dirpath, sizeof(entrypath));
-        strlcat(entrypath, "/", sizeof(entrypath));
-        strlcat(entrypath, entry->d_name, sizeof(entrypath));
+    if (image_cache_path(cachepath, sizeof(cachepath), server_data->base_path, key) != ESP_OK) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_414_URI_TOO_LONG, "Path too long");
+    }
 
-        struct stat entry_stat;
-        if (stat(entrypath, &entry_stat) == -1) {
-            ESP_LOGE(TAG, "Failed to stat %s : %s", entrytype, entry->d_name);
-            continue;
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", cache_control_for_path(filename));
+
+    if (stat(cachepath, &cache_stat) == 0) {
+        int fd = open(cachepath, O_RDONLY);
+        char *chunks[2] = { scratch_pool_lease(&server_data->pool, pdMS_TO_TICKS(CONFIG_HTTP_SERVER_SCRATCH_LEASE_TIMEOUT_MS)), NULL };
+        if (fd >= 0 && chunks[0]) {
+            ESP_LOGD(TAG, "Scaled image cache hit : %s", cachepath);
+            esp_err_t err = file_reader_stream(fd, 0, cache_stat.st_size, cache_stat.st_blksize, chunks,
+                                               server_data->pool.bufsize, send_chunk_sink, req);
+            close(fd);
+            scratch_pool_release(&server_data->pool, chunks[0]);
+            return err == ESP_OK ? httpd_resp_send_chunk(req, NULL, 0) : ESP_FAIL;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        scratch_pool_release(&server_data->pool, chunks[0]);
+        if (!chunks[0]) {
+            return send_busy(req, "1", "Server busy");
         }
-        snprintf(entrysize, sizeof(entrysize), "%ld", entry_stat.st_size);
-        ESP_LOGI(TAG, "Found %s : %s (%s bytes)", entrytype, entry->d_name, entrysize);
-        struct tm *tm_info = localtime(&entry_stat.st_mtime); 
-        strftime(date, sizeof(date), "%m/%d/%Y %I:%M:%S %p", tm_info);
-
-        httpd_resp_sendstr_chunk(req, "<tr><td><a href=\"");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        if (entry->d_type == DT_DIR) {
-            httpd_resp_sendstr_chunk(req, "/");
-        }
-        httpd_resp_sendstr_chunk(req, "\">");
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "</a></td><td>");
-        httpd_resp_sendstr_chunk(req, entrytype);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, entrysize);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, date);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, "<form method=\"post\" action=\"/delete");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Delete</button></form>");
-        httpd_resp_sendstr_chunk(req, "</td></tr>\n");
-
-        free(entry);
     }
-    free(entries);
 
-    httpd_resp_sendstr_chunk(req, "</tbody></table>");
-    return ESP_OK;
-}
+    if (file_stat.st_size > CONFIG_HTTP_SERVER_IMG_MAX_SOURCE_SIZE) {
+        return image_send_error(req, "413 Payload Too Large", "Image too large to scale");
+    }
+    uint8_t *src = image_read_file(filepath, file_stat.st_size);
+    if (!src) {
+        return send_busy(req, "1", "Not enough memory");
+    }
 
-static esp_err_t index_html_get_handler(httpd_req_t *req) {
-    httpd_resp_set_status(req, "307 Temporary Redirect");
-    httpd_resp_set_hdr(req, "Location", "/");
-    httpd_resp_send(req, NULL, 0);
-    return ESP_OK;
+    int64_t start_us = esp_timer_get_time();
+    uint8_t *jpg = NULL;
+    size_t jpg_len = 0;
+    esp_err_t err = camera_jpeg_downscale(src, file_stat.st_size, width, quality, &jpg, &jpg_len);
+    heap_caps_free(src);
+    if (err == ESP_ERR_NOT_SUPPORTED) {
+        return image_send_error(req, "415 Unsupported Media Type", "Only baseline JPEGs can be scaled");
+    }
+    if (err != ESP_OK) {
+        return send_busy(req, "1", "Not enough memory");
+    }
+    ESP_LOGI(TAG, "Scaled %s to w>=%u q=%u in %lld ms (%ld -> %u bytes)", filename, width, quality,
+             (long long)((esp_timer_get_time() - start_us) / 1000), (long)file_stat.st_size, (unsigned)jpg_len);
+
+    image_cache_store(cachepath, jpg, jpg_len);
+    image_cache_trim(server_data->base_path);
+    err = send_chunk_sink(req, (const char *)jpg, jpg_len);
+    free(jpg);
+    return err == ESP_OK ? httpd_resp_send_chunk(req, NULL, 0) : ESP_FAIL;
 }
+#endif // CONFIG_HTTP_SERVER_IMG_RESIZE
 
-static esp_err_t file_list_html(httpd_req_t *req, const char *dirpath) {
-    char clean_dirpath[FILE_PATH_MAX];
-    strlcpy(clean_dirpath, dirpath, sizeof(clean_dirpath));
-    size_t dirpath_len = strlen(clean_dirpath);
-    if (clean_dirpath[dirpath_len - 1] == '/') {
-        clean_dirpath[dirpath_len - 1] = '\0';
+static esp_err_t jpg_stream_handler(httpd_req_t *req) {
+    const char *stream_resp_hdr = "HTTP/1.1 200 OK\r\n"
+        "Content-Type: multipart/x-mixed-replace;boundary=" PART_BOUNDARY "\r\n"
+        "Cache-Control: no-store\r\n"
+        "\r\n";
+
+    if (!stream_mux_has_capacity()) {
+        ESP_LOGW(TAG, "Too many stream clients");
+        // Answered without handing over the socket, so the stream never starts
+        admission_stream_release(httpd_req_to_sockfd(req));
+        return send_busy(req, "5", "Too many stream clients");
     }
 
-    ESP_LOGI(TAG, "Request to list directory : %s", clean_dirpath);
-    send_html_header(req);
+    // The stream task writes the multipart body straight to the socket, so the
+    // response headers go out raw instead of through the chunked response API
+    if (httpd_send_raw(req, stream_resp_hdr, strlen(stream_resp_hdr)) != ESP_OK) {
+        return ESP_FAIL;
+    }
 
-    send_file_list(req, clean_dirpath);
-    send_html_footer(req);
+    int sockfd = httpd_req_to_sockfd(req);
+    if (stream_mux_add_client(sockfd, STREAM_CLIENT_MJPEG) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to hand socket %d to stream task", sockfd);
+        return ESP_FAIL;
+    }
     return ESP_OK;
 }
 
-static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filename) {
-    if (IS_FILE_EXT(filename, ".pdf")) {
-        return httpd_resp_set_type(req, "application/pdf");
-    } else if (IS_FILE_EXT(filename, ".html")) {
-        return httpd_resp_set_type(req, "text/html");
-    } else if (IS_FILE_EXT(filename, ".jpeg")) {
-        return httpd_resp_set_type(req, "image/jpeg");
-    } else if (IS_FILE_EXT(filename, ".ico")) {
-        return httpd_resp_set_type(req, "image/x-icon");
+/**
+ * @brief Send a single JPEG captured from the camera.
+ *
+ * The capture times are sent like those of MJPEG parts, see http_server_stream.h.
+ */
+static esp_err_t snapshot_get_handler(httpd_req_t *req) {
+    uint8_t *jpg = NULL;
+    size_t jpg_len = 0;
+    camera_frame_info_t info = { 0 };
+    char capture_us[24];
+    char timestamp[24];
+
+    if (camera_capture_jpeg_ex(&jpg, &jpg_len, &info) != ESP_OK || !jpg) {
+        free(jpg);
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to capture image");
     }
-    return httpd_resp_set_type(req, "text/plain");
+
+    httpd_resp_set_type(req, "image/jpeg");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    snprintf(capture_us, sizeof(capture_us), "%" PRId64, info.timestamp_us);
+    httpd_resp_set_hdr(req, "X-Capture-Us", capture_us);
+    if (info.wall_time_us > 0) {
+        snprintf(timestamp, sizeof(timestamp), "%" PRId64 ".%06" PRId64, info.wall_time_us / 1000000, info.wall_time_us % 1000000);
+        httpd_resp_set_hdr(req, "X-Timestamp", timestamp);
+    }
+    httpd_resp_set_hdr(req, "Content-Disposition", "inline; filename=\"snapshot.jpg\"");
+    esp_err_t err = httpd_resp_send(req, (const char *)jpg, jpg_len);
+    if (err == ESP_OK) {
+        http_metrics_add_bytes_sent(jpg_len);
+    }
+    free(jpg);
+    return err;
 }
 
-static const char* get_path_from_uri(char *dest, const char *base_path, const char *uri, size_t destsize) {
-    const size_t base_pathlen = strlen(base_path);
-    size_t pathlen = strlen(uri);
+#if CONFIG_HTTPD_WS_SUPPORT
+#define WS_MAX_CONTROL_MSG_LEN 32
 
-    const char *quest = strchr(uri, '?');
-    if (quest) {
-        pathlen = MIN(pathlen, quest - uri);
+static esp_err_t ws_stream_handler(httpd_req_t *req) {
+    int sockfd = httpd_req_to_sockfd(req);
+
+    if (req->method == HTTP_GET) {
+        // The handshake response has been sent, from here on the stream task writes to the socket
+        if (stream_mux_add_client(sockfd, STREAM_CLIENT_WS) != ESP_OK) {
+            ESP_LOGW(TAG, "Too many stream clients");
+            return ESP_FAIL;
+        }
+        return ESP_OK;
     }
-    const char *hash = strchr(uri, '#');
-    if (hash) {
-        pathlen = MIN(pathlen, hash - uri);
+
+    uint8_t payload[WS_MAX_CONTROL_MSG_LEN + 1];
+    httpd_ws_frame_t frame = {
+        .payload = payload,
+    };
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (frame.len > WS_MAX_CONTROL_MSG_LEN) {
+        ESP_LOGW(TAG, "WebSocket message too long (%u bytes)", (unsigned)frame.len);
+        return ESP_FAIL;
+    }
+    err = httpd_ws_recv_frame(req, &frame, WS_MAX_CONTROL_MSG_LEN);
+    if (err != ESP_OK) {
+        return err;
     }
+    payload[frame.len] = '\0';
 
-    if (base_pathlen + pathlen + 1 > destsize) {
-        return NULL;
+    switch (frame.type) {
+    case HTTPD_WS_TYPE_TEXT:
+        stream_mux_ws_control(sockfd, (const char *)payload);
+        return ESP_OK;
+    case HTTPD_WS_TYPE_PING:
+        return stream_mux_ws_queue_pong(sockfd, payload, frame.len);
+    case HTTPD_WS_TYPE_CLOSE:
+        httpd_sess_trigger_close(req->handle, sockfd);
+        return ESP_OK;
+    default:
+        return ESP_OK;
     }
+}
+#endif
 
-    strcpy(dest, base_path);
-    strlcpy(dest + base_pathlen, uri, pathlen + 1);
-    return dest + base_pathlen;
+static esp_err_t stream_stats_get_handler(httpd_req_t *req) {
+    http_stream_client_stats_t stats[CONFIG_HTTP_SERVER_STREAM_MAX_CLIENTS];
+    size_t count = 0;
+    char buf[512];
+    resp_writer_t w;
+
+    if (http_server_get_stream_stats(stats, CONFIG_HTTP_SERVER_STREAM_MAX_CLIENTS, &count) != ESP_OK) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Stream statistics unavailable");
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    resp_writer_init(&w, req, buf, sizeof(buf));
+    resp_writer_puts(&w, "{\"clients\":[");
+    for (size_t i = 0; i < count; i++) {
+        resp_writer_printf(&w,
+            "%s{\"fd\":%d,\"frames_sent\":%" PRIu32 ",\"frames_dropped\":%" PRIu32 ",\"bytes_sent\":%" PRIu64
+            ",\"drain_rate_bps\":%" PRIu32 ",\"outstanding_bytes\":%" PRIu32 ",\"backpressured\":%s,\"websocket\":%s}",
+            i ? "," : "", stats[i].sockfd, stats[i].frames_sent, stats[i].frames_dropped, stats[i].bytes_sent,
+            stats[i].drain_rate_bps, stats[i].outstanding_bytes, stats[i].backpressured ? "true" : "false",
+            stats[i].websocket ? "true" : "false");
+    }
+    resp_writer_puts(&w, "]}");
+    return resp_writer_finish(&w);
 }
 
-static esp_err_t favicon_get_handler(httpd_req_t *req)
-{
-    extern const unsigned char favicon_ico_start[] asm("_binary_favicon_ico_start");
-    extern const unsigned char favicon_ico_end[]   asm("_binary_favicon_ico_end");
-    const size_t favicon_ico_size = (favicon_ico_end - favicon_ico_start);
-    httpd_resp_set_type(req, "image/x-icon");
-    httpd_resp_send(req, (const char *)favicon_ico_start, favicon_ico_size);
-    return ESP_OK;
+static esp_err_t metrics_get_handler(httpd_req_t *req) {
+    char buf[1024];
+    resp_writer_t w;
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    resp_writer_init(&w, req, buf, sizeof(buf));
+    http_metrics_write(&w);
+    return resp_writer_finish(&w);
 }
 
-static esp_err_t download_file_get_handler(httpd_req_t *req) {
-    char filepath[FILE_PATH_MAX];
-    FILE *fd = NULL;
-    struct stat file_stat;
+#define LIST_DEFAULT_LIMIT 100
+#define LIST_MAX_LIMIT 1000
 
-    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path, req->uri, sizeof(filepath));
-    ESP_LOGI(TAG, "Filename: %s", filename);
+typedef enum {
+    LIST_SORT_NAME,
+    LIST_SORT_MTIME,
+    LIST_SORT_NONE,             // directory order, streamed with cursor paging
+} list_sort_t;
 
-    if (!filename) {
-        ESP_LOGE(TAG, "Filename is too long");
-        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+struct list_query {
+    char path[64];              // URI path of the directory
+    char dir[FILE_PATH_MAX];    // filesystem path of the directory
+    char glob[64];
+    size_t offset;
+    size_t limit;
+    list_sort_t sort;
+    bool descending;
+    long cursor;                // FILE_ITER_START, or where the previous page ended
+};
+
+struct list_entry {
+    char *name;
+    time_t mtime;
+    off_t size;
+    bool is_dir;
+};
+
+/**
+ * @brief Match a file name against a glob pattern with '*' and '?'.
+ */
+static bool glob_match(const char *pattern, const char *name) {
+    const char *star = NULL;
+    const char *star_name = NULL;
+
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            star_name = name;
+        } else if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++star_name;
+        } else {
+            return false;
+        }
     }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
 
-    if (filename[strlen(filename) - 1] == '/') {
-        ESP_LOGI(TAG, "Responding with directory contents of %s", filepath);
-        return file_list_html(req, filepath);
+/**
+ * @brief Whether entry a is listed before entry b.
+ */
+static bool list_entry_before(const struct list_query *q, const struct list_entry *a, const struct list_entry *b) {
+    int cmp = 0;
+    if (q->sort == LIST_SORT_MTIME) {
+        cmp = (a->mtime > b->mtime) - (a->mtime < b->mtime);
+    }
+    if (cmp == 0) {
+        cmp = strcmp(a->name, b->name);
     }
+    return q->descending ? cmp > 0 : cmp < 0;
+}
 
-    if (stat(filepath, &file_stat) == -1) {
-        if (strcmp(filename, "/index.html") == 0) {
-            return index_html_get_handler(req);
-        } else if (strcmp(filename, "/favicon.ico") == 0) {
-            return favicon_get_handler(req);
+/*
+ * The listing keeps only the first offset + limit entries in a binary heap
+ * whose root is the entry listed last, so memory stays bounded however
+ * large the directory is.
+ */
+static void list_heap_sift_down(const struct list_query *q, struct list_entry *heap, size_t count, size_t i) {
+    while (true) {
+        size_t largest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < count && list_entry_before(q, &heap[largest], &heap[left])) {
+            largest = left;
         }
-        ESP_LOGE(TAG, "Failed to stat file : %s", filepath);
-        HTTP_RESP_SEND_ERR(req, HTTPD_404_NOT_FOUND, "File does not exist");
+        if (right < count && list_entry_before(q, &heap[largest], &heap[right])) {
+            largest = right;
+        }
+        if (largest == i) {
+            return;
+        }
+        struct list_entry tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
     }
+}
 
-    fd = fopen(filepath, "r");
-    if (!fd) {
-        ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
-        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
+static void list_heap_sift_up(const struct list_query *q, struct list_entry *heap, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!list_entry_before(q, &heap[parent], &heap[i])) {
+            return;
+        }
+        struct list_entry tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
     }
+}
 
-    ESP_LOGI(TAG, "Sending file : %s (%ld bytes)...", filename, file_stat.st_size);
-    set_content_type_from_file(req, filename);
+static void list_entry_stat(const struct list_query *q, struct list_entry *entry) {
+    char entrypath[FILE_PATH_MAX + FILE_NAME_MAX];
+    struct stat entry_stat;
 
-    char *chunk = ((struct file_server_data *)req->user_ctx)->scratch;
-    size_t chunksize;
-    do {
-        chunksize = fread(chunk, 1, SCRATCH_BUFSIZE, fd);
-        if (chunksize > 0) {
-            if (httpd_resp_send_chunk(req, chunk, chunksize) != ESP_OK) {
-                fclose(fd);
-                ESP_LOGE(TAG, "File sending failed!");
-                httpd_resp_sendstr_chunk(req, NULL);
-                HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
-            }
+    snprintf(entrypath, sizeof(entrypath), "%s/%s", q->dir, entry->name);
+    if (stat(entrypath, &entry_stat) == 0) {
+        entry->mtime = entry_stat.st_mtime;
+        entry->size = entry_stat.st_size;
+    }
+}
+
+/**
+ * @brief Parse the query string of /api/list.
+ *
+ * @return const char* NULL on success, or a message for a 400 response.
+ */
+static const char *list_query_parse(httpd_req_t *req, const char *base_path, struct list_query *q) {
+    char query[256] = "";
+    char value[16];
+
+    strcpy(q->path, "/");
+    q->glob[0] = '\0';
+    q->offset = 0;
+    q->limit = LIST_DEFAULT_LIMIT;
+    q->sort = LIST_SORT_NAME;
+    q->descending = false;
+    q->cursor = FILE_ITER_START;
+
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+    if (httpd_query_key_value(query, "path", q->path, sizeof(q->path)) == ESP_ERR_HTTPD_RESULT_TRUNC || q->path[0] != '/' ||
+        strstr(q->path, "..") || is_reserved_path(q->path)) {
+        return "Invalid path";
+    }
+    if (httpd_query_key_value(query, "glob", q->glob, sizeof(q->glob)) == ESP_ERR_HTTPD_RESULT_TRUNC) {
+        return "Glob too long";
+    }
+    if (httpd_query_key_value(query, "offset", value, sizeof(value)) == ESP_OK) {
+        q->offset = strtoul(value, NULL, 10);
+    }
+    if (httpd_query_key_value(query, "limit", value, sizeof(value)) == ESP_OK) {
+        q->limit = MIN(MAX(strtoul(value, NULL, 10), 1), LIST_MAX_LIMIT);
+    }
+    if (httpd_query_key_value(query, "sort", value, sizeof(value)) == ESP_OK) {
+        if (strcmp(value, "mtime") == 0) {
+            q->sort = LIST_SORT_MTIME;
+        } else if (strcmp(value, "none") == 0) {
+            q->sort = LIST_SORT_NONE;
+        } else if (strcmp(value, "name") != 0) {
+            return "sort must be name, mtime or none";
+        }
+    }
+    if (httpd_query_key_value(query, "cursor", value, sizeof(value)) == ESP_OK) {
+        char *end;
+        q->cursor = strtol(value, &end, 10);
+        if (end == value || *end) {
+            return "Invalid cursor";
         }
-    } while (chunksize != 0);
+        q->sort = LIST_SORT_NONE;
+    }
+    if (q->sort != LIST_SORT_NONE && q->offset + q->limit > CONFIG_HTTP_SERVER_LIST_WINDOW_MAX) {
+        return "offset + limit too large";
+    }
+    if (httpd_query_key_value(query, "order", value, sizeof(value)) == ESP_OK) {
+        q->descending = strcmp(value, "desc") == 0;
+    }
 
-    fclose(fd);
-    ESP_LOGI(TAG, "File sending complete");
-    httpd_resp_send_chunk(req, NULL, 0);
-    return ESP_OK;
+    if (strlen(base_path) + strlen(q->path) >= sizeof(q->dir)) {
+        return "Path too long";
+    }
+    snprintf(q->dir, sizeof(q->dir), "%s%s", base_path, q->path);
+    size_t dir_len = strlen(q->dir);
+    if (dir_len > 1 && q->dir[dir_len - 1] == '/') {
+        q->dir[dir_len - 1] = '\0';
+    }
+    return NULL;
 }
 
-static esp_err_t delete_file_post_handler(httpd_req_t *req) {
-    char filepath[FILE_PATH_MAX];
-    struct stat file_stat;
+/**
+ * @brief Send one page of a directory in directory order, as it is read.
+ *
+ * Nothing is buffered, so memory does not depend on the directory size and
+ * the first entries go out before the directory has been read to the end.
+ * The total is not known and is left out. When more entries follow,
+ * next_cursor resumes the listing after the last one sent.
+ */
+static esp_err_t api_list_stream(httpd_req_t *req, struct file_server_data *server_data, const struct list_query *q) {
+    file_iter_t it;
+    if (file_iter_open(&it, q->dir, q->cursor) != ESP_OK) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
+    }
 
-    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path, req->uri + sizeof("/delete") - 1, sizeof(filepath));
-    if (!filename) {
-        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+    char *chunk = scratch_pool_lease(&server_data->pool, pdMS_TO_TICKS(CONFIG_HTTP_SERVER_SCRATCH_LEASE_TIMEOUT_MS));
+    if (!chunk) {
+        file_iter_close(&it);
+        return send_busy(req, "1", "Server busy");
     }
 
-    if (filename[strlen(filename) - 1] == '/') {
-        ESP_LOGE(TAG, "Invalid filename : %s", filename);
-        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Invalid filename");
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    resp_writer_t w;
+    resp_writer_init(&w, req, chunk, server_data->pool.bufsize);
+    resp_writer_puts(&w, "{\"path\":");
+    resp_writer_json_string(&w, q->path);
+    resp_writer_printf(&w, ",\"offset\":%u,\"limit\":%u,\"entries\":[", (unsigned)q->offset, (unsigned)q->limit);
+
+    const file_iter_entry_t *entry;
+    size_t skipped = 0;
+    size_t sent = 0;
+    long cookie = q->cursor;
+    bool more = false;
+    while (w.err == ESP_OK && file_iter_next(&it, &entry) == ESP_OK) {
+        if (is_reserved_entry(server_data->base_path, q->dir, entry->name) ||
+            (q->glob[0] && !glob_match(q->glob, entry->name))) {
+            continue;
+        }
+        if (sent == q->limit) {
+            more = true;
+            break;
+        }
+        cookie = entry->cookie;
+        if (skipped < q->offset) {
+            skipped++;
+            continue;
+        }
+        file_iter_stat(&it);
+        resp_writer_puts(&w, sent ? ",{\"name\":" : "{\"name\":");
+        resp_writer_json_string(&w, entry->name);
+        resp_writer_printf(&w, ",\"type\":\"%s\",\"size\":%lu,\"mtime\":%lld}",
+                           entry->type == DT_DIR ? "directory" : "file", (unsigned long)entry->size, (long long)entry->mtime);
+        sent++;
     }
+    file_iter_close(&it);
 
-    if (stat(filepath, &file_stat) == -1) {
-        ESP_LOGE(TAG, "File does not exist : %s", filename);
-        HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, "File does not exist");
+    resp_writer_puts(&w, "]");
+    if (more) {
+        resp_writer_printf(&w, ",\"next_cursor\":\"%ld\"", cookie);
     }
+    resp_writer_puts(&w, "}");
 
-    ESP_LOGI(TAG, "Deleting file : %s", filename);
-    unlink(filepath);
-    httpd_resp_set_status(req, "303 See Other");
-    httpd_resp_set_hdr(req, "Location", "/");
-    httpd_resp_sendstr(req, "File deleted successfully");
-    return ESP_OK;
+    esp_err_t err = resp_writer_finish(&w);
+    scratch_pool_release(&server_data->pool, chunk);
+    return err;
 }
 
-esp_err_t jpg_stream_handler(httpd_req_t *req){
-    const char* _STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-    const char* _STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-    const char* _STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+/**
+ * @brief List a directory as JSON: GET /api/list?path=&offset=&limit=&sort=name|mtime|none&order=asc|desc&glob=&cursor=
+ *
+ * Only the entries up to offset + limit are kept while the directory is read.
+ * When sorting by name, only the returned page is stat()ed. sort=none, or a
+ * cursor from a previous page, streams the directory instead, see api_list_stream().
+ */
+static esp_err_t api_list_get_handler(httpd_req_t *req) {
+    struct file_server_data *server_data = (struct file_server_data *)req->user_ctx;
+    struct list_query q;
 
-    esp_err_t res = ESP_OK;
-    size_t jpg_len = 0;
-    uint8_t * jpg_buf = NULL;
-    char part_buf[64]; // Corrected type from char* to char
-    static int64_t last_frame = 0;
-    if(!last_frame) {
-        last_frame = esp_timer_get_time();
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+    if (!is_on_async_worker_thread() && submit_async_req(req, api_list_get_handler) == ESP_OK) {
+        return ESP_OK;
     }
+#endif
 
-    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-    if(res != ESP_OK){
-        return res;
+    const char *invalid = list_query_parse(req, server_data->base_path, &q);
+    if (invalid) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_400_BAD_REQUEST, invalid);
+    }
+    if (q.sort == LIST_SORT_NONE) {
+        return api_list_stream(req, server_data, &q);
     }
 
-    while(true)
-    {
-        // ...existing code...
-        res = camera_capture_jpeg(&jpg_buf, &jpg_len); // Corrected pointer types
-        if (res != ESP_OK || jpg_buf == NULL || jpg_len == 0) {
-            ESP_LOGE(TAG, "Failed to capture JPEG image");
-            if (jpg_buf) {
-                free(jpg_buf); // Free the buffer if it was allocated
-            }
-            break;
-        }
+    const size_t window = q.offset + q.limit;
+    struct list_entry *entries = calloc(window, sizeof(struct list_entry));
+    if (!entries) {
+        HTTP_RESP_SEND_ERR(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
 
-        if(res == ESP_OK){
-            res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
+    DIR *dir = opendir(q.dir);
+    if (!dir) {
+        free(entries);
+        HTTP_RESP_SEND_ERR(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
+    }
+
+    size_t kept = 0;
+    size_t total = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        // FAT and SPIFFS have no dot entries, a host directory (tools/host) does
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+            is_reserved_entry(server_data->base_path, q.dir, de->d_name) ||
+            (q.glob[0] && !glob_match(q.glob, de->d_name))) {
+            continue;
         }
-        if(res == ESP_OK){
-            size_t hlen = snprintf(part_buf, sizeof(part_buf), _STREAM_PART, jpg_len);
+        total++;
 
-            res = httpd_resp_send_chunk(req, part_buf, hlen);
+        struct list_entry candidate = { .name = de->d_name, .is_dir = de->d_type == DT_DIR };
+        if (q.sort == LIST_SORT_MTIME) {
+            list_entry_stat(&q, &candidate);
+        }
+        if (kept == window && !list_entry_before(&q, &candidate, &entries[0])) {
+            continue;
+        }
+        candidate.name = strdup(de->d_name);
+        if (!candidate.name) {
+            ESP_LOGW(TAG, "Out of memory listing %s", q.dir);
+            break;
         }
-        if(res == ESP_OK){
-            res = httpd_resp_send_chunk(req, (const char *)jpg_buf, jpg_len);
+        if (kept == window) {
+            free(entries[0].name);
+            entries[0] = candidate;
+            list_heap_sift_down(&q, entries, kept, 0);
+        } else {
+            entries[kept] = candidate;
+            list_heap_sift_up(&q, entries, kept++);
         }
+    }
+    closedir(dir);
 
-        if (jpg_buf) {
-            free(jpg_buf); // Free the buffer after sending
+    // Heap sort into listing order
+    for (size_t n = kept; n > 1; n--) {
+        struct list_entry tmp = entries[0];
+        entries[0] = entries[n - 1];
+        entries[n - 1] = tmp;
+        list_heap_sift_down(&q, entries, n - 1, 0);
+    }
+
+    char *chunk = scratch_pool_lease(&server_data->pool, pdMS_TO_TICKS(CONFIG_HTTP_SERVER_SCRATCH_LEASE_TIMEOUT_MS));
+    if (!chunk) {
+        for (size_t i = 0; i < kept; i++) {
+            free(entries[i].name);
         }
+        free(entries);
+        return send_busy(req, "1", "Server busy");
+    }
 
-        if(res != ESP_OK){
-            break;
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    resp_writer_t w;
+    resp_writer_init(&w, req, chunk, server_data->pool.bufsize);
+    resp_writer_puts(&w, "{\"path\":");
+    resp_writer_json_string(&w, q.path);
+    resp_writer_printf(&w, ",\"total\":%u,\"offset\":%u,\"limit\":%u,\"entries\":[",
+                       (unsigned)total, (unsigned)q.offset, (unsigned)q.limit);
+    for (size_t i = q.offset; i < kept; i++) {
+        if (q.sort == LIST_SORT_NAME) {
+            list_entry_stat(&q, &entries[i]);
         }
-        int64_t fr_end = esp_timer_get_time();
-        int64_t frame_time = fr_end - last_frame;
-        last_frame = fr_end;
-        frame_time /= 1000;
-        //ESP_LOGI(TAG, "MJPG: %uKB %ums (%.1ffps)",
-        //    (uint32_t)(_jpg_buf_len/1024),
-        //    (uint32_t)frame_time, 1000.0 / (uint32_t)frame_time);
+        resp_writer_puts(&w, i > q.offset ? ",{\"name\":" : "{\"name\":");
+        resp_writer_json_string(&w, entries[i].name);
+        resp_writer_printf(&w, ",\"type\":\"%s\",\"size\":%ld,\"mtime\":%lld}",
+                           entries[i].is_dir ? "directory" : "file", (long)entries[i].size, (long long)entries[i].mtime);
+    }
+    resp_writer_puts(&w, "]}");
+
+    for (size_t i = 0; i < kept; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+
+    esp_err_t err = resp_writer_finish(&w);
+    scratch_pool_release(&server_data->pool, chunk);
+    return err;
+}
 
-        // Add delay to control frame rate (e.g., 30 FPS)
-        vTaskDelay(pdMS_TO_TICKS(33)); // 33 ms delay for ~30 FPS
+static esp_err_t http_server_open_fn(httpd_handle_t hd, int sockfd) {
+    if (tls_transport_enabled()) {
+        esp_err_t err = tls_transport_open(hd, sockfd);
+        if (err != ESP_OK) {
+            return err;
+        }
     }
+    admission_conn_open(hd, sockfd);
+    return ESP_OK;
+}
+
+static void http_server_close_fn(httpd_handle_t hd, int sockfd) {
+    stream_mux_remove_client(sockfd);
+    admission_conn_close(sockfd);
+    close(sockfd);
+}
 
-    last_frame = 0;
-    return res;
+TIMED_HANDLER(jpg_stream_handler, HTTP_ROUTE_STREAM)
+#if CONFIG_HTTPD_WS_SUPPORT
+TIMED_HANDLER(ws_stream_handler, HTTP_ROUTE_WS)
+#endif
+TIMED_HANDLER(snapshot_get_handler, HTTP_ROUTE_SNAPSHOT)
+TIMED_HANDLER(stream_stats_get_handler, HTTP_ROUTE_STATS)
+TIMED_HANDLER(metrics_get_handler, HTTP_ROUTE_METRICS)
+TIMED_HANDLER(api_list_get_handler, HTTP_ROUTE_LIST)
+TIMED_HANDLER(archive_get_handler, HTTP_ROUTE_ARCHIVE)
+#if CONFIG_HTTP_SERVER_IMG_RESIZE
+TIMED_HANDLER(image_get_handler, HTTP_ROUTE_IMAGE)
+#endif
+TIMED_HANDLER(download_file_get_handler, HTTP_ROUTE_FILE)
+TIMED_HANDLER(delete_file_post_handler, HTTP_ROUTE_DELETE)
+TIMED_HANDLER(upload_file_handler, HTTP_ROUTE_UPLOAD)
+
+/* Number of httpd_register_uri_handler() calls in start_http_server() */
+#if CONFIG_HTTPD_WS_SUPPORT
+#define URI_HANDLER_WS_COUNT 1
+#else
+#define URI_HANDLER_WS_COUNT 0
+#endif
+#if CONFIG_HTTP_SERVER_IMG_RESIZE
+#define URI_HANDLER_IMG_COUNT 1
+#else
+#define URI_HANDLER_IMG_COUNT 0
+#endif
+#define URI_HANDLER_COUNT (11 + URI_HANDLER_WS_COUNT + URI_HANDLER_IMG_COUNT)
+
+/**
+ * @brief Release what belongs to one run of the server, after a failed start or a stop.
+ *
+ * The file cache, reader task, async workers and stream task serve every
+ * start and are kept; each cleans up after itself if its own setup fails.
+ */
+static void server_release(void) {
+    tls_transport_deinit();
+    scratch_pool_deinit(&server_data->pool);
+    free(server_data);
+    server_data = NULL;
 }
 
-esp_err_t start_http_server(const char *base_path) {
-    static struct file_server_data *server_data = NULL;
+/**
+ * @brief Undo a failed start_http_server() in reverse order, so that it can be retried.
+ *
+ * @return esp_err_t err, for returning straight from the failure path.
+ */
+static esp_err_t start_failed(esp_err_t err) {
+    admission_deinit();
+    server_release();
+    return err;
+}
 
+esp_err_t start_http_server(const char *base_path, const http_server_config_t *server_config) {
     if (server_data) {
         ESP_LOGE(TAG, "File server already started");
         return ESP_ERR_INVALID_STATE;
     }
+    if (!base_path || !server_config || server_config->scratch_bufsize == 0 ||
+        server_config->max_uri_handlers < URI_HANDLER_COUNT ||
+        server_config->reserved_control_sockets >= server_config->max_open_sockets) {
+        ESP_LOGE(TAG, "Invalid server configuration");
+        return ESP_ERR_INVALID_ARG;
+    }
 
     server_data = calloc(1, sizeof(struct file_server_data));
     if (!server_data) {
@@ -353,49 +2981,225 @@ esp_err_t start_http_server(const char *base_path) {
     }
     strlcpy(server_data->base_path, base_path, sizeof(server_data->base_path));
 
-    httpd_handle_t server = NULL;
+    esp_err_t err = scratch_pool_init(&server_data->pool, server_config->scratch_bufsize);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to allocate I/O buffer pool");
+        return start_failed(err);
+    }
+
+    err = file_cache_init();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set up file cache");
+        return start_failed(err);
+    }
+
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+    err = start_async_req_workers();
+    if (err != ESP_OK) {
+        return start_failed(err);
+    }
+#endif
+
+    err = file_reader_start();
+    if (err != ESP_OK) {
+        return start_failed(err);
+    }
+
+    admission_limits_t limits = {
+        .max_open_sockets = server_config->max_open_sockets,
+        .reserved_control = server_config->reserved_control_sockets,
+        // Streams beyond the stream task's client table would only be admitted to be refused
+        .max_streams = MIN(server_config->max_streams, CONFIG_HTTP_SERVER_STREAM_MAX_CLIENTS),
+        .max_transfers = server_config->max_transfers,
+        .conn_rate = server_config->transfer_conn_rate,
+        .conn_burst = server_config->transfer_conn_burst,
+        .class_rate = server_config->transfer_rate,
+        .class_burst = server_config->transfer_burst,
+        .class_rate_streaming = server_config->transfer_rate_while_streaming,
+    };
+    err = admission_init(&limits);
+    if (err != ESP_OK) {
+        return start_failed(err);
+    }
+
+    if (server_config->tls_cert) {
+        err = tls_transport_init(server_config->tls_cert, server_config->tls_cert_len,
+                                 server_config->tls_key, server_config->tls_key_len,
+                                 server_config->tls_session_tickets);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set up HTTPS: %s", esp_err_to_name(err));
+            return start_failed(err);
+        }
+    }
+
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = server_config->server_port;
+    config.max_open_sockets = server_config->max_open_sockets;
+    config.lru_purge_enable = server_config->lru_purge_enable;
+    config.task_priority = server_config->task_priority;
+    config.core_id = server_config->core_id;
+    config.stack_size = server_config->stack_size;
+    config.backlog_conn = server_config->backlog_conn;
+    config.keep_alive_enable = server_config->keep_alive_enable;
+    config.keep_alive_idle = server_config->keep_alive_idle;
+    config.keep_alive_interval = server_config->keep_alive_interval;
+    config.keep_alive_count = server_config->keep_alive_count;
+    config.send_wait_timeout = server_config->send_wait_timeout;
+    config.recv_wait_timeout = server_config->recv_wait_timeout;
+    config.max_uri_handlers = server_config->max_uri_handlers;
     config.uri_match_fn = httpd_uri_match_wildcard;
+    config.open_fn = http_server_open_fn;
+    config.close_fn = http_server_close_fn;
 
-    ESP_LOGI(TAG, "Starting HTTP Server on port: '%d'", config.server_port);
+    ESP_LOGI(TAG, "Starting %s Server on port: '%d' (%u sockets, %u byte I/O buffers)",
+             tls_transport_enabled() ? "HTTPS" : "HTTP", config.server_port,
+             (unsigned)config.max_open_sockets, (unsigned)server_config->scratch_bufsize);
     if (httpd_start(&server, &config) == ESP_OK) 
     { 
+        if (stream_mux_start(server, tls_transport_enabled()) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to start stream task");
+            httpd_stop(server);
+            server = NULL;
+            return start_failed(ESP_FAIL);
+        }
+
         httpd_uri_t uri_handler = { 
             .uri = "/image-stream", 
             .method = HTTP_GET, 
-            .handler = jpg_stream_handler, 
+            .handler = jpg_stream_handler_timed, 
             .user_ctx = server_data 
         }; 
         httpd_register_uri_handler(server, &uri_handler); 
 
+#if CONFIG_HTTPD_WS_SUPPORT
+        httpd_uri_t ws_stream = {
+            .uri = "/ws-stream",
+            .method = HTTP_GET,
+            .handler = ws_stream_handler_timed,
+            .user_ctx = server_data,
+            .is_websocket = true,
+            .handle_ws_control_frames = true
+        };
+        httpd_register_uri_handler(server, &ws_stream);
+#endif
+
+        httpd_uri_t stream_stats = {
+            .uri = "/stream-stats",
+            .method = HTTP_GET,
+            .handler = stream_stats_get_handler_timed,
+            .user_ctx = server_data
+        };
+        httpd_register_uri_handler(server, &stream_stats);
+
+        httpd_uri_t snapshot = {
+            .uri = "/snapshot",
+            .method = HTTP_GET,
+            .handler = snapshot_get_handler_timed,
+            .user_ctx = server_data
+        };
+        httpd_register_uri_handler(server, &snapshot);
+
+        httpd_uri_t metrics = {
+            .uri = "/metrics",
+            .method = HTTP_GET,
+            .handler = metrics_get_handler_timed,
+            .user_ctx = server_data
+        };
+        httpd_register_uri_handler(server, &metrics);
+
+        httpd_uri_t api_list = {
+            .uri = "/api/list",
+            .method = HTTP_GET,
+            .handler = api_list_get_handler_timed,
+            .user_ctx = server_data
+        };
+        httpd_register_uri_handler(server, &api_list);
+
+        httpd_uri_t archive = {
+            .uri = "/archive/*",
+            .method = HTTP_GET,
+            .handler = archive_get_handler_timed,
+            .user_ctx = server_data
+        };
+        httpd_register_uri_handler(server, &archive);
+
+#if CONFIG_HTTP_SERVER_IMG_RESIZE
+        httpd_uri_t image = {
+            .uri = "/img/*",
+            .method = HTTP_GET,
+            .handler = image_get_handler_timed,
+            .user_ctx = server_data
+        };
+        httpd_register_uri_handler(server, &image);
+#endif
+
         httpd_uri_t file_download = {
             .uri = "/*",
             .method = HTTP_GET,
-            .handler = download_file_get_handler,
+            .handler = download_file_get_handler_timed,
             .user_ctx = server_data
         };
         httpd_register_uri_handler(server, &file_download);
 
+        httpd_uri_t file_head = {
+            .uri = "/*",
+            .method = HTTP_HEAD,
+            .handler = download_file_get_handler_timed,
+            .user_ctx = server_data
+        };
+        httpd_register_uri_handler(server, &file_head);
+
         httpd_uri_t file_delete = {
             .uri = "/delete/*",
             .method = HTTP_POST,
-            .handler = delete_file_post_handler,
+            .handler = delete_file_post_handler_timed,
             .user_ctx = server_data
         };
         httpd_register_uri_handler(server, &file_delete);
+
+        httpd_uri_t file_upload = {
+            .uri = "/upload/*",
+            .method = HTTP_POST,
+            .handler = upload_file_handler_timed,
+            .user_ctx = server_data
+        };
+        httpd_register_uri_handler(server, &file_upload);
+
+        file_upload.method = HTTP_PUT;
+        httpd_register_uri_handler(server, &file_upload);
     } 
     else
     {
         ESP_LOGE(TAG, "Failed to start file server!");
-        return ESP_FAIL;
+        return start_failed(ESP_FAIL);
     }
 
     return ESP_OK;
 }
 
+esp_err_t start_http_server_default(const char *base_path) {
+    http_server_config_t config = HTTP_SERVER_DEFAULT_CONFIG();
+    return start_http_server(base_path, &config);
+}
+
 void stop_http_server(void) {
-    if (server) {
-        httpd_stop(server);
-        server = NULL;
+    if (!server) {
+        return;
     }
+
+    // Workers hold copies of requests that httpd_stop() would free under them
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+    drain_async_req_workers();
+#endif
+    // Detached before the stop, so that no frame is written through a freed server
+    stream_mux_stop();
+    httpd_stop(server);
+    server = NULL;
+#if CONFIG_HTTP_SERVER_ASYNC_WORKERS > 0
+    resume_async_req_workers();
+#endif
+
+    admission_deinit();
+    server_release();
+    ESP_LOGI(TAG, "File server stopped");
 }
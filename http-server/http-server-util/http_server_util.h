@@ -9,10 +9,158 @@
 #include <esp_http_server.h>
 #include <esp_err.h>
 
+#include "sdkconfig.h"
+
 #define IS_FILE_EXT(filename, ext) \
     (strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
 
-esp_err_t start_http_server(const char *base_path);
+/**
+ * @brief Send statistics of one MJPEG stream client.
+ */
+typedef struct {
+    int sockfd;                 /*!< Client socket */
+    uint32_t frames_sent;       /*!< Frames completely written to the socket */
+    uint32_t frames_dropped;    /*!< Frames skipped because the client was still busy with an older one */
+    uint64_t bytes_sent;        /*!< Total bytes written to the socket */
+    uint32_t drain_rate_bps;    /*!< Smoothed socket drain rate in bytes per second, 0 until measured */
+    uint32_t outstanding_bytes; /*!< Bytes of the current part not yet written */
+    bool backpressured;         /*!< The client is falling behind the camera */
+    bool websocket;             /*!< The client streams over WebSocket rather than multipart MJPEG */
+} http_stream_client_stats_t;
+
+/**
+ * @brief Counters of the RAM file cache.
+ */
+typedef struct {
+    uint32_t hits;              /*!< Requests answered from RAM */
+    uint32_t misses;            /*!< Requests for cacheable files that were not in RAM */
+    uint32_t evictions;         /*!< Entries dropped to stay within the byte budget */
+    uint32_t invalidations;     /*!< Entries dropped because the file changed or was deleted */
+    size_t bytes_used;          /*!< Bytes held by cached responses */
+    size_t entries;             /*!< Number of cached files */
+} http_file_cache_stats_t;
+
+/**
+ * @brief Tuning of the HTTP server task, its sockets and its I/O buffers.
+ */
+typedef struct {
+    uint16_t server_port;           /*!< TCP port to listen on */
+    uint16_t max_open_sockets;      /*!< Concurrent client connections, limited by CONFIG_LWIP_MAX_SOCKETS - 3 */
+    bool lru_purge_enable;          /*!< Let the server close its least recently used connection when all sockets are taken, which may be a stream. Admission control already closes idle keep-alive connections instead */
+    unsigned task_priority;         /*!< Priority of the server task */
+    BaseType_t core_id;             /*!< Core the server task runs on, or tskNO_AFFINITY */
+    size_t stack_size;              /*!< Stack size of the server task */
+    uint16_t backlog_conn;          /*!< Pending connections the listen socket queues */
+    bool keep_alive_enable;         /*!< Enable TCP keep-alive probes on client sockets */
+    int keep_alive_idle;            /*!< Idle seconds before the first probe, 0 for the stack default */
+    int keep_alive_interval;        /*!< Seconds between probes, 0 for the stack default */
+    int keep_alive_count;           /*!< Unanswered probes before the connection is dropped, 0 for the stack default */
+    uint16_t send_wait_timeout;     /*!< Seconds a send may block before the connection is dropped */
+    uint16_t recv_wait_timeout;     /*!< Seconds a receive may block before the connection is dropped */
+    size_t scratch_bufsize;         /*!< Size of each pooled I/O buffer used for file transfers */
+    uint16_t max_uri_handlers;      /*!< URI handler slots, at least the number the server registers */
+    uint16_t max_streams;           /*!< Concurrent camera streams, at most CONFIG_HTTP_SERVER_STREAM_MAX_CLIENTS */
+    uint16_t max_transfers;         /*!< Concurrent file downloads, uploads, listings and archives */
+    uint16_t reserved_control_sockets; /*!< Sockets kept free of streams and transfers, so delete, statistics and metrics stay reachable */
+    uint32_t transfer_conn_rate;    /*!< Send rate of each transfer in bytes per second, 0 for unlimited */
+    uint32_t transfer_conn_burst;   /*!< Bytes a transfer connection may save up while idle */
+    uint32_t transfer_rate;         /*!< Send rate of all transfers together in bytes per second, 0 for unlimited */
+    uint32_t transfer_burst;        /*!< Bytes all transfers together may save up while idle */
+    uint32_t transfer_rate_while_streaming; /*!< Send rate of all transfers together while a camera stream is connected, 0 for transfer_rate */
+    const uint8_t *tls_cert;        /*!< PEM server certificate chain for HTTPS, NULL to serve plain HTTP */
+    size_t tls_cert_len;            /*!< Length of tls_cert including the NUL terminator */
+    const uint8_t *tls_key;         /*!< PEM private key for HTTPS */
+    size_t tls_key_len;             /*!< Length of tls_key including the NUL terminator */
+    bool tls_session_tickets;       /*!< Issue TLS session tickets so returning clients skip the full handshake */
+} http_server_config_t;
+
+/**
+ * @brief Server configuration matching HTTPD_DEFAULT_CONFIG(), with the component's Kconfig defaults.
+ */
+#define HTTP_SERVER_DEFAULT_CONFIG() {                          \
+        .server_port = 80,                                      \
+        .max_open_sockets = 7,                                  \
+        .lru_purge_enable = false,                              \
+        .task_priority = tskIDLE_PRIORITY + 5,                  \
+        .core_id = tskNO_AFFINITY,                              \
+        .stack_size = 4096,                                     \
+        .backlog_conn = 5,                                      \
+        .keep_alive_enable = false,                             \
+        .keep_alive_idle = 0,                                   \
+        .keep_alive_interval = 0,                               \
+        .keep_alive_count = 0,                                  \
+        .send_wait_timeout = 5,                                 \
+        .recv_wait_timeout = 5,                                 \
+        .scratch_bufsize = CONFIG_HTTP_SERVER_SCRATCH_BUFSIZE,  \
+        .max_uri_handlers = 16,                                 \
+        .max_streams = CONFIG_HTTP_SERVER_STREAM_MAX_CLIENTS,   \
+        .max_transfers = 4,                                     \
+        .reserved_control_sockets = 1,                          \
+        .transfer_conn_rate = 0,                                \
+        .transfer_conn_burst = 0,                               \
+        .transfer_rate = 0,                                     \
+        .transfer_burst = 0,                                    \
+        .transfer_rate_while_streaming = 0,                     \
+        .tls_cert = NULL,                                       \
+        .tls_cert_len = 0,                                      \
+        .tls_key = NULL,                                        \
+        .tls_key_len = 0,                                       \
+        .tls_session_tickets = true,                            \
+}
+
+/**
+ * @brief Start the file and camera server.
+ *
+ * @param base_path The directory files are served from.
+ * @param config The server tuning, see HTTP_SERVER_DEFAULT_CONFIG().
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if the configuration is unusable, or an error code on failure.
+ */
+esp_err_t start_http_server(const char *base_path, const http_server_config_t *config);
+
+/**
+ * @brief Start the file and camera server with HTTP_SERVER_DEFAULT_CONFIG().
+ *
+ * @param base_path The directory files are served from.
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t start_http_server_default(const char *base_path);
+
+/**
+ * @brief Stop the server and release its resources, so that it can be started again.
+ *
+ * Waits for requests running on async workers to finish first. Must not be
+ * called from a request handler.
+ */
 void stop_http_server(void);
 
+/**
+ * @brief Set the Cache-Control value sent for files under a path prefix.
+ *
+ * The longest matching prefix wins; files without a match use
+ * CONFIG_HTTP_SERVER_DEFAULT_CACHE_CONTROL. Call this during startup.
+ *
+ * @param path_prefix URI path prefix, e.g. "/assets/".
+ * @param value Cache-Control header value, e.g. "max-age=86400".
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if a string is too long, ESP_ERR_NO_MEM if the rule table is full.
+ */
+esp_err_t http_server_set_cache_control(const char *path_prefix, const char *value);
+
+/**
+ * @brief Get the counters of the RAM file cache.
+ *
+ * @param stats Receives the counters.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_SUPPORTED if the cache is disabled in Kconfig.
+ */
+esp_err_t http_server_get_file_cache_stats(http_file_cache_stats_t *stats);
+
+/**
+ * @brief Get send statistics of the connected MJPEG stream clients.
+ *
+ * @param stats Array that receives one entry per client.
+ * @param max_stats Number of entries in stats.
+ * @param count Number of entries written.
+ * @return esp_err_t ESP_OK on success, or an error code on failure.
+ */
+esp_err_t http_server_get_stream_stats(http_stream_client_stats_t *stats, size_t max_stats, size_t *count);
+
 #endif // HTTP_SERVER_UTIL_H
@@ -0,0 +1,158 @@
+#include "http_server_writer.h"
+#include "http_server_metrics.h"
+#include "http_server_admission.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void resp_writer_init(resp_writer_t *w, httpd_req_t *req, char *buf, size_t size) {
+    w->req = req;
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->err = ESP_OK;
+}
+
+esp_err_t resp_writer_flush(resp_writer_t *w) {
+    if (w->len > 0 && w->err == ESP_OK) {
+        admission_pace(httpd_req_to_sockfd(w->req), w->len);
+        w->err = httpd_resp_send_chunk(w->req, w->buf, w->len);
+        if (w->err == ESP_OK) {
+            http_metrics_add_bytes_sent(w->len);
+        }
+    }
+    w->len = 0;
+    return w->err;
+}
+
+esp_err_t resp_writer_append(resp_writer_t *w, const char *data, size_t len) {
+    while (len > 0) {
+        if (w->len == w->size) {
+            resp_writer_flush(w);
+        }
+        size_t n = w->size - w->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+    }
+    return w->err;
+}
+
+char *resp_writer_reserve(resp_writer_t *w, size_t min, size_t *avail) {
+    if (w->size - w->len < min) {
+        resp_writer_flush(w);
+    }
+    *avail = w->size - w->len;
+    return w->buf + w->len;
+}
+
+void resp_writer_commit(resp_writer_t *w, size_t len) {
+    w->len += len;
+}
+
+esp_err_t resp_writer_puts(resp_writer_t *w, const char *s) {
+    return resp_writer_append(w, s, strlen(s));
+}
+
+esp_err_t resp_writer_printf(resp_writer_t *w, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    int n = vsnprintf(w->buf + w->len, w->size - w->len, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        return w->err;
+    }
+    if ((size_t)n < w->size - w->len) {
+        w->len += n;
+        return w->err;
+    }
+
+    // Did not fit behind the buffered data, try again in an empty buffer
+    resp_writer_flush(w);
+    if ((size_t)n < w->size) {
+        va_start(args, fmt);
+        vsnprintf(w->buf, w->size, fmt, args);
+        va_end(args);
+        w->len = n;
+        return w->err;
+    }
+
+    char *tmp = malloc(n + 1);
+    if (!tmp) {
+        return ESP_ERR_NO_MEM;
+    }
+    va_start(args, fmt);
+    vsnprintf(tmp, n + 1, fmt, args);
+    va_end(args);
+    resp_writer_append(w, tmp, n);
+    free(tmp);
+    return w->err;
+}
+
+esp_err_t resp_writer_json_string(resp_writer_t *w, const char *s) {
+    char esc[8];
+
+    resp_writer_append(w, "\"", 1);
+    while (*s) {
+        // Copy the run of characters that need no escaping in one go
+        size_t run = 0;
+        while (s[run] && s[run] != '"' && s[run] != '\\' && (uint8_t)s[run] >= 0x20) {
+            run++;
+        }
+        resp_writer_append(w, s, run);
+        s += run;
+        if (!*s) {
+            break;
+        }
+        if (*s == '"' || *s == '\\') {
+            esc[0] = '\\';
+            esc[1] = *s;
+            resp_writer_append(w, esc, 2);
+        } else {
+            resp_writer_append(w, esc, snprintf(esc, sizeof(esc), "\\u%04x", (uint8_t)*s));
+        }
+        s++;
+    }
+    return resp_writer_append(w, "\"", 1);
+}
+
+esp_err_t resp_writer_html_escaped(resp_writer_t *w, const char *s) {
+    while (*s) {
+        size_t run = strcspn(s, "&<>\"");
+        resp_writer_append(w, s, run);
+        s += run;
+        switch (*s) {
+        case '&':
+            resp_writer_append(w, "&amp;", 5);
+            break;
+        case '<':
+            resp_writer_append(w, "&lt;", 4);
+            break;
+        case '>':
+            resp_writer_append(w, "&gt;", 4);
+            break;
+        case '"':
+            resp_writer_append(w, "&quot;", 6);
+            break;
+        default:
+            return w->err;
+        }
+        s++;
+    }
+    return w->err;
+}
+
+esp_err_t resp_writer_finish(resp_writer_t *w) {
+    resp_writer_flush(w);
+    if (w->err == ESP_OK) {
+        w->err = httpd_resp_send_chunk(w->req, NULL, 0);
+    }
+    return w->err;
+}
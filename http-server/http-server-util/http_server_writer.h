@@ -0,0 +1,107 @@
+#ifndef HTTP_SERVER_WRITER_H
+#define HTTP_SERVER_WRITER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <esp_http_server.h>
+#include <esp_err.h>
+
+/**
+ * @brief Collects a chunked response in a fixed buffer and sends it in full chunks.
+ *
+ * Handlers that build a response from many small pieces append them here
+ * instead of calling httpd_resp_send_chunk() for each one, so the client
+ * receives one chunk, and usually one TCP segment, per buffer.
+ *
+ * After a failed send the writer keeps accepting data but drops it; the
+ * error is returned by every later call and by resp_writer_finish().
+ */
+typedef struct {
+    httpd_req_t *req;
+    char *buf;
+    size_t size;
+    size_t len;
+    esp_err_t err;
+} resp_writer_t;
+
+/**
+ * @brief Set up a writer over a caller-provided buffer.
+ *
+ * @param w The writer.
+ * @param req The request to respond to.
+ * @param buf The output buffer, e.g. leased from the scratch pool.
+ * @param size Size of buf.
+ */
+void resp_writer_init(resp_writer_t *w, httpd_req_t *req, char *buf, size_t size);
+
+/**
+ * @brief Append bytes, sending a chunk whenever the buffer fills up.
+ *
+ * @param w The writer.
+ * @param data The bytes to append.
+ * @param len Length of data, may exceed the buffer size.
+ * @return esp_err_t ESP_OK, or the error of a failed send.
+ */
+esp_err_t resp_writer_append(resp_writer_t *w, const char *data, size_t len);
+
+/**
+ * @brief Append a NUL-terminated string.
+ */
+esp_err_t resp_writer_puts(resp_writer_t *w, const char *s);
+
+/**
+ * @brief Append formatted text.
+ *
+ * The text is formatted straight into the buffer. Text that does not fit in
+ * an empty buffer is formatted into a temporary heap allocation.
+ */
+esp_err_t resp_writer_printf(resp_writer_t *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Append a string as a quoted JSON string.
+ */
+esp_err_t resp_writer_json_string(resp_writer_t *w, const char *s);
+
+/**
+ * @brief Append a string with the HTML special characters &, <, > and " escaped.
+ */
+esp_err_t resp_writer_html_escaped(resp_writer_t *w, const char *s);
+
+/**
+ * @brief Get the free tail of the buffer, to be filled in place, e.g. by read().
+ *
+ * The buffered bytes are sent first if fewer than min bytes are free.
+ *
+ * @param w The writer.
+ * @param min Bytes needed, at most the buffer size.
+ * @param avail Receives the number of free bytes.
+ * @return char* Where to write, followed by resp_writer_commit().
+ */
+char *resp_writer_reserve(resp_writer_t *w, size_t min, size_t *avail);
+
+/**
+ * @brief Add bytes written in place after resp_writer_reserve() to the buffer.
+ *
+ * @param w The writer.
+ * @param len Number of bytes written, at most the space reserved.
+ */
+void resp_writer_commit(resp_writer_t *w, size_t len);
+
+/**
+ * @brief Send the buffered bytes as one chunk now.
+ *
+ * @param w The writer.
+ * @return esp_err_t ESP_OK, or the error of a failed send.
+ */
+esp_err_t resp_writer_flush(resp_writer_t *w);
+
+/**
+ * @brief Send the buffered bytes and end the chunked response.
+ *
+ * @param w The writer.
+ * @return esp_err_t ESP_OK, or the first error of the response.
+ */
+esp_err_t resp_writer_finish(resp_writer_t *w);
+
+#endif // HTTP_SERVER_WRITER_H
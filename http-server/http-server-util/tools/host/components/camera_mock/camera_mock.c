@@ -0,0 +1,232 @@
+#include "camera_util.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+/*
+ * Host stand-in for camera_util.c. Frames come at a fixed rate, like a
+ * sensor, and are either a JPEG read from CAMERA_MOCK_JPEG or a synthetic
+ * frame of CAMERA_MOCK_FRAME_SIZE bytes. The synthetic frame is a JPEG
+ * marker skeleton padded with comments: the server and the benchmark client
+ * treat it like a picture, a browser shows a broken image.
+ *
+ * Environment:
+ *   CAMERA_MOCK_JPEG        JPEG file to serve as every frame
+ *   CAMERA_MOCK_FRAME_SIZE  Size of the synthetic frame in bytes (default 32768)
+ *   CAMERA_MOCK_FPS         Frame rate (default 25)
+ */
+
+static const char *TAG = "camera_mock";
+
+#define MOCK_DEFAULT_FRAME_SIZE 32768
+#define MOCK_DEFAULT_FPS 25
+#define MOCK_WIDTH 640
+#define MOCK_HEIGHT 480
+#define WALL_CLOCK_VALID_AFTER 1577836800
+
+static uint8_t *frame = NULL;
+static size_t frame_len = 0;
+static int64_t frame_interval_us = 1000000 / MOCK_DEFAULT_FPS;
+static uint8_t jpeg_quality = 12;
+
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static camera_stats_t stats = { 0 };
+static int64_t last_capture_us = 0;
+
+static long env_long(const char *name, long fallback)
+{
+    const char *value = getenv(name);
+    if (!value || !*value)
+    {
+        return fallback;
+    }
+    char *end;
+    long n = strtol(value, &end, 10);
+    return (*end || n <= 0) ? fallback : n;
+}
+
+static esp_err_t load_jpeg(const char *path)
+{
+    FILE *fd = fopen(path, "rb");
+    if (!fd)
+    {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return ESP_FAIL;
+    }
+    fseek(fd, 0, SEEK_END);
+    long len = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    frame = len > 0 ? malloc(len) : NULL;
+    if (!frame || fread(frame, 1, len, fd) != (size_t)len)
+    {
+        fclose(fd);
+        free(frame);
+        frame = NULL;
+        ESP_LOGE(TAG, "Failed to read %s", path);
+        return ESP_FAIL;
+    }
+    fclose(fd);
+    frame_len = len;
+    return ESP_OK;
+}
+
+/* SOI, COM segments of filler up to len, EOI */
+static esp_err_t build_synthetic_frame(size_t len)
+{
+    len = len < 8 ? 8 : len;
+    frame = malloc(len);
+    if (!frame)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    frame[0] = 0xFF;
+    frame[1] = 0xD8;
+    size_t pos = 2;
+    while (len - pos > 2)
+    {
+        size_t seg = len - pos - 2;
+        if (seg > 0xFFFF + 2)
+        {
+            seg = 0xFFFF + 2;
+        }
+        if (seg < 4)
+        {
+            memset(frame + pos, 0xFF, seg);  // fill bytes are allowed between markers
+            pos += seg;
+            break;
+        }
+        frame[pos] = 0xFF;
+        frame[pos + 1] = 0xFE;
+        frame[pos + 2] = (seg - 2) >> 8;
+        frame[pos + 3] = (seg - 2) & 0xFF;
+        memset(frame + pos + 4, 'x', seg - 4);
+        pos += seg;
+    }
+    frame[pos] = 0xFF;
+    frame[pos + 1] = 0xD9;
+    frame_len = len;
+    return ESP_OK;
+}
+
+static int64_t wall_time_from_timer(int64_t timer_us)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec < WALL_CLOCK_VALID_AFTER)
+    {
+        return 0;
+    }
+    return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec - (esp_timer_get_time() - timer_us);
+}
+
+esp_err_t camera_init(void)
+{
+    if (frame)
+    {
+        return ESP_OK;
+    }
+
+    frame_interval_us = 1000000 / env_long("CAMERA_MOCK_FPS", MOCK_DEFAULT_FPS);
+    const char *path = getenv("CAMERA_MOCK_JPEG");
+    esp_err_t err = path ? load_jpeg(path) : build_synthetic_frame(env_long("CAMERA_MOCK_FRAME_SIZE", MOCK_DEFAULT_FRAME_SIZE));
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    ESP_LOGI(TAG, "Mock camera: %u byte frames at %lld fps", (unsigned)frame_len, (long long)(1000000 / frame_interval_us));
+    return ESP_OK;
+}
+
+esp_err_t camera_deinit(void)
+{
+    free(frame);
+    frame = NULL;
+    frame_len = 0;
+    return ESP_OK;
+}
+
+esp_err_t camera_capture_jpeg_ex(uint8_t **jpg_buf, size_t *jpg_len, camera_frame_info_t *info)
+{
+    esp_err_t err = camera_init();
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    // Wait for the next frame boundary, as esp_camera_fb_get() waits for the sensor
+    int64_t start_us = esp_timer_get_time();
+    int64_t next_us = (start_us / frame_interval_us + 1) * frame_interval_us;
+    vTaskDelay(pdMS_TO_TICKS((next_us - start_us + 999) / 1000));
+    int64_t end_us = esp_timer_get_time();
+
+    *jpg_buf = malloc(frame_len);
+    if (!*jpg_buf)
+    {
+        portENTER_CRITICAL(&stats_lock);
+        stats.capture_failures++;
+        portEXIT_CRITICAL(&stats_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(*jpg_buf, frame, frame_len);
+    *jpg_len = frame_len;
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.frames_captured++;
+    stats.capture_us_total += end_us - start_us;
+    if (last_capture_us > 0 && end_us > last_capture_us)
+    {
+        float fps = 1000000.0f / (end_us - last_capture_us);
+        stats.fps = stats.fps > 0 ? stats.fps * 0.9f + fps * 0.1f : fps;
+    }
+    last_capture_us = end_us;
+    portEXIT_CRITICAL(&stats_lock);
+
+    if (info)
+    {
+        info->width = MOCK_WIDTH;
+        info->height = MOCK_HEIGHT;
+        info->timestamp_us = end_us;
+        info->wall_time_us = wall_time_from_timer(end_us);
+    }
+    return ESP_OK;
+}
+
+esp_err_t camera_capture_jpeg(uint8_t **jpg_buf, size_t *jpg_len)
+{
+    return camera_capture_jpeg_ex(jpg_buf, jpg_len, NULL);
+}
+
+esp_err_t camera_set_jpeg_quality(uint8_t quality)
+{
+    if (quality < 1 || quality > 100)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    jpeg_quality = quality;
+    return ESP_OK;
+}
+
+esp_err_t camera_get_stats(camera_stats_t *out)
+{
+    if (!out)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_lock);
+    return ESP_OK;
+}
+
+esp_err_t camera_jpeg_downscale(const uint8_t *jpg, size_t jpg_len, uint16_t min_width, uint8_t quality,
+                                uint8_t **out, size_t *out_len)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
@@ -0,0 +1,10 @@
+#ifndef ESP_CAMERA_H
+#define ESP_CAMERA_H
+
+/*
+ * Stand-in for the esp32-camera header included by camera_util.h. The host
+ * build links camera_mock.c instead of camera_util.c, so nothing from the
+ * driver is needed.
+ */
+
+#endif // ESP_CAMERA_H
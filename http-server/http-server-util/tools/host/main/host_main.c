@@ -0,0 +1,82 @@
+#include "http_server_util.h"
+
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Runs the file and camera server on the development machine so it can be
+ * load tested with tools/http_bench.c:
+ *
+ *   idf.py --preview set-target linux && idf.py build
+ *   HTTP_HOST_ROOT=/tmp/www ./build/http_server_host.elf
+ *
+ * Environment:
+ *   HTTP_HOST_ROOT  Directory to serve (default /tmp/www)
+ *   HTTP_HOST_PORT  Port to listen on (default 8080)
+ *   HTTP_HOST_TLS_CERT, HTTP_HOST_TLS_KEY
+ *                   PEM certificate and key files; serves HTTPS with session
+ *                   tickets when both are set
+ *
+ * A self-signed certificate for the HTTPS mode:
+ *
+ *   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+ *       -subj /CN=localhost -days 365 -keyout key.pem -out cert.pem
+ *
+ * The camera is mocked, see components/camera_mock.
+ */
+
+static const char *TAG = "http_server_host";
+
+/* Read a PEM file NUL terminated, as esp-tls expects it */
+static uint8_t *read_pem(const char *path, size_t *len) {
+    FILE *fd = fopen(path, "rb");
+    if (!fd) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return NULL;
+    }
+    fseek(fd, 0, SEEK_END);
+    long size = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+    uint8_t *buf = size > 0 ? malloc(size + 1) : NULL;
+    if (!buf || fread(buf, 1, size, fd) != (size_t)size) {
+        ESP_LOGE(TAG, "Failed to read %s", path);
+        fclose(fd);
+        free(buf);
+        return NULL;
+    }
+    fclose(fd);
+    buf[size] = '\0';
+    *len = size + 1;
+    return buf;
+}
+
+void app_main(void) {
+    const char *root = getenv("HTTP_HOST_ROOT");
+    const char *port = getenv("HTTP_HOST_PORT");
+
+    http_server_config_t config = HTTP_SERVER_DEFAULT_CONFIG();
+    config.server_port = port ? atoi(port) : 8080;
+    config.max_open_sockets = 24;
+    config.max_streams = 16;
+    config.max_transfers = 8;
+    config.lru_purge_enable = true;
+
+    const char *cert = getenv("HTTP_HOST_TLS_CERT");
+    const char *key = getenv("HTTP_HOST_TLS_KEY");
+    if (cert && key) {
+        config.tls_cert = read_pem(cert, &config.tls_cert_len);
+        config.tls_key = read_pem(key, &config.tls_key_len);
+        if (!config.tls_cert || !config.tls_key) {
+            exit(1);
+        }
+        config.tls_session_tickets = true;
+    }
+
+    esp_err_t err = start_http_server(root ? root : "/tmp/www", &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start server: %s", esp_err_to_name(err));
+        exit(1);
+    }
+}
@@ -0,0 +1,841 @@
+/*
+ * Load generator for http_server_util, run against a board or the host build
+ * in tools/host. Each client is a thread holding one keep-alive connection.
+ * Listing, download and snapshot clients issue requests back to back; MJPEG
+ * clients hold /image-stream open and count frames. The results are written
+ * as one JSON object so runs can be compared over time.
+ *
+ * Frames from /image-stream and /snapshot carry their capture time (see
+ * http_server_stream.h), from which the age of each frame on arrival is
+ * reported as capture_age_ms. With X-Timestamp, the server's wall clock,
+ * ages are absolute and assume both clocks are synchronised (SNTP on the
+ * board, or the same machine for the host build). Without it only the
+ * esp_timer time is known, and ages are reported relative to the youngest
+ * frame seen by that client ("clock":"relative").
+ *
+ * With -T every connection is TLS. Each client offers the session from its
+ * previous connection, so with -C (a new connection per request) all but
+ * the first handshake should be resumed. The handshake times are reported
+ * split into full and resumed, next to the server's own
+ * tls_handshake_duration_seconds histogram read from /metrics after the run.
+ *
+ * build: cc -O2 -pthread -o http_bench http_bench.c -lssl -lcrypto
+ *
+ * usage: http_bench [-H host] [-p port] [-t seconds] [-l clients] [-g clients]
+ *                   [-f path] [-s clients] [-m clients] [-o file] [-T] [-C]
+ *
+ *   -H  server address (default 127.0.0.1)
+ *   -p  server port (default 8080)
+ *   -t  test duration in seconds (default 10)
+ *   -l  clients requesting /api/list?path=/ (default 2)
+ *   -g  clients downloading the file given with -f (default 2)
+ *   -f  file to download (default /bench.bin)
+ *   -s  clients requesting /snapshot (default 1)
+ *   -m  MJPEG stream clients (default 2)
+ *   -o  write the JSON here instead of stdout
+ *   -T  connect with TLS (--tls), certificates are not verified
+ *   -C  close the connection after every request instead of keeping it alive
+ *
+ * e.g. against the host build in HTTPS mode:
+ *
+ *   http_bench -T -C -p 8443 -l 4 -g 0 -s 0 -m 1
+ */
+
+#define _GNU_SOURCE  // strcasestr
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IO_TIMEOUT_S 10
+#define RECV_BUF_SIZE 16384
+#define HEADER_MAX 4096
+
+typedef enum {
+    ROUTE_LIST,
+    ROUTE_DOWNLOAD,
+    ROUTE_SNAPSHOT,
+    ROUTE_STREAM,
+    ROUTE_COUNT,
+} route_t;
+
+static const char *const route_names[ROUTE_COUNT] = {
+    [ROUTE_LIST] = "list",
+    [ROUTE_DOWNLOAD] = "download",
+    [ROUTE_SNAPSHOT] = "snapshot",
+    [ROUTE_STREAM] = "stream",
+};
+
+/* A growing list of samples in microseconds */
+typedef struct {
+    int64_t *v;
+    size_t n;
+    size_t cap;
+} samples_t;
+
+typedef struct {
+    route_t route;
+    const char *path;
+    pthread_t thread;
+
+    samples_t latency;      // request round trips
+    samples_t age_wall;     // capture to arrival, by X-Timestamp
+    samples_t age_offset;   // arrival minus X-Capture-Us, an unknown clock offset apart
+
+    /* Stream clients */
+    uint64_t frames;
+    int64_t first_frame_us;
+    int64_t last_frame_us;
+
+    uint64_t bytes;
+    uint32_t errors;
+
+    /* TLS */
+    SSL_SESSION *session;       // last session the server gave out, offered on the next connection
+    samples_t handshake_full;
+    samples_t handshake_resumed;
+    uint32_t handshake_failures;
+} client_t;
+
+/* A connection with a read buffer in front of it */
+typedef struct {
+    int fd;
+    SSL *ssl;               // NULL for plain HTTP
+    char buf[RECV_BUF_SIZE];
+    size_t start;
+    size_t end;
+} conn_t;
+
+static struct {
+    const char *host;
+    int port;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    SSL_CTX *tls;           // NULL for plain HTTP
+    bool reconnect;
+    volatile bool stop;
+} bench = { .host = "127.0.0.1", .port = 8080 };
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t wall_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void samples_add(samples_t *s, int64_t us) {
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        int64_t *grown = realloc(s->v, cap * sizeof(int64_t));
+        if (!grown) {
+            return;
+        }
+        s->v = grown;
+        s->cap = cap;
+    }
+    s->v[s->n++] = us;
+}
+
+static void samples_append(samples_t *dst, const samples_t *src, int64_t bias) {
+    for (size_t i = 0; i < src->n; i++) {
+        samples_add(dst, src->v[i] - bias);
+    }
+}
+
+static int64_t samples_min(const samples_t *s) {
+    int64_t min = s->n ? s->v[0] : 0;
+    for (size_t i = 1; i < s->n; i++) {
+        min = s->v[i] < min ? s->v[i] : min;
+    }
+    return min;
+}
+
+static void samples_free(samples_t *s) {
+    free(s->v);
+    s->v = NULL;
+    s->n = s->cap = 0;
+}
+
+/* "X-Timestamp: <seconds>.<microseconds>" */
+static int64_t parse_timestamp(const char *value) {
+    char *end;
+    int64_t us = strtoll(value, &end, 10) * 1000000;
+    if (*end == '.') {
+        int64_t scale = 100000;
+        for (const char *p = end + 1; *p >= '0' && *p <= '9' && scale > 0; p++, scale /= 10) {
+            us += (*p - '0') * scale;
+        }
+    }
+    return us;
+}
+
+/* Record the age of a frame that just arrived, from its capture time headers */
+static void record_age(client_t *cl, int64_t wall_capture_us, int64_t capture_us) {
+    if (wall_capture_us > 0) {
+        samples_add(&cl->age_wall, wall_us() - wall_capture_us);
+    } else if (capture_us > 0) {
+        samples_add(&cl->age_offset, now_us() - capture_us);
+    }
+}
+
+/* Keeps the newest session of a client; TLS 1.3 tickets arrive after the handshake */
+static int save_session(SSL *ssl, SSL_SESSION *session) {
+    client_t *cl = SSL_get_app_data(ssl);
+    if (cl->session) {
+        SSL_SESSION_free(cl->session);
+    }
+    cl->session = session;
+    return 1;
+}
+
+static bool conn_handshake(conn_t *c, client_t *cl) {
+    c->ssl = SSL_new(bench.tls);
+    if (!c->ssl) {
+        return false;
+    }
+    SSL_set_fd(c->ssl, c->fd);
+    SSL_set_app_data(c->ssl, cl);
+    if (cl->session) {
+        SSL_set_session(c->ssl, cl->session);
+    }
+    int64_t start = now_us();
+    if (SSL_connect(c->ssl) != 1) {
+        cl->handshake_failures++;
+        return false;
+    }
+    samples_add(SSL_session_reused(c->ssl) ? &cl->handshake_resumed : &cl->handshake_full, now_us() - start);
+    return true;
+}
+
+static void conn_close(conn_t *c);
+
+static bool conn_open(conn_t *c, client_t *cl) {
+    c->start = c->end = 0;
+    c->ssl = NULL;
+    c->fd = socket(bench.addr.ss_family, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        return false;
+    }
+    struct timeval tv = { .tv_sec = IO_TIMEOUT_S };
+    int one = 1;
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&bench.addr, bench.addr_len) < 0 ||
+        (bench.tls && !conn_handshake(c, cl))) {
+        conn_close(c);
+        return false;
+    }
+    return true;
+}
+
+static void conn_close(conn_t *c) {
+    if (c->ssl) {
+        SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static bool conn_fill(conn_t *c) {
+    if (c->start == c->end) {
+        c->start = c->end = 0;
+    } else if (c->end == sizeof(c->buf)) {
+        memmove(c->buf, c->buf + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+    size_t space = sizeof(c->buf) - c->end;
+    ssize_t n = c->ssl ? SSL_read(c->ssl, c->buf + c->end, space) : recv(c->fd, c->buf + c->end, space, 0);
+    if (n <= 0) {
+        return false;
+    }
+    c->end += n;
+    return true;
+}
+
+/* Read one CRLF terminated line, without the terminator */
+static bool conn_read_line(conn_t *c, char *line, size_t size) {
+    for (;;) {
+        char *eol = memchr(c->buf + c->start, '\n', c->end - c->start);
+        if (eol) {
+            size_t len = eol - (c->buf + c->start);
+            if (len > 0 && eol[-1] == '\r') {
+                len--;
+            }
+            if (len >= size) {
+                return false;
+            }
+            memcpy(line, c->buf + c->start, len);
+            line[len] = '\0';
+            c->start = eol + 1 - c->buf;
+            return true;
+        }
+        if (c->end - c->start >= HEADER_MAX || !conn_fill(c)) {
+            return false;
+        }
+    }
+}
+
+/* A response body kept in memory */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} body_t;
+
+static void body_append(body_t *body, const char *data, size_t len) {
+    if (!body) {
+        return;
+    }
+    if (body->len + len + 1 > body->cap) {
+        size_t cap = (body->len + len + 1) * 2;
+        char *grown = realloc(body->buf, cap);
+        if (!grown) {
+            return;
+        }
+        body->buf = grown;
+        body->cap = cap;
+    }
+    memcpy(body->buf + body->len, data, len);
+    body->len += len;
+    body->buf[body->len] = '\0';
+}
+
+/* Consume len bytes of body, keeping them in body unless it is NULL */
+static bool conn_skip(conn_t *c, uint64_t len, uint64_t *bytes, body_t *body) {
+    while (len > 0) {
+        if (c->start == c->end && !conn_fill(c)) {
+            return false;
+        }
+        size_t n = c->end - c->start;
+        if (n > len) {
+            n = len;
+        }
+        body_append(body, c->buf + c->start, n);
+        c->start += n;
+        len -= n;
+        *bytes += n;
+    }
+    return true;
+}
+
+static bool send_get(conn_t *c, const char *path) {
+    char req[512];
+    int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, bench.host);
+    if (len < 0 || len >= (int)sizeof(req)) {
+        return false;
+    }
+    for (int sent = 0; sent < len;) {
+        ssize_t n = c->ssl ? SSL_write(c->ssl, req + sent, len - sent) : send(c->fd, req + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+typedef struct {
+    int status;
+    int64_t content_length;  // -1 when absent
+    bool chunked;
+    bool close;
+    int64_t wall_capture_us; // X-Timestamp, 0 when absent
+    int64_t capture_us;      // X-Capture-Us, 0 when absent
+} response_t;
+
+static bool read_response_head(conn_t *c, response_t *resp) {
+    char line[HEADER_MAX];
+    if (!conn_read_line(c, line, sizeof(line)) || sscanf(line, "HTTP/1.%*d %d", &resp->status) != 1) {
+        return false;
+    }
+    resp->content_length = -1;
+    resp->chunked = false;
+    resp->close = false;
+    resp->wall_capture_us = 0;
+    resp->capture_us = 0;
+    for (;;) {
+        if (!conn_read_line(c, line, sizeof(line))) {
+            return false;
+        }
+        if (!line[0]) {
+            return true;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            resp->content_length = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line, "chunked")) {
+            resp->chunked = true;
+        } else if (strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line, "close")) {
+            resp->close = true;
+        } else if (strncasecmp(line, "X-Timestamp:", 12) == 0) {
+            resp->wall_capture_us = parse_timestamp(line + 12);
+        } else if (strncasecmp(line, "X-Capture-Us:", 13) == 0) {
+            resp->capture_us = strtoll(line + 13, NULL, 10);
+        }
+    }
+}
+
+static bool read_response_body(conn_t *c, const response_t *resp, uint64_t *bytes, body_t *body) {
+    if (!resp->chunked) {
+        if (resp->content_length >= 0) {
+            return conn_skip(c, resp->content_length, bytes, body);
+        }
+        // Body runs to the end of the connection
+        while (conn_fill(c)) {
+            body_append(body, c->buf + c->start, c->end - c->start);
+            *bytes += c->end - c->start;
+            c->start = c->end;
+        }
+        return true;
+    }
+
+    char line[64];
+    for (;;) {
+        if (!conn_read_line(c, line, sizeof(line))) {
+            return false;
+        }
+        uint64_t len = strtoull(line, NULL, 16);
+        if (len == 0) {
+            // Trailers, then the blank line
+            do {
+                if (!conn_read_line(c, line, sizeof(line))) {
+                    return false;
+                }
+            } while (line[0]);
+            return true;
+        }
+        if (!conn_skip(c, len, bytes, body) || !conn_read_line(c, line, sizeof(line))) {
+            return false;
+        }
+    }
+}
+
+static void *request_client(void *arg) {
+    client_t *cl = arg;
+    conn_t *c = malloc(sizeof(conn_t));
+    if (!c) {
+        cl->errors++;
+        return NULL;
+    }
+    c->fd = -1;
+
+    while (!bench.stop) {
+        if (c->fd < 0 && !conn_open(c, cl)) {
+            cl->errors++;
+            usleep(100000);
+            continue;
+        }
+
+        int64_t start = now_us();
+        response_t resp;
+        if (!send_get(c, cl->path) || !read_response_head(c, &resp) || !read_response_body(c, &resp, &cl->bytes, NULL)) {
+            cl->errors++;
+            conn_close(c);
+            continue;
+        }
+        if (resp.status != 200) {
+            cl->errors++;
+        } else {
+            samples_add(&cl->latency, now_us() - start);
+            record_age(cl, resp.wall_capture_us, resp.capture_us);
+        }
+        if (bench.reconnect || resp.close || (!resp.chunked && resp.content_length < 0)) {
+            conn_close(c);
+        }
+    }
+
+    conn_close(c);
+    free(c);
+    return NULL;
+}
+
+/* Reads the multipart body of /image-stream, counting frames */
+static void *stream_client(void *arg) {
+    client_t *cl = arg;
+    conn_t *c = malloc(sizeof(conn_t));
+    if (!c) {
+        cl->errors++;
+        return NULL;
+    }
+    c->fd = -1;
+
+    while (!bench.stop) {
+        response_t resp;
+        if (!conn_open(c, cl)) {
+            cl->errors++;
+            usleep(100000);
+            continue;
+        }
+        if (!send_get(c, cl->path) || !read_response_head(c, &resp) || resp.status != 200) {
+            cl->errors++;
+            conn_close(c);
+            usleep(100000);
+            continue;
+        }
+
+        char line[HEADER_MAX];
+        int64_t part_len = -1, wall_capture_us = 0, capture_us = 0;
+        while (!bench.stop && conn_read_line(c, line, sizeof(line))) {
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                part_len = strtoll(line + 15, NULL, 10);
+            } else if (strncasecmp(line, "X-Timestamp:", 12) == 0) {
+                wall_capture_us = parse_timestamp(line + 12);
+            } else if (strncasecmp(line, "X-Capture-Us:", 13) == 0) {
+                capture_us = strtoll(line + 13, NULL, 10);
+            } else if (!line[0] && part_len >= 0) {
+                if (!conn_skip(c, part_len, &cl->bytes, NULL)) {
+                    break;
+                }
+                int64_t t = now_us();
+                if (!cl->frames) {
+                    cl->first_frame_us = t;
+                }
+                cl->last_frame_us = t;
+                cl->frames++;
+                record_age(cl, wall_capture_us, capture_us);
+                part_len = -1;
+                wall_capture_us = capture_us = 0;
+            }
+        }
+        if (!bench.stop) {
+            cl->errors++;
+        }
+        conn_close(c);
+    }
+
+    free(c);
+    return NULL;
+}
+
+static int compare_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const samples_t *sorted, double p) {
+    if (!sorted->n) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (sorted->n - 1) + 0.5);
+    return sorted->v[i] / 1000.0;
+}
+
+/* Writes "name":{p50, p90, p99, max} in milliseconds, sorting the samples */
+static void write_distribution(FILE *out, const char *name, samples_t *s) {
+    qsort(s->v, s->n, sizeof(int64_t), compare_i64);
+    fprintf(out, "\"%s\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}", name,
+            percentile_ms(s, 0.50), percentile_ms(s, 0.90), percentile_ms(s, 0.99), percentile_ms(s, 1.0));
+}
+
+/*
+ * Collects the frame ages of one client into ages. Without wall-clock
+ * times the offsets are made relative to the youngest frame.
+ *
+ * @return true if the ages are absolute.
+ */
+static bool collect_ages(const client_t *cl, samples_t *ages) {
+    if (cl->age_wall.n) {
+        samples_append(ages, &cl->age_wall, 0);
+        return true;
+    }
+    samples_append(ages, &cl->age_offset, samples_min(&cl->age_offset));
+    return false;
+}
+
+static void write_ages(FILE *out, samples_t *ages, bool absolute) {
+    if (!ages->n) {
+        return;
+    }
+    fputc(',', out);
+    write_distribution(out, "capture_age_ms", ages);
+    fprintf(out, ",\"clock\":\"%s\"", absolute ? "wall" : "relative");
+}
+
+static void write_request_route(FILE *out, route_t route, client_t *clients, size_t count, double elapsed_s) {
+    size_t nclients = 0;
+    uint64_t bytes = 0;
+    uint32_t errors = 0;
+    samples_t latency = { 0 }, ages = { 0 };
+    bool absolute = true;
+    for (size_t i = 0; i < count; i++) {
+        if (clients[i].route != route) {
+            continue;
+        }
+        samples_append(&latency, &clients[i].latency, 0);
+        absolute &= collect_ages(&clients[i], &ages);
+        bytes += clients[i].bytes;
+        errors += clients[i].errors;
+        nclients++;
+    }
+
+    fprintf(out, "\"%s\":{\"clients\":%zu,\"requests\":%zu,\"errors\":%u,\"req_per_s\":%.2f,\"bytes\":%llu,",
+            route_names[route], nclients, latency.n, errors, latency.n / elapsed_s, (unsigned long long)bytes);
+    write_distribution(out, "latency_ms", &latency);
+    write_ages(out, &ages, absolute);
+    fputc('}', out);
+    samples_free(&latency);
+    samples_free(&ages);
+}
+
+/*
+ * Reads the server's tls_handshake_duration_seconds buckets from /metrics
+ * and writes them as "le":count pairs.
+ */
+static void write_server_handshakes(FILE *out) {
+    client_t probe = { 0 };
+    conn_t *c = malloc(sizeof(conn_t));
+    body_t body = { 0 };
+    uint64_t bytes = 0;
+    response_t resp;
+    bool ok = c && conn_open(c, &probe) && send_get(c, "/metrics") && read_response_head(c, &resp) &&
+              resp.status == 200 && read_response_body(c, &resp, &bytes, &body) && body.buf;
+    if (c) {
+        conn_close(c);
+        free(c);
+    }
+    if (probe.session) {
+        SSL_SESSION_free(probe.session);
+    }
+    samples_free(&probe.handshake_full);
+    samples_free(&probe.handshake_resumed);
+    if (!ok) {
+        free(body.buf);
+        return;
+    }
+
+    static const char prefix[] = "tls_handshake_duration_seconds_bucket{le=\"";
+    fprintf(out, ",\"server_handshake_buckets\":{");
+    bool first = true;
+    for (char *line = strstr(body.buf, prefix); line; line = strstr(line + 1, prefix)) {
+        char le[16];
+        unsigned long long n;
+        if (sscanf(line + sizeof(prefix) - 1, "%15[^\"]\"} %llu", le, &n) == 2) {
+            fprintf(out, "%s\"%s\":%llu", first ? "" : ",", le, n);
+            first = false;
+        }
+    }
+    fputc('}', out);
+    free(body.buf);
+}
+
+static void write_tls_results(FILE *out, client_t *clients, size_t count) {
+    samples_t full = { 0 }, resumed = { 0 };
+    uint32_t failures = 0;
+    for (size_t i = 0; i < count; i++) {
+        samples_append(&full, &clients[i].handshake_full, 0);
+        samples_append(&resumed, &clients[i].handshake_resumed, 0);
+        failures += clients[i].handshake_failures;
+    }
+    fprintf(out, ",\"tls\":{\"handshakes\":%zu,\"resumed\":%zu,\"failures\":%u,",
+            full.n + resumed.n, resumed.n, failures);
+    write_distribution(out, "full_ms", &full);
+    fputc(',', out);
+    write_distribution(out, "resumed_ms", &resumed);
+    write_server_handshakes(out);
+    fputc('}', out);
+    samples_free(&full);
+    samples_free(&resumed);
+}
+
+static void write_results(FILE *out, client_t *clients, size_t count, double elapsed_s) {
+    fprintf(out, "{\"target\":\"%s:%d\",\"duration_s\":%.3f,\"routes\":{", bench.host, bench.port, elapsed_s);
+    write_request_route(out, ROUTE_LIST, clients, count, elapsed_s);
+    fputc(',', out);
+    write_request_route(out, ROUTE_DOWNLOAD, clients, count, elapsed_s);
+    fputc(',', out);
+    write_request_route(out, ROUTE_SNAPSHOT, clients, count, elapsed_s);
+    fprintf(out, "},\"streams\":[");
+
+    bool first = true, all_absolute = true;
+    double fps_min = 0, fps_sum = 0;
+    size_t streams = 0;
+    samples_t all_ages = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        client_t *cl = &clients[i];
+        if (cl->route != ROUTE_STREAM) {
+            continue;
+        }
+        double span_s = (cl->last_frame_us - cl->first_frame_us) / 1e6;
+        double fps = cl->frames > 1 && span_s > 0 ? (cl->frames - 1) / span_s : 0;
+        fprintf(out, "%s{\"frames\":%llu,\"fps\":%.2f,\"bytes\":%llu,\"errors\":%u", first ? "" : ",",
+                (unsigned long long)cl->frames, fps, (unsigned long long)cl->bytes, cl->errors);
+        samples_t ages = { 0 };
+        bool absolute = collect_ages(cl, &ages);
+        samples_append(&all_ages, &ages, 0);
+        all_absolute &= absolute;
+        write_ages(out, &ages, absolute);
+        samples_free(&ages);
+        fputc('}', out);
+        fps_min = streams == 0 || fps < fps_min ? fps : fps_min;
+        fps_sum += fps;
+        streams++;
+        first = false;
+    }
+    fprintf(out, "],\"stream_fps\":{\"min\":%.2f,\"mean\":%.2f}", fps_min, streams ? fps_sum / streams : 0.0);
+    if (all_ages.n) {
+        fprintf(out, ",\"stream_age\":{");
+        write_distribution(out, "capture_age_ms", &all_ages);
+        fprintf(out, ",\"clock\":\"%s\"}", all_absolute ? "wall" : "relative");
+    }
+    if (bench.tls) {
+        write_tls_results(out, clients, count);
+    }
+    fprintf(out, "}\n");
+    samples_free(&all_ages);
+}
+
+static bool resolve(const char *host, int port) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    char service[12];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return false;
+    }
+    memcpy(&bench.addr, res->ai_addr, res->ai_addrlen);
+    bench.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-H host] [-p port] [-t seconds] [-l clients] [-g clients] [-f path]"
+            " [-s clients] [-m clients] [-o file] [-T] [-C]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int duration_s = 10;
+    int counts[ROUTE_COUNT] = { [ROUTE_LIST] = 2, [ROUTE_DOWNLOAD] = 2, [ROUTE_SNAPSHOT] = 1, [ROUTE_STREAM] = 2 };
+    const char *paths[ROUTE_COUNT] = {
+        [ROUTE_LIST] = "/api/list?path=/",
+        [ROUTE_DOWNLOAD] = "/bench.bin",
+        [ROUTE_SNAPSHOT] = "/snapshot",
+        [ROUTE_STREAM] = "/image-stream",
+    };
+    const char *output = NULL;
+
+    static const struct option long_options[] = {
+        { "tls", no_argument, NULL, 'T' },
+        { 0 },
+    };
+    bool tls = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:t:l:g:f:s:m:o:TC", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'H': bench.host = optarg; break;
+        case 'p': bench.port = atoi(optarg); break;
+        case 't': duration_s = atoi(optarg); break;
+        case 'l': counts[ROUTE_LIST] = atoi(optarg); break;
+        case 'g': counts[ROUTE_DOWNLOAD] = atoi(optarg); break;
+        case 'f': paths[ROUTE_DOWNLOAD] = optarg; break;
+        case 's': counts[ROUTE_SNAPSHOT] = atoi(optarg); break;
+        case 'm': counts[ROUTE_STREAM] = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        case 'T': tls = true; break;
+        case 'C': bench.reconnect = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (duration_s <= 0 || bench.port <= 0) {
+        usage(argv[0]);
+    }
+    if (!resolve(bench.host, bench.port)) {
+        fprintf(stderr, "Cannot resolve %s\n", bench.host);
+        return 1;
+    }
+    // Writes to a connection the server closed fail with EPIPE instead of killing the run
+    signal(SIGPIPE, SIG_IGN);
+    if (tls) {
+        bench.tls = SSL_CTX_new(TLS_client_method());
+        if (!bench.tls) {
+            fprintf(stderr, "Cannot create TLS context\n");
+            return 1;
+        }
+        SSL_CTX_set_verify(bench.tls, SSL_VERIFY_NONE, NULL);
+        SSL_CTX_set_session_cache_mode(bench.tls, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(bench.tls, save_session);
+    }
+
+    size_t count = 0;
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        count += counts[r] > 0 ? counts[r] : 0;
+    }
+    client_t *clients = calloc(count ? count : 1, sizeof(client_t));
+    if (!clients) {
+        return 1;
+    }
+
+    size_t started = 0;
+    int64_t start = now_us();
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        for (int i = 0; i < counts[r]; i++) {
+            client_t *cl = &clients[started];
+            cl->route = r;
+            cl->path = paths[r];
+            if (pthread_create(&cl->thread, NULL, r == ROUTE_STREAM ? stream_client : request_client, cl) != 0) {
+                fprintf(stderr, "Failed to start client thread\n");
+                bench.stop = true;
+                break;
+            }
+            started++;
+        }
+    }
+
+    sleep(duration_s);
+    bench.stop = true;
+    double elapsed_s = (now_us() - start) / 1e6;
+    // Blocked reads end at the latest after IO_TIMEOUT_S
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Cannot open %s\n", output);
+        return 1;
+    }
+    write_results(out, clients, started, elapsed_s);
+    if (output) {
+        fclose(out);
+    }
+    for (size_t i = 0; i < started; i++) {
+        samples_free(&clients[i].latency);
+        samples_free(&clients[i].age_wall);
+        samples_free(&clients[i].age_offset);
+        samples_free(&clients[i].handshake_full);
+        samples_free(&clients[i].handshake_resumed);
+        if (clients[i].session) {
+            SSL_SESSION_free(clients[i].session);
+        }
+    }
+    free(clients);
+    if (bench.tls) {
+        SSL_CTX_free(bench.tls);
+    }
+    return 0;
+}
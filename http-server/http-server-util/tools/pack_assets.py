@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""Pack a directory of web assets into a C source file for http_server_assets.c.
+
+Every file becomes a flash-resident http_asset_t holding its URI path, MIME
+type, ETag and payload. The payload is gzip-compressed when that makes it
+smaller. Entries are placed with a hash-and-displace perfect hash, so a
+lookup at runtime costs two FNV-1a hashes and one string compare.
+
+usage: pack_assets.py <asset dir> <output .c>
+"""
+
+import gzip
+import hashlib
+import os
+import sys
+
+# Keep in sync with mime_types[] in http_server_util.c
+MIME_TYPES = {
+    "bin": "application/octet-stream",
+    "css": "text/css",
+    "csv": "text/csv",
+    "gif": "image/gif",
+    "gz": "application/gzip",
+    "htm": "text/html",
+    "html": "text/html",
+    "ico": "image/x-icon",
+    "jpeg": "image/jpeg",
+    "jpg": "image/jpeg",
+    "js": "text/javascript",
+    "json": "application/json",
+    "log": "text/plain",
+    "map": "application/json",
+    "mjs": "text/javascript",
+    "mp4": "video/mp4",
+    "pdf": "application/pdf",
+    "png": "image/png",
+    "svg": "image/svg+xml",
+    "txt": "text/plain",
+    "wasm": "application/wasm",
+    "wav": "audio/wav",
+    "webmanifest": "application/manifest+json",
+    "webp": "image/webp",
+    "woff": "font/woff",
+    "woff2": "font/woff2",
+    "xml": "application/xml",
+    "zip": "application/zip",
+}
+
+# Formats that are already compressed are stored as they are
+INCOMPRESSIBLE = {"gif", "gz", "jpeg", "jpg", "mp4", "png", "webp", "woff", "woff2", "zip"}
+
+
+def fnv1a(seed, data):
+    """Seeded FNV-1a, must match asset_hash() in http_server_assets.c."""
+    h = (0x811C9DC5 ^ seed) & 0xFFFFFFFF
+    for b in data:
+        h = ((h ^ b) * 0x01000193) & 0xFFFFFFFF
+    return h
+
+
+def build_perfect_hash(keys):
+    """Return (displacements, slot per key) such that every key gets its own slot.
+
+    Keys are grouped into buckets by fnv1a(0, key); the largest buckets are
+    placed first, each trying displacements until all of its keys land in
+    free slots of fnv1a(d, key) % n.
+    """
+    n = len(keys)
+    buckets = [[] for _ in range(n)]
+    for i, key in enumerate(keys):
+        buckets[fnv1a(0, key) % n].append(i)
+
+    displacements = [0] * n
+    slots = [None] * n
+    taken = [False] * n
+    for b in sorted(range(n), key=lambda b: -len(buckets[b])):
+        if not buckets[b]:
+            continue
+        d = 1
+        while True:
+            candidate = [fnv1a(d, keys[i]) % n for i in buckets[b]]
+            if len(set(candidate)) == len(candidate) and not any(taken[s] for s in candidate):
+                break
+            d += 1
+        displacements[b] = d
+        for i, s in zip(buckets[b], candidate):
+            slots[i] = s
+            taken[s] = True
+    return displacements, slots
+
+
+def c_bytes(data, indent="    "):
+    lines = []
+    for i in range(0, len(data), 16):
+        lines.append(indent + ", ".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+    return "\n".join(lines) if lines else indent + "0x00,"
+
+
+def c_string(s):
+    return '"' + s.replace("\\", "\\\\").replace('"', '\\"') + '"'
+
+
+def collect(asset_dir):
+    assets = []
+    for root, dirs, files in os.walk(asset_dir):
+        dirs.sort()
+        for name in sorted(files):
+            full = os.path.join(root, name)
+            uri = "/" + os.path.relpath(full, asset_dir).replace(os.sep, "/")
+            with open(full, "rb") as f:
+                data = f.read()
+            ext = name.rsplit(".", 1)[-1].lower() if "." in name else ""
+            payload, gzipped = data, False
+            if ext not in INCOMPRESSIBLE:
+                compressed = gzip.compress(data, compresslevel=9, mtime=0)
+                if len(compressed) < len(data):
+                    payload, gzipped = compressed, True
+            etag = '"%s"' % hashlib.sha1(data).hexdigest()[:16]
+            assets.append({
+                "uri": uri,
+                "mime": MIME_TYPES.get(ext, "text/plain"),
+                "etag": etag,
+                "payload": payload,
+                "gzip": gzipped,
+                "size": len(data),
+            })
+    return assets
+
+
+def generate(assets):
+    out = ["/* Generated by pack_assets.py, do not edit. */",
+           '#include "http_server_assets.h"',
+           ""]
+    keys = [a["uri"].encode() for a in assets]
+    if assets:
+        displacements, slots = build_perfect_hash(keys)
+    else:
+        displacements, slots = [0], []
+
+    for i, a in enumerate(assets):
+        out.append("/* %s, %d -> %d bytes */" % (a["uri"], a["size"], len(a["payload"])))
+        out.append("static const uint8_t asset_%d[] = {" % i)
+        out.append(c_bytes(a["payload"]))
+        out.append("};")
+        out.append("")
+
+    table = [None] * max(1, len(assets))
+    for i, a in enumerate(assets):
+        table[slots[i]] = (i, a)
+    out.append("const http_asset_t http_assets[] = {")
+    for entry in table:
+        if entry is None:
+            out.append("    { 0 },")
+            continue
+        i, a = entry
+        out.append("    { %s, %s, %s, asset_%d, %d, %s }," % (
+            c_string(a["uri"]), c_string(a["mime"]), c_string(a["etag"]), i,
+            len(a["payload"]), "true" if a["gzip"] else "false"))
+    out.append("};")
+    out.append("")
+    out.append("const uint32_t http_asset_displacements[] = {")
+    out.append("    " + ", ".join(str(d) for d in displacements) + ",")
+    out.append("};")
+    out.append("")
+    out.append("const size_t http_asset_count = %d;" % len(assets))
+    out.append("")
+    return "\n".join(out)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    asset_dir, output = sys.argv[1], sys.argv[2]
+    assets = collect(asset_dir) if os.path.isdir(asset_dir) else []
+    source = generate(assets)
+
+    # Leave an unchanged output alone so the component is not rebuilt
+    if os.path.exists(output):
+        with open(output) as f:
+            if f.read() == source:
+                return
+    with open(output, "w") as f:
+        f.write(source)
+
+    raw = sum(a["size"] for a in assets)
+    packed = sum(len(a["payload"]) for a in assets)
+    print("pack_assets: %d files, %d -> %d bytes" % (len(assets), raw, packed))
+
+
+if __name__ == "__main__":
+    main()
@@ -5,6 +5,8 @@
 #include <dirent.h>
 #include "stdbool.h"
 #include <limits.h>
+#include <sys/param.h>
+#include <sys/stat.h>
 
 #include "esp_log.h"
 
@@ -46,65 +48,225 @@ esp_err_t write_file(const char *path, const uint8_t *data, size_t bytes_to_writ
     return ESP_OK;
 }
 
-esp_err_t list_files(const char *path, bool include_dirs, bool recursive, struct dirent ***results, size_t *count) {
+/* Entries no listing shows: the directory links and FAT's system folder */
+static bool is_hidden_entry(const char *name) {
+    return strcmp(name, "System Volume Information") == 0 ||
+           strcmp(name, ".") == 0 ||
+           strcmp(name, "..") == 0;
+}
+
+/**
+ * @brief Make room in the list for one more entry with a path of name_len bytes.
+ *
+ * Entries and paths share one allocation: the entry array first, the paths
+ * behind it. Paths are addressed by offset, so growing only moves them.
+ */
+static esp_err_t file_list_reserve(file_list_t *list, size_t name_len) {
+    size_t entry_cap = list->entry_cap;
+    size_t names_cap = list->names_cap;
+    if (list->count == entry_cap) {
+        entry_cap = entry_cap ? entry_cap * 2 : 16;
+    }
+    while (list->names_len + name_len > names_cap) {
+        names_cap = names_cap ? names_cap * 2 : 256;
+    }
+    if (entry_cap == list->entry_cap && names_cap == list->names_cap) {
+        return ESP_OK;
+    }
+
+    char *arena = realloc(list->entries, entry_cap * sizeof(file_entry_t) + names_cap);
+    if (!arena) {
+        return ESP_ERR_NO_MEM;
+    }
+    char *names = arena + entry_cap * sizeof(file_entry_t);
+    memmove(names, arena + list->entry_cap * sizeof(file_entry_t), list->names_len);
+    list->entries = (file_entry_t *)arena;
+    list->names = names;
+    list->entry_cap = entry_cap;
+    list->names_cap = names_cap;
+    return ESP_OK;
+}
+
+static esp_err_t file_list_append(file_list_t *list, const char *name, const struct stat *st, uint8_t depth) {
+    size_t name_len = strlen(name) + 1;
+    if (file_list_reserve(list, name_len) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    file_entry_t *entry = &list->entries[list->count++];
+    entry->name_offset = list->names_len;
+    entry->type = S_ISDIR(st->st_mode) ? DT_DIR : DT_REG;
+    entry->depth = depth;
+    entry->size = S_ISDIR(st->st_mode) ? 0 : MIN(st->st_size, (off_t)UINT32_MAX);
+    entry->mtime = st->st_mtime;
+    memcpy(list->names + list->names_len, name, name_len);
+    list->names_len += name_len;
+    return ESP_OK;
+}
+
+/* Drop the directories once the walk no longer needs them */
+static void file_list_remove_dirs(file_list_t *list) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->entries[i].type != DT_DIR) {
+            list->entries[kept++] = list->entries[i];
+        }
+    }
+    list->count = kept;
+}
+
+esp_err_t list_files(const char *path, bool include_dirs, uint8_t max_depth, file_list_t *list) {
+    DIR *dirs[FILE_LIST_MAX_DEPTH + 1];
+    size_t path_lens[FILE_LIST_MAX_DEPTH + 1];
+    char full_path[FILE_LIST_PATH_MAX];
+    esp_err_t err = ESP_OK;
+
+    memset(list, 0, sizeof(*list));
+    if (max_depth > FILE_LIST_MAX_DEPTH) {
+        max_depth = FILE_LIST_MAX_DEPTH;
+    }
+
     ESP_LOGI(TAG, "Listing files in directory: %s", path);
-    DIR *dir = opendir(path);
-    if (!dir) {
+    if (strlcpy(full_path, path, sizeof(full_path)) >= sizeof(full_path)) {
+        ESP_LOGE(TAG, "Path too long: %s", path);
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t len = strlen(full_path);
+    while (len > 0 && full_path[len - 1] == '/') {
+        full_path[--len] = '\0';
+    }
+
+    int depth = 0;
+    path_lens[0] = len;
+    dirs[0] = opendir(len ? full_path : "/");
+    if (!dirs[0]) {
         ESP_LOGE(TAG, "Failed to open directory: %s", path);
         return ESP_FAIL;
     }
+    const size_t root_len = path_lens[0] + 1;
 
-    struct dirent *entry;
-    size_t num_entries = 0;
-    size_t max_entries = 10;
-    struct dirent **entries = malloc(max_entries * sizeof(struct dirent *));
-    if (!entries) {
-        closedir(dir);
-        return ESP_ERR_NO_MEM;
-    }
+    while (depth >= 0) {
+        struct dirent *entry = readdir(dirs[depth]);
+        if (!entry) {
+            closedir(dirs[depth--]);
+            continue;
+        }
+        if (is_hidden_entry(entry->d_name)) {
+            continue;
+        }
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (!include_dirs && entry->d_type == DT_DIR) {
+        const size_t base = path_lens[depth];
+        if (snprintf(full_path + base, sizeof(full_path) - base, "/%s", entry->d_name) >= (int)(sizeof(full_path) - base)) {
+            ESP_LOGW(TAG, "Skipping entry with too long a path: %s", entry->d_name);
             continue;
         }
 
-        if (strcmp(entry->d_name, "System Volume Information") == 0 ||
-            strcmp(entry->d_name, ".") == 0 || 
-            strcmp(entry->d_name, "..") == 0) 
-        { 
-            continue; 
+        struct stat st;
+        if (stat(full_path, &st) != 0) {
+            ESP_LOGW(TAG, "Failed to stat: %s", full_path);
+            continue;
+        }
+        err = file_list_append(list, full_path + root_len, &st, depth);
+        if (err != ESP_OK) {
+            break;
         }
 
-        if (num_entries >= max_entries) {
-            max_entries *= 2;
-            struct dirent **new_entries = realloc(entries, max_entries * sizeof(struct dirent *));
-            if (!new_entries) {
-                for (size_t i = 0; i < num_entries; i++) {
-                    free(entries[i]);
-                }
-                free(entries);
-                closedir(dir);
-                return ESP_ERR_NO_MEM;
+        if (S_ISDIR(st.st_mode) && depth < max_depth) {
+            DIR *sub = opendir(full_path);
+            if (!sub) {
+                ESP_LOGW(TAG, "Failed to open directory: %s", full_path);
+                continue;
             }
-            entries = new_entries;
+            dirs[++depth] = sub;
+            path_lens[depth] = strlen(full_path);
         }
+    }
 
-        entries[num_entries] = malloc(sizeof(struct dirent));
-        if (!entries[num_entries]) {
-            for (size_t i = 0; i < num_entries; i++) {
-                free(entries[i]);
-            }
-            free(entries);
-            closedir(dir);
-            return ESP_ERR_NO_MEM;
+    while (depth >= 0) {
+        closedir(dirs[depth--]);
+    }
+    if (err != ESP_OK) {
+        free_file_list(list);
+        return err;
+    }
+
+    if (!include_dirs) {
+        file_list_remove_dirs(list);
+    }
+    ESP_LOGI(TAG, "Listed %zu entries in directory: %s", list->count, path);
+    return ESP_OK;
+}
+
+void free_file_list(file_list_t *list) {
+    free(list->entries);
+    memset(list, 0, sizeof(*list));
+}
+
+esp_err_t file_iter_open(file_iter_t *it, const char *path, long cookie) {
+    memset(it, 0, sizeof(*it));
+    it->path_len = strlcpy(it->path, path, sizeof(it->path));
+    if (it->path_len >= sizeof(it->path)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    while (it->path_len > 0 && it->path[it->path_len - 1] == '/') {
+        it->path[--it->path_len] = '\0';
+    }
+
+    it->dir = opendir(it->path_len ? it->path : "/");
+    if (!it->dir) {
+        ESP_LOGE(TAG, "Failed to open directory: %s", path);
+        return ESP_FAIL;
+    }
+    if (cookie != FILE_ITER_START) {
+        seekdir(it->dir, cookie);
+    }
+    return ESP_OK;
+}
+
+esp_err_t file_iter_next(file_iter_t *it, const file_iter_entry_t **entry) {
+    struct dirent *de;
+    while ((de = readdir(it->dir)) != NULL) {
+        if (is_hidden_entry(de->d_name)) {
+            continue;
         }
-        memcpy(entries[num_entries], entry, sizeof(struct dirent));
-        num_entries++;
+
+        file_iter_entry_t *e = &it->entry;
+        e->name = de->d_name;
+        e->type = de->d_type == DT_DIR ? DT_DIR : DT_REG;
+        e->has_stat = false;
+        e->size = 0;
+        e->mtime = 0;
+        e->cookie = telldir(it->dir);
+        *entry = e;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t file_iter_stat(file_iter_t *it) {
+    file_iter_entry_t *e = &it->entry;
+    if (e->has_stat) {
+        return ESP_OK;
+    }
+
+    struct stat st;
+    size_t room = sizeof(it->path) - it->path_len;
+    int len = snprintf(it->path + it->path_len, room, "/%s", e->name);
+    int res = len < (int)room ? stat(it->path, &st) : -1;
+    it->path[it->path_len] = '\0';
+    if (res != 0) {
+        return ESP_FAIL;
     }
 
-    closedir(dir);
-    *results = entries;
-    *count = num_entries;
-    ESP_LOGI(TAG, "Listed %zu entries in directory: %s", num_entries, path);
+    e->type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+    e->has_stat = true;
+    e->size = S_ISDIR(st.st_mode) ? 0 : MIN(st.st_size, (off_t)UINT32_MAX);
+    e->mtime = st.st_mtime;
     return ESP_OK;
 }
+
+void file_iter_close(file_iter_t *it) {
+    if (it->dir) {
+        closedir(it->dir);
+        it->dir = NULL;
+    }
+}
@@ -2,12 +2,142 @@
 #define FILE_OPERATIONS_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <dirent.h>
+#include <time.h>
 #include "stdbool.h"
 #include "esp_err.h"
 
+#define FILE_LIST_MAX_DEPTH 8       // deepest subdirectory level list_files() descends to
+#define FILE_LIST_PATH_MAX 256      // longest path list_files() can visit
+
+/**
+ * @brief An entry found by list_files().
+ */
+typedef struct {
+    time_t mtime;           /*!< Last modification time */
+    uint32_t name_offset;   /*!< Offset of the entry's path in file_list_t.names */
+    uint32_t size;          /*!< Size in bytes, 0 for directories */
+    uint8_t type;           /*!< DT_REG or DT_DIR */
+    uint8_t depth;          /*!< 0 for entries of the listed directory itself */
+} file_entry_t;
+
+/**
+ * @brief The result of list_files(): entries and their paths in a single allocation.
+ */
+typedef struct {
+    file_entry_t *entries;  /*!< Entries in walk order, a directory before its contents */
+    size_t count;           /*!< Number of entries */
+    char *names;            /*!< NUL terminated paths relative to the listed directory */
+    size_t names_len;       /*!< Bytes of names in use */
+    size_t entry_cap;       /*!< Entries the allocation has room for */
+    size_t names_cap;       /*!< Bytes of names the allocation has room for */
+} file_list_t;
+
+/**
+ * @brief An entry produced by file_iter_next().
+ */
+typedef struct {
+    const char *name;       /*!< Entry name, valid until the next call */
+    uint8_t type;           /*!< DT_REG or DT_DIR */
+    bool has_stat;          /*!< size and mtime are set, see file_iter_stat() */
+    uint32_t size;          /*!< Size in bytes, 0 for directories */
+    time_t mtime;           /*!< Last modification time */
+    long cookie;            /*!< Resumes the listing after this entry when passed to file_iter_open() */
+} file_iter_entry_t;
+
+/**
+ * @brief A directory being read one entry at a time. Its size does not depend on the directory.
+ */
+typedef struct {
+    DIR *dir;
+    size_t path_len;
+    char path[FILE_LIST_PATH_MAX];  // the directory, then the current entry's path while it is stat()ed
+    file_iter_entry_t entry;
+} file_iter_t;
+
+#define FILE_ITER_START 0           // cookie for reading a directory from its first entry
+
 esp_err_t read_file(const char *path, char *buffer, size_t size);
 esp_err_t write_file(const char *path, const uint8_t *data, size_t bytes_to_write);
-esp_err_t list_files(const char *path, bool include_dirs, bool recursive, struct dirent ***results, size_t *count);
+
+/**
+ * @brief List a directory, optionally with its subdirectories.
+ *
+ * The tree is walked depth-first without recursion, holding one open
+ * directory per level. Subdirectories that cannot be opened are skipped.
+ *
+ * @param path The directory to list.
+ * @param include_dirs Whether directories appear in the result. They are descended into either way.
+ * @param max_depth Subdirectory levels to descend, 0 for the directory itself only. At most FILE_LIST_MAX_DEPTH.
+ * @param list Receives the entries. Free it with free_file_list().
+ * @return esp_err_t ESP_OK on success, ESP_FAIL if the directory cannot be opened, ESP_ERR_NO_MEM if there is not enough memory.
+ */
+esp_err_t list_files(const char *path, bool include_dirs, uint8_t max_depth, file_list_t *list);
+
+/**
+ * @brief Get the path of an entry, relative to the listed directory.
+ *
+ * @param list The list.
+ * @param index The entry index.
+ * @return const char* The path.
+ */
+static inline const char *file_list_name(const file_list_t *list, size_t index) {
+    return list->names + list->entries[index].name_offset;
+}
+
+/**
+ * @brief Start reading a directory one entry at a time.
+ *
+ * Unlike list_files(), nothing is collected: each entry is produced as
+ * readdir() returns it, so listing a directory of any size takes the same
+ * memory. Stop early by calling file_iter_close().
+ *
+ * A cookie is a telldir() position, restored with seekdir() on a new
+ * opendir(). POSIX only guarantees that for the same open directory, so
+ * cookies rely on the filesystem: FAT and SPIFFS count entries, and resuming
+ * re-reads the directory up to the cookie. Paging through a directory this
+ * way costs O(n^2) reads in total, and entries created or deleted between
+ * pages may shift others so that they are skipped or repeated.
+ *
+ * @param it The iterator to set up.
+ * @param path The directory.
+ * @param cookie FILE_ITER_START, or the cookie of the last entry already seen to resume after it.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_INVALID_ARG if the path is too long, ESP_FAIL if the directory cannot be opened.
+ */
+esp_err_t file_iter_open(file_iter_t *it, const char *path, long cookie);
+
+/**
+ * @brief Read the next entry.
+ *
+ * @param it The iterator.
+ * @param entry Receives the entry, valid until the next call.
+ * @return esp_err_t ESP_OK on success, ESP_ERR_NOT_FOUND when the directory is exhausted.
+ */
+esp_err_t file_iter_next(file_iter_t *it, const file_iter_entry_t **entry);
+
+/**
+ * @brief Fill in the size and mtime of the entry last returned by file_iter_next().
+ *
+ * Entries that are skipped never need to be stat()ed, which is the slow part of listing on FAT.
+ *
+ * @param it The iterator.
+ * @return esp_err_t ESP_OK on success, ESP_FAIL if the entry could not be stat()ed.
+ */
+esp_err_t file_iter_stat(file_iter_t *it);
+
+/**
+ * @brief Finish reading a directory.
+ *
+ * @param it The iterator.
+ */
+void file_iter_close(file_iter_t *it);
+
+/**
+ * @brief Free the result of list_files().
+ *
+ * @param list The list. It is left empty.
+ */
+void free_file_list(file_list_t *list);
 
 #endif // FILE_OPERATIONS_H